@@ -0,0 +1,341 @@
+/*
+ * In-process sampling agent: LD_PRELOAD=liblsstack-agent.so samples every
+ * thread with SIGPROF and writes raw program counters to a shared memory
+ * ring for lsstack64 -A to symbolize, without the process ever being stopped
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "agent.h"
+
+/* Each thread gets a timer on its own CPU clock that sends it SIGPROF, so
+   samples land in proportion to CPU time and on the thread that used it.
+   Threads are hooked through pthread_create; the timer is deleted by a
+   thread-specific data destructor when the thread exits.
+
+   The handler walks the frame pointer chain of the interrupted code the way
+   grok_thread_stack walks a stopped thread: the saved BP and return address
+   sit at BP and BP + 8, and a saved BP of 0 ends the chain. Memory of its own
+   stack can be read directly, but a bad BP must not fault, so each step has
+   to stay within the thread's stack and go up it.
+
+   The agent stays out of the way when anything fails: no ring, no sampling.
+   It logs nothing, as stderr belongs to the process. */
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define AGENT_TLS __attribute__((tls_model("initial-exec")))
+
+static agent_ring *ring = NULL;
+static uint64_t slot_mask = 0;
+static int period_ms = AGENT_DEFAULT_PERIOD_MS;
+static pthread_key_t timer_key;
+static char ring_name[64];
+
+static int (*real_pthread_create)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *) = NULL;
+
+/* Top of the thread's stack, for the walk; 0 until the thread is set up */
+static __thread uintptr_t stack_high AGENT_TLS = 0;
+
+/* Stack walk helper functions */
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int walk_own_stack(ucontext_t *context, uint64_t *pcs, int *truncated)
+{
+	uintptr_t bp = context->uc_mcontext.gregs[REG_RBP];
+	uintptr_t sp = context->uc_mcontext.gregs[REG_RSP];
+	int number_of_frames = 0;
+
+	pcs[number_of_frames++] = context->uc_mcontext.gregs[REG_RIP];
+	*truncated = 0;
+	while (bp >= sp && bp + 2 * sizeof(uintptr_t) <= stack_high && 0 == (bp & (sizeof(uintptr_t) - 1))) {
+		uintptr_t next_bp = ((uintptr_t*)bp)[0];
+		uintptr_t next_ip = ((uintptr_t*)bp)[1];
+		if (number_of_frames == AGENT_MAX_FRAMES) {
+			*truncated = 1;
+			break;
+		}
+		if (0 == next_ip) {
+			break;
+		}
+		pcs[number_of_frames++] = next_ip;
+		if (0 == next_bp || next_bp <= bp) {
+			break;
+		}
+		bp = next_bp;
+	}
+	return number_of_frames;
+}
+
+/* End of stack walk helper functions */
+
+static void sample_handler(int signal, siginfo_t *info, void *context)
+{
+	int saved_errno = errno;
+	agent_sample *slot = NULL;
+	uint64_t n;
+	int truncated = 0;
+
+	(void)signal;
+	(void)info;
+	if (NULL == ring || 0 == stack_high) {
+		errno = saved_errno;
+		return;
+	}
+	n = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	slot = &ring->slots[n & slot_mask];
+	__atomic_store_n(&slot->sequence, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->timestamp_ns = monotonic_ns();
+	slot->tid = syscall(SYS_gettid);
+	slot->number_of_frames = walk_own_stack((ucontext_t*)context, slot->pcs, &truncated);
+	if (truncated) {
+		__atomic_fetch_add(&ring->truncated, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&slot->sequence, 2 * n + 2, __ATOMIC_RELEASE);
+	errno = saved_errno;
+}
+
+/* Thread setup helper functions */
+
+/* The id is kept on the heap: the first timer of a process is usually 0, and
+   a NULL value would keep the destructor from running */
+static void delete_thread_timer(void *timer)
+{
+	timer_delete(*(timer_t*)timer);
+	free(timer);
+}
+
+/* Runs on the thread to be sampled */
+static void start_thread_sampling(void)
+{
+	struct sigevent event;
+	struct itimerspec interval;
+	pthread_attr_t attributes;
+	timer_t timer;
+	timer_t *stored = NULL;
+	void *low = NULL;
+	size_t size = 0;
+
+	if (NULL == ring) {
+		return;
+	}
+	if (0 == pthread_getattr_np(pthread_self(), &attributes)) {
+		if (0 == pthread_attr_getstack(&attributes, &low, &size)) {
+			stack_high = (uintptr_t)low + size;
+		}
+		pthread_attr_destroy(&attributes);
+	}
+	if (0 == stack_high) {
+		return;
+	}
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event.sigev_notify_thread_id = syscall(SYS_gettid);
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer)) {
+		return;
+	}
+	interval.it_interval.tv_sec = period_ms / 1000;
+	interval.it_interval.tv_nsec = (period_ms % 1000) * 1000000L;
+	interval.it_value = interval.it_interval;
+	stored = (timer_t*) malloc(sizeof(timer_t));
+	if (NULL == stored) {
+		timer_delete(timer);
+		return;
+	}
+	*stored = timer;
+	if (timer_settime(timer, 0, &interval, NULL) || pthread_setspecific(timer_key, stored)) {
+		delete_thread_timer(stored);
+	}
+}
+
+typedef struct _thread_start {
+	void *(*routine)(void *);
+	void *argument;
+} thread_start;
+
+static void *sampled_thread(void *argument)
+{
+	thread_start start = *(thread_start*)argument;
+	free(argument);
+	start_thread_sampling();
+	return start.routine(start.argument);
+}
+
+/* End of thread setup helper functions */
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attributes, void *(*routine)(void *), void *argument)
+{
+	thread_start *start = NULL;
+	int ret;
+
+	if (NULL == real_pthread_create) {
+		real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+		if (NULL == real_pthread_create) {
+			return EAGAIN;
+		}
+	}
+	if (NULL == ring) {
+		return real_pthread_create(thread, attributes, routine, argument);
+	}
+	start = (thread_start*) malloc(sizeof(thread_start));
+	if (NULL == start) {
+		return real_pthread_create(thread, attributes, routine, argument);
+	}
+	start->routine = routine;
+	start->argument = argument;
+	ret = real_pthread_create(thread, attributes, sampled_thread, start);
+	if (ret) {
+		free(start);
+	}
+	return ret;
+}
+
+/* Rings of processes that were killed, or left through _exit, stay behind;
+   clear those out before adding ours */
+static void remove_stale_rings(void)
+{
+	const char *prefix = AGENT_RING_PREFIX + 1;
+	DIR *dir = opendir("/dev/shm");
+	struct dirent *entry = NULL;
+
+	if (NULL == dir) {
+		return;
+	}
+	while (NULL != (entry = readdir(dir))) {
+		char name[sizeof(entry->d_name) + 1];
+		int pid;
+		if (strncmp(entry->d_name, prefix, strlen(prefix))) {
+			continue;
+		}
+		pid = atoi(entry->d_name + strlen(prefix));
+		if (pid <= 0 || 0 == kill(pid, 0) || ESRCH != errno) {
+			continue;
+		}
+		snprintf(name, sizeof(name), "/%s", entry->d_name);
+		shm_unlink(name);
+	}
+	closedir(dir);
+}
+
+static int open_ring(void)
+{
+	const char *value = NULL;
+	uint64_t slots = 1;
+	uint64_t wanted = AGENT_DEFAULT_SLOTS;
+	size_t size;
+	void *memory = NULL;
+	int fd;
+
+	value = getenv(AGENT_PERIOD_VARIABLE);
+	if (NULL != value && atoi(value) > 0) {
+		period_ms = atoi(value);
+	}
+	value = getenv(AGENT_SLOTS_VARIABLE);
+	if (NULL != value && atol(value) > 0) {
+		wanted = atol(value);
+	}
+	while (slots < wanted) {
+		slots *= 2;
+	}
+	size = sizeof(agent_ring) + slots * sizeof(agent_sample);
+
+	remove_stale_rings();
+	snprintf(ring_name, sizeof(ring_name), AGENT_RING_PREFIX "%d", getpid());
+	fd = shm_open(ring_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		return errno;
+	}
+	if (ftruncate(fd, size)) {
+		close(fd);
+		shm_unlink(ring_name);
+		return errno;
+	}
+	memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == memory) {
+		shm_unlink(ring_name);
+		return errno;
+	}
+	ring = (agent_ring*) memory;
+	ring->pid = getpid();
+	ring->period_ms = period_ms;
+	ring->number_of_slots = slots;
+	slot_mask = slots - 1;
+	/* Readers check the magic last */
+	__atomic_store_n(&ring->magic, AGENT_RING_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void stop_agent(void)
+{
+	if (NULL != ring && ring->pid == getpid()) {
+		shm_unlink(ring_name);
+	}
+}
+
+/* A forked child has no timers, and the ring belongs to the parent; its
+   threads and any program it executes set up their own */
+static void forget_ring(void)
+{
+	ring = NULL;
+}
+
+__attribute__((constructor))
+static void start_agent(void)
+{
+	struct sigaction action;
+
+	if (pthread_key_create(&timer_key, delete_thread_timer)) {
+		return;
+	}
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = sample_handler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, NULL)) {
+		return;
+	}
+	if (open_ring()) {
+		return;
+	}
+	pthread_atfork(NULL, NULL, forget_ring);
+	atexit(stop_agent);
+	start_thread_sampling();
+}
@@ -0,0 +1,61 @@
+/*
+ * Shared memory ring between the preloaded sampling agent (agent.c) and
+ * lsstack64 -A, which reads it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* The ring of process <pid> is the POSIX shared memory object
+   AGENT_RING_PREFIX "<pid>", i.e. /dev/shm/lsstack-agent.<pid> */
+#define AGENT_RING_PREFIX "/lsstack-agent."
+
+#define AGENT_RING_MAGIC 0x31676e6972736c00ULL /* "\0lsring1" */
+
+/* Deeper stacks keep their innermost frames */
+#define AGENT_MAX_FRAMES 62
+
+/* Environment of the agent: sampling period per thread of CPU time, and ring
+   size in samples (rounded up to a power of two) */
+#define AGENT_PERIOD_VARIABLE "LSSTACK_AGENT_PERIOD_MS"
+#define AGENT_SLOTS_VARIABLE "LSSTACK_AGENT_SLOTS"
+#define AGENT_DEFAULT_PERIOD_MS 10
+#define AGENT_DEFAULT_SLOTS 4096
+
+/* Writers are signal handlers on any thread, so nothing can lock. A writer
+   claims sample number n by adding one to head, and wraps its slot in a
+   sequence: 2n + 1 while writing, 2n + 2 once done. A reader after sample n
+   copies the slot if its sequence is 2n + 2 before and after the copy; a
+   larger one means the ring went round and the sample is lost, a smaller
+   one that it isn't written yet. */
+typedef struct _agent_sample {
+	uint64_t sequence;
+	uint64_t timestamp_ns; /* CLOCK_MONOTONIC */
+	int32_t tid;
+	int32_t number_of_frames;
+	uint64_t pcs[AGENT_MAX_FRAMES]; /* Innermost first */
+} agent_sample;
+
+typedef struct _agent_ring {
+	uint64_t magic;
+	int32_t pid;
+	int32_t period_ms;
+	uint64_t number_of_slots; /* A power of two */
+	uint64_t head; /* Samples claimed so far */
+	uint64_t truncated; /* Samples cut short at AGENT_MAX_FRAMES */
+	agent_sample slots[];
+} agent_ring;
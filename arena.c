@@ -0,0 +1,122 @@
+/*
+ * A simple region allocator: allocate many, free all at once
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+
+struct _arena_chunk {
+	arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+static arena_chunk *chunk_alloc(size_t size)
+{
+	arena_chunk *chunk = (arena_chunk*)malloc(sizeof(arena_chunk) + size);
+	if (NULL != chunk) {
+		chunk->next = NULL;
+		chunk->size = size;
+		chunk->used = 0;
+	}
+	return chunk;
+}
+
+void arena_init(arena *a, size_t chunk_size)
+{
+	a->first = NULL;
+	a->current = NULL;
+	a->chunk_size = chunk_size;
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+	arena_chunk *chunk = a->current;
+	void *ret = NULL;
+
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+	/* Move on to chunks left over from before the last reset */
+	while (NULL != chunk && chunk->size - chunk->used < size) {
+		chunk = chunk->next;
+		if (NULL != chunk) {
+			chunk->used = 0;
+		}
+	}
+
+	if (NULL == chunk) {
+		chunk = chunk_alloc(size > a->chunk_size ? size : a->chunk_size);
+		if (NULL == chunk) {
+			return NULL;
+		}
+		if (NULL == a->current) {
+			chunk->next = a->first;
+			a->first = chunk;
+		} else {
+			chunk->next = a->current->next;
+			a->current->next = chunk;
+		}
+	}
+
+	a->current = chunk;
+	ret = chunk->data + chunk->used;
+	chunk->used += size;
+	return ret;
+}
+
+void *arena_calloc(arena *a, size_t nmemb, size_t size)
+{
+	void *ret = arena_alloc(a, nmemb * size);
+	if (NULL != ret) {
+		memset(ret, 0, nmemb * size);
+	}
+	return ret;
+}
+
+char *arena_strdup(arena *a, const char *s)
+{
+	size_t length = strlen(s) + 1;
+	char *ret = (char*)arena_alloc(a, length);
+	if (NULL != ret) {
+		memcpy(ret, s, length);
+	}
+	return ret;
+}
+
+void arena_reset(arena *a)
+{
+	a->current = a->first;
+	if (NULL != a->current) {
+		a->current->used = 0;
+	}
+}
+
+void arena_free(arena *a)
+{
+	arena_chunk *chunk = a->first;
+	while (NULL != chunk) {
+		arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	a->first = NULL;
+	a->current = NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * A simple region allocator: allocate many, free all at once
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+typedef struct _arena_chunk arena_chunk;
+
+/* Chunks are kept across arena_reset(), so once an arena has grown to the
+   size of a typical snapshot it stops calling malloc altogether. */
+typedef struct _arena {
+	arena_chunk *first;
+	arena_chunk *current;
+	size_t chunk_size;
+} arena;
+
+void arena_init(arena *a, size_t chunk_size);
+void *arena_alloc(arena *a, size_t size);
+void *arena_calloc(arena *a, size_t nmemb, size_t size);
+char *arena_strdup(arena *a, const char *s);
+void arena_reset(arena *a);
+void arena_free(arena *a);
@@ -0,0 +1,355 @@
+/*
+ * Core file backend: target memory, registers and modules from an ELF core
+ * dump instead of a live process
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/procfs.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "lsstack.h"
+
+/* The core file is mapped whole and never copied: memory reads are a binary
+   search over the PT_LOAD segments and a memcpy out of the mapping. */
+
+typedef struct _core_thread {
+	int pid;
+	struct user_regs_struct regs;
+} core_thread;
+
+typedef struct _core_file {
+	char *image;
+	size_t size;
+	Elf64_Phdr *segments; /* PT_LOAD only, sorted by address */
+	int number_of_segments;
+	core_thread *threads; /* In note order, the thread that crashed first */
+	int number_of_threads;
+	int *thread_pids; /* Zero terminated, for process_info */
+	memory_map *files; /* From NT_FILE, offsets in bytes */
+	int number_of_files;
+	memory_map *maps; /* PT_LOAD segments, named from NT_FILE */
+} core_file;
+
+/* Core note helper functions */
+
+#define NOTE_ALIGN(x) (((x) + 3) & ~3UL)
+
+static int add_core_thread(core_file *core, const char *desc, size_t size)
+{
+	const struct elf_prstatus *status = (const struct elf_prstatus*)desc;
+	core_thread *threads = NULL;
+	if (size < sizeof(struct elf_prstatus)) {
+		return EINVAL;
+	}
+	threads = (core_thread*) realloc(core->threads, (core->number_of_threads + 1) * sizeof(core_thread));
+	if (NULL == threads) {
+		return ENOMEM;
+	}
+	core->threads = threads;
+	threads[core->number_of_threads].pid = status->pr_pid;
+	/* elf_gregset_t has the user_regs_struct layout on x86_64 */
+	memcpy(&threads[core->number_of_threads].regs, &status->pr_reg, sizeof(struct user_regs_struct));
+	core->number_of_threads++;
+	return 0;
+}
+
+/* NT_FILE: count, page size, count (start, end, page offset) triples and then
+   count NUL terminated names */
+static int grok_core_files(core_file *core, const char *desc, size_t size)
+{
+	const unsigned long *words = (const unsigned long*)desc;
+	const char *name = NULL;
+	unsigned long count, page_size, x;
+
+	if (size < 2 * sizeof(unsigned long)) {
+		return EINVAL;
+	}
+	count = words[0];
+	page_size = words[1];
+	if (size < (2 + 3 * count) * sizeof(unsigned long)) {
+		return EINVAL;
+	}
+	core->files = (memory_map*) calloc(count, sizeof(memory_map));
+	if (NULL == core->files) {
+		return ENOMEM;
+	}
+	name = (const char*)&words[2 + 3 * count];
+	for (x = 0; x < count && name < desc + size; x++) {
+		memory_map *file = &core->files[core->number_of_files++];
+		file->start = words[2 + 3 * x];
+		file->end = words[3 + 3 * x];
+		file->offset = words[4 + 3 * x] * page_size;
+		file->path = (char*)name;
+		name += strlen(name) + 1;
+	}
+	return 0;
+}
+
+static int grok_core_notes(core_file *core, Elf64_Phdr *note)
+{
+	size_t position = note->p_offset;
+	size_t end = note->p_offset + note->p_filesz;
+	int ret = 0;
+
+	if (end > core->size) {
+		return EINVAL;
+	}
+	while (!ret && position + sizeof(Elf64_Nhdr) <= end) {
+		Elf64_Nhdr *header = (Elf64_Nhdr*)(core->image + position);
+		const char *desc = core->image + position + sizeof(Elf64_Nhdr) + NOTE_ALIGN(header->n_namesz);
+		if (desc + header->n_descsz > core->image + end) {
+			break;
+		}
+		switch (header->n_type) {
+			case NT_PRSTATUS:
+				ret = add_core_thread(core, desc, header->n_descsz);
+				break;
+			case NT_FILE:
+				ret = grok_core_files(core, desc, header->n_descsz);
+				break;
+		}
+		position = desc - core->image + NOTE_ALIGN(header->n_descsz);
+	}
+	return ret;
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+	const Elf64_Phdr *x = (const Elf64_Phdr*)a;
+	const Elf64_Phdr *y = (const Elf64_Phdr*)b;
+	return (x->p_vaddr > y->p_vaddr) - (x->p_vaddr < y->p_vaddr);
+}
+
+/* Name each PT_LOAD segment after the NT_FILE entry it falls in */
+static int grok_core_maps(core_file *core)
+{
+	int x, y;
+	core->maps = (memory_map*) calloc(core->number_of_segments + 1, sizeof(memory_map));
+	if (NULL == core->maps) {
+		return ENOMEM;
+	}
+	for (x = 0; x < core->number_of_segments; x++) {
+		memory_map *map = &core->maps[x];
+		map->start = core->segments[x].p_vaddr;
+		map->end = core->segments[x].p_vaddr + core->segments[x].p_memsz;
+		map->executable = 0 != (core->segments[x].p_flags & PF_X);
+		map->path = "";
+		for (y = 0; y < core->number_of_files; y++) {
+			if (map->start >= core->files[y].start && map->start < core->files[y].end) {
+				map->path = core->files[y].path;
+				map->offset = core->files[y].offset + (map->start - core->files[y].start);
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+/* End of core note helper functions */
+
+/* Core target operations */
+
+static Elf64_Phdr *find_core_segment(core_file *core, TARGET_ADDRESS address)
+{
+	int low = 0;
+	int high = core->number_of_segments - 1;
+	while (low <= high) {
+		int middle = low + (high - low) / 2;
+		Elf64_Phdr *segment = &core->segments[middle];
+		if (address < segment->p_vaddr) {
+			high = middle - 1;
+		} else if (address >= segment->p_vaddr + segment->p_memsz) {
+			low = middle + 1;
+		} else {
+			return segment;
+		}
+	}
+	return NULL;
+}
+
+static int core_read_block(process_info *pi, char *value, size_t length, TARGET_ADDRESS address)
+{
+	core_file *core = (core_file*)pi->target;
+	Elf64_Phdr *segment = find_core_segment(core, address);
+	/* Pages the kernel didn't dump (e.g. unmodified file mappings) read as
+	   errors, the same as unmapped memory in a live process */
+	if (NULL == segment || address + length > segment->p_vaddr + segment->p_filesz) {
+		return EIO;
+	}
+	memcpy(value, core->image + segment->p_offset + (address - segment->p_vaddr), length);
+	return 0;
+}
+
+static int core_read_registers(process_info *pi, struct user_regs_struct *regs, int thepid)
+{
+	core_file *core = (core_file*)pi->target;
+	int x;
+	for (x = 0; x < core->number_of_threads; x++) {
+		if (core->threads[x].pid == thepid) {
+			*regs = core->threads[x].regs;
+			return 0;
+		}
+	}
+	return ESRCH;
+}
+
+static int core_grok_maps(process_info *pi)
+{
+	core_file *core = (core_file*)pi->target;
+	pi->maps = core->maps;
+	pi->number_of_maps = core->number_of_segments;
+	return 0;
+}
+
+static target_ops core_ops = {
+	core_read_block,
+	core_read_registers,
+	core_grok_maps,
+};
+
+/* End of core target operations */
+
+/* Map the core file and point pi at it. The first thread in the notes is the
+   one that received the fatal signal, and is reported as the initial thread. */
+int open_core_file(process_info *pi, const char *path)
+{
+	core_file *core = NULL;
+	Elf64_Ehdr *header = NULL;
+	struct stat st;
+	int fd = -1;
+	int ret = 0;
+	int x;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		ret = errno;
+		log(ERROR, "Failed to open core file %s: %s\n", path, strerror(ret));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return ret;
+	}
+	core = (core_file*) calloc(1, sizeof(core_file));
+	if (NULL == core) {
+		close(fd);
+		return ENOMEM;
+	}
+	core->size = st.st_size;
+	core->image = (char*) mmap(NULL, core->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == core->image) {
+		ret = errno;
+		log(ERROR, "Failed to map core file %s: %s\n", path, strerror(ret));
+		free(core);
+		return ret;
+	}
+	pi->target = core;
+
+	header = (Elf64_Ehdr*)core->image;
+	if (core->size < sizeof(Elf64_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG) ||
+		ELFCLASS64 != header->e_ident[EI_CLASS] || ET_CORE != header->e_type ||
+		header->e_phoff + header->e_phnum * sizeof(Elf64_Phdr) > core->size) {
+		log(ERROR, "%s is not a 64-bit ELF core file\n", path);
+		close_core_file(pi);
+		return EINVAL;
+	}
+	core->segments = (Elf64_Phdr*) calloc(header->e_phnum + 1, sizeof(Elf64_Phdr));
+	if (NULL == core->segments) {
+		close_core_file(pi);
+		return ENOMEM;
+	}
+	for (x = 0; x < header->e_phnum && !ret; x++) {
+		Elf64_Phdr *phdr = (Elf64_Phdr*)(core->image + header->e_phoff) + x;
+		if (PT_LOAD == phdr->p_type) {
+			/* The image is mapped read-only; clamp the copy */
+			Elf64_Phdr *segment = &core->segments[core->number_of_segments++];
+			*segment = *phdr;
+			if (segment->p_offset + segment->p_filesz > core->size) {
+				/* A truncated core; keep what is there */
+				log(DEBUG, "Segment at 0x%lx is truncated\n", segment->p_vaddr);
+				segment->p_filesz = segment->p_offset < core->size ? core->size - segment->p_offset : 0;
+			}
+		} else if (PT_NOTE == phdr->p_type) {
+			ret = grok_core_notes(core, phdr);
+		}
+	}
+	qsort(core->segments, core->number_of_segments, sizeof(Elf64_Phdr), compare_segments);
+	if (!ret && 0 == core->number_of_threads) {
+		log(ERROR, "No NT_PRSTATUS notes in %s\n", path);
+		ret = EINVAL;
+	}
+	if (!ret) {
+		ret = grok_core_maps(core);
+	}
+	if (!ret) {
+		core->thread_pids = (int*) calloc(core->number_of_threads + 1, sizeof(int));
+		if (NULL == core->thread_pids) {
+			ret = ENOMEM;
+		}
+	}
+	if (ret) {
+		close_core_file(pi);
+		return ret;
+	}
+	for (x = 0; x < core->number_of_threads; x++) {
+		core->thread_pids[x] = core->threads[x].pid;
+	}
+	pi->ops = &core_ops;
+	pi->pid = core->threads[0].pid;
+	pi->peek_pid = pi->pid;
+	pi->thread_pids = core->thread_pids;
+	pi->initial_thread_id = pi->pid;
+	pi->threads_present_flag = 1;
+	log(DEBUG, "Core file %s: %d threads, %d segments, %d files\n", path,
+		core->number_of_threads, core->number_of_segments, core->number_of_files);
+	return 0;
+}
+
+/* The files mapped at the time of the dump, for loading their symbols */
+int grok_core_files_mapped(process_info *pi, memory_map **files, int *number_of_files)
+{
+	core_file *core = (core_file*)pi->target;
+	*files = core->files;
+	*number_of_files = core->number_of_files;
+	return 0;
+}
+
+void close_core_file(process_info *pi)
+{
+	core_file *core = (core_file*)pi->target;
+	if (NULL == core) {
+		return;
+	}
+	munmap(core->image, core->size);
+	free(core->segments);
+	free(core->threads);
+	free(core->thread_pids);
+	free(core->files);
+	free(core->maps);
+	free(core);
+	pi->target = NULL;
+	pi->ops = NULL;
+	pi->maps = NULL;
+	pi->thread_pids = NULL;
+}
@@ -0,0 +1,323 @@
+/*
+ * Resident mode: keep module images and unwind strategies warm between
+ * dumps and take requests over a Unix domain socket
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "lsstack.h"
+#include "schedule.h"
+#include "output.h"
+
+/* Requests are a single line:
+
+     dump <pid>
+     profile <pid> <seconds>
+
+   The reply is the stacks a direct lsstack64 run would have printed, in the
+   daemon's -F format, streamed back on the same connection, which is closed
+   when the request is done. Requests are served one at a time: a target can
+   only be traced by one process anyway, and serving inline is what keeps the
+   caches warm. A client gets REQUEST_TIMEOUT seconds to send its request, so
+   that it can't hold up the others.
+ */
+
+#define MAXIMUM_REQUEST_LENGTH 256
+
+#define REQUEST_TIMEOUT 5
+
+/* Default interval between samples of a profile request */
+#define DEFAULT_PROFILE_PERIOD 100
+
+/* Socket helper functions */
+
+static int fill_socket_address(struct sockaddr_un *address, const char *path)
+{
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		log(ERROR, "Socket path too long: %s\n", path);
+		return ENAMETOOLONG;
+	}
+	strcpy(address->sun_path, path);
+	return 0;
+}
+
+static int write_all(int fd, const char *buffer, size_t length)
+{
+	while (length) {
+		ssize_t written = write(fd, buffer, length);
+		if (written < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return errno;
+		}
+		buffer += written;
+		length -= written;
+	}
+	return 0;
+}
+
+/* Read one newline terminated request, without the newline. A request cut
+   short by the timeout or an error is refused rather than served in part. */
+static int read_request(int fd, char *request, size_t size)
+{
+	struct timeval timeout = { REQUEST_TIMEOUT, 0 };
+	size_t length = 0;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) {
+		return errno;
+	}
+	while (length < size - 1) {
+		ssize_t got = read(fd, request + length, 1);
+		if (got < 0 && EINTR == errno) {
+			continue;
+		}
+		if (got < 0) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno) {
+				log(ERROR, "No request within %d seconds\n", REQUEST_TIMEOUT);
+				return ETIMEDOUT;
+			}
+			log(ERROR, "Failed to read a request: %s\n", strerror(errno));
+			return errno;
+		}
+		if (0 == got || '\n' == request[length]) {
+			break;
+		}
+		length++;
+	}
+	request[length] = '\0';
+	return length ? 0 : EINVAL;
+}
+
+/* Clear the way for the socket at path, which may be left from an earlier
+   run, without deleting anything that isn't a socket */
+static int remove_socket(const char *path)
+{
+	struct stat st;
+	if (lstat(path, &st)) {
+		return ENOENT == errno ? 0 : errno;
+	}
+	if (!S_ISSOCK(st.st_mode)) {
+		log(ERROR, "%s exists and is not a socket\n", path);
+		return EEXIST;
+	}
+	return unlink(path) ? errno : 0;
+}
+
+/* The socket's mode keeps other users out only for as long as nobody
+   changes it; check who is on the other end as well */
+static int is_owner(int fd)
+{
+	struct ucred peer;
+	socklen_t length = sizeof(peer);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length)) {
+		log(ERROR, "Failed to get the credentials of a client: %s\n", strerror(errno));
+		return 0;
+	}
+	if (peer.uid != geteuid()) {
+		log(ERROR, "Refusing a request from uid %d, pid %d\n", (int)peer.uid, (int)peer.pid);
+		return 0;
+	}
+	return 1;
+}
+
+/* End of socket helper functions */
+
+static long elapsed_ms(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int serve_request(char *request, int period, int jitter)
+{
+	char verb[16];
+	int pid = 0;
+	int seconds = 0;
+	int ret = 0;
+	int fields = sscanf(request, "%15s %d %d", verb, &pid, &seconds);
+
+	if (fields >= 2 && 0 == strcmp(verb, "dump") && pid > 0) {
+		log(DEBUG, "Dumping %d\n", pid);
+		ret = dump_process(pid);
+	} else if (3 == fields && 0 == strcmp(verb, "profile") && pid > 0 && seconds > 0) {
+		struct timespec start;
+		schedule s;
+		log(DEBUG, "Profiling %d for %d seconds\n", pid, seconds);
+		ret = start_schedule(&s, period ? period : DEFAULT_PROFILE_PERIOD, jitter);
+		if (ret) {
+			return ret;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			ret = dump_process(pid);
+			if (ret) {
+				break;
+			}
+			wait_for_deadline(&s);
+		} while (elapsed_ms(&start) < seconds * 1000L);
+		stop_schedule(&s);
+	} else {
+		log(ERROR, "Bad request: '%s'\n", request);
+		return EINVAL;
+	}
+	if (ret) {
+		log(ERROR, "Failed to dump process %d: %s\n", pid, strerror(ret));
+	}
+	return ret;
+}
+
+int serve_requests(const char *path, int period, int jitter)
+{
+	struct sockaddr_un address;
+	mode_t saved_umask;
+	int listener = -1;
+	int saved_stderr = -1;
+	int saved_stdout = -1;
+	int ret = 0;
+
+	ret = fill_socket_address(&address, path);
+	if (ret) {
+		return ret;
+	}
+	ret = remove_socket(path);
+	if (ret) {
+		return ret;
+	}
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		ret = errno;
+		log(ERROR, "Failed to create socket: %s\n", strerror(ret));
+		return ret;
+	}
+	/* Only the owner may ask us to ptrace things */
+	saved_umask = umask(077);
+	ret = bind(listener, (struct sockaddr*)&address, sizeof(address));
+	umask(saved_umask);
+	if (ret || listen(listener, 8)) {
+		ret = errno;
+		log(ERROR, "Failed to listen on %s: %s\n", path, strerror(ret));
+		close(listener);
+		return ret;
+	}
+	/* A client going away mid-dump must not take the daemon with it */
+	signal(SIGPIPE, SIG_IGN);
+	saved_stderr = dup(2);
+	saved_stdout = dup(1);
+	log(INFO, "Serving requests on %s\n", path);
+
+	for (;;) {
+		char request[MAXIMUM_REQUEST_LENGTH];
+		int client = accept(listener, NULL, NULL);
+		if (client < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			ret = errno;
+			log(ERROR, "Failed to accept a connection: %s\n", strerror(ret));
+			break;
+		}
+		if (!is_owner(client) || read_request(client, request, sizeof(request))) {
+			close(client);
+			continue;
+		}
+		/* Stacks go to the client on stdout. Diagnostics stay on the
+		   daemon's stderr, except in the legacy format, where the stacks
+		   are log lines themselves. */
+		fflush(stderr);
+		fflush(stdout);
+		if (OUTPUT_LEGACY == output_format) {
+			dup2(client, 2);
+		}
+		dup2(client, 1);
+		serve_request(request, period, jitter);
+		fflush(stderr);
+		fflush(stdout);
+		dup2(saved_stderr, 2);
+		dup2(saved_stdout, 1);
+		close(client);
+	}
+	close(saved_stderr);
+	close(saved_stdout);
+	close(listener);
+	remove_socket(path);
+	return ret;
+}
+
+int send_request(const char *path, char **words, int number_of_words)
+{
+	struct sockaddr_un address;
+	char request[MAXIMUM_REQUEST_LENGTH];
+	char buffer[4096];
+	size_t length = 0;
+	ssize_t got;
+	int server = -1;
+	int ret = 0;
+	int x;
+
+	ret = fill_socket_address(&address, path);
+	if (ret) {
+		return ret;
+	}
+	request[0] = '\0';
+	for (x = 0; x < number_of_words; x++) {
+		length += strlen(words[x]) + 1;
+		if (length >= sizeof(request)) {
+			log(ERROR, "Request too long\n");
+			return EINVAL;
+		}
+		strcat(request, words[x]);
+		strcat(request, x == number_of_words - 1 ? "\n" : " ");
+	}
+	server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server < 0 || connect(server, (struct sockaddr*)&address, sizeof(address))) {
+		ret = errno;
+		log(ERROR, "Failed to connect to %s: %s\n", path, strerror(ret));
+		if (server >= 0) {
+			close(server);
+		}
+		return ret;
+	}
+	ret = write_all(server, request, length);
+	shutdown(server, SHUT_WR);
+	while (!ret && (got = read(server, buffer, sizeof(buffer))) != 0) {
+		if (got < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			ret = errno;
+			break;
+		}
+		ret = write_all(1, buffer, got);
+	}
+	close(server);
+	return ret;
+}
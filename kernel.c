@@ -0,0 +1,172 @@
+/*
+ * Kernel side of a thread's stack: its state, wait channel and the kernel
+ * frames from /proc/<pid>/task/<tid>/stack
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include "log.h"
+#include "arena.h"
+#include "lsstack.h"
+
+/* A thread blocked in a system call shows nothing past the libc wrapper in
+   user space; what it waits for is in the kernel. The kernel frames are read
+   before the process is stopped, because once it is, every thread's kernel
+   stack ends in the ptrace stop. For a thread that stays blocked they match
+   the user frames walked a moment later; a running thread has none anyway.
+
+   The stack file takes CAP_SYS_ADMIN, and wchan shows 0 without access to
+   kernel symbols. Whatever can't be read is left out. */
+
+static arena kernel_arena;
+static int kernel_arena_ready = 0;
+
+static kernel_stack *kernel_stacks = NULL; /* Sorted by pid */
+static int number_of_kernel_stacks = 0;
+static int kernel_stacks_size = 0;
+
+/* Kernel stack helper functions */
+
+static int compare_kernel_stacks(const void *a, const void *b)
+{
+	return ((const kernel_stack*)a)->pid - ((const kernel_stack*)b)->pid;
+}
+
+static char *read_wchan(const char *file_name)
+{
+	char line[128];
+	FILE *fp = fopen(file_name, "r");
+	if (NULL == fp) {
+		return NULL;
+	}
+	if (NULL == fgets(line, sizeof(line), fp)) {
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	line[strcspn(line, "\n")] = '\0';
+	if ('\0' == line[0] || 0 == strcmp(line, "0")) {
+		return NULL;
+	}
+	return arena_strdup(&kernel_arena, line);
+}
+
+/* Lines are "[<0>] function+0x62/0xa0", innermost first */
+static void read_kernel_frames(kernel_stack *ks, const char *file_name)
+{
+	char line[256];
+	char *frames[MAX_KERNEL_FRAMES];
+	FILE *fp = fopen(file_name, "r");
+	if (NULL == fp) {
+		log(DEBUG, "Can't read %s: %s\n", file_name, strerror(errno));
+		return;
+	}
+	while (ks->number_of_frames < MAX_KERNEL_FRAMES && NULL != fgets(line, sizeof(line), fp)) {
+		char *name = strchr(line, ' ');
+		if (NULL == name) {
+			continue;
+		}
+		name++;
+		name[strcspn(name, "\n")] = '\0';
+		frames[ks->number_of_frames] = arena_strdup(&kernel_arena, name);
+		if (NULL == frames[ks->number_of_frames]) {
+			break;
+		}
+		ks->number_of_frames++;
+	}
+	fclose(fp);
+	if (ks->number_of_frames) {
+		ks->frames = (char**) arena_alloc(&kernel_arena, ks->number_of_frames * sizeof(char*));
+		if (NULL == ks->frames) {
+			ks->number_of_frames = 0;
+			return;
+		}
+		memcpy(ks->frames, frames, ks->number_of_frames * sizeof(char*));
+	}
+}
+
+/* End of kernel stack helper functions */
+
+/* Replace the kernel stacks of the last call with those of pid's threads */
+int grok_kernel_stacks(int pid)
+{
+	char task_dir_name[64];
+	DIR *task_dir = NULL;
+	struct dirent *entry = NULL;
+
+	if (!kernel_arena_ready) {
+		arena_init(&kernel_arena, 64 * 1024);
+		kernel_arena_ready = 1;
+	}
+	arena_reset(&kernel_arena);
+	number_of_kernel_stacks = 0;
+
+	sprintf(task_dir_name, "/proc/%d/task", pid);
+	task_dir = opendir(task_dir_name);
+	if (NULL == task_dir) {
+		return errno;
+	}
+	while (NULL != (entry = readdir(task_dir))) {
+		char file_name[96];
+		unsigned long ticks;
+		long threads;
+		kernel_stack *ks = NULL;
+		int thread_pid = atoi(entry->d_name);
+		if (thread_pid <= 0) {
+			continue;
+		}
+		if (number_of_kernel_stacks == kernel_stacks_size) {
+			int size = kernel_stacks_size ? kernel_stacks_size * 2 : 64;
+			kernel_stack *temp = (kernel_stack*) realloc(kernel_stacks, size * sizeof(kernel_stack));
+			if (NULL == temp) {
+				closedir(task_dir);
+				return ENOMEM;
+			}
+			kernel_stacks = temp;
+			kernel_stacks_size = size;
+		}
+		ks = &kernel_stacks[number_of_kernel_stacks];
+		memset(ks, 0, sizeof(*ks));
+		ks->pid = thread_pid;
+		sprintf(file_name, "%s/%d/stat", task_dir_name, thread_pid);
+		if (read_stat_file(file_name, &ks->state, &ticks, &threads)) {
+			/* Gone already */
+			continue;
+		}
+		sprintf(file_name, "%s/%d/wchan", task_dir_name, thread_pid);
+		ks->wchan = read_wchan(file_name);
+		sprintf(file_name, "%s/%d/stack", task_dir_name, thread_pid);
+		read_kernel_frames(ks, file_name);
+		number_of_kernel_stacks++;
+	}
+	closedir(task_dir);
+	qsort(kernel_stacks, number_of_kernel_stacks, sizeof(kernel_stack), compare_kernel_stacks);
+	return 0;
+}
+
+kernel_stack *find_kernel_stack(int thepid)
+{
+	kernel_stack key;
+	key.pid = thepid;
+	if (0 == number_of_kernel_stacks) {
+		return NULL;
+	}
+	return (kernel_stack*) bsearch(&key, kernel_stacks, number_of_kernel_stacks, sizeof(kernel_stack), compare_kernel_stacks);
+}
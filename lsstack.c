@@ -25,14 +25,12 @@
 /*
 	Todo: 
 	install signal handler so we detatch and free the target if someone interrupts us.
-	Figure out what we should be free()'ing at the end.
 	Implement file and line number identification.
 	Correctly handle the case where the target is expecting a signal as we attach to it.
 	Correctly handle relative paths (LD_LIBRARY_PATH) on shared objects.
  */
 
 #include <sys/types.h>
-#include <sys/utsname.h>
 #include <unistd.h>
 #include <linux/stddef.h>
 #include <stdlib.h>
@@ -51,11 +49,26 @@
 #include <stddef.h>
 #include <unistd.h> 
 #include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
 
 /* Header for 64-bit registers */
 #include <sys/reg.h>
 
 #include "log.h"
+#include "arena.h"
+#include "lsstack.h"
+#include "stats.h"
+#include "output.h"
+#include "schedule.h"
+#include "agent.h"
 
 #ifndef false
 #define false 0
@@ -66,34 +79,43 @@ int current_log_level = DEBUG;
 static int debug_option = 1;
 static int execute_option = 0;
 static int period_option = 0;
+static int jitter_option = 0;
+static int kernel_option = 0;
+static int frame_cache_option = 1;
+static int agent_option = 0;
+static int watermark_option = 0;
+static int futex_option = 0;
+static int stagger_option = 0;
+static int blocked_option = 0;
+static int snapshots_option = 0;
+static int top_option = 0;
+static int unwinder_option = UNWINDER_AUTO;
 
 static int wait_loops = 20;
 static int wait_time = 1;
 static const char* append_file = NULL;
+static const char* daemon_socket = NULL;
+static const char* client_socket = NULL;
+static const char* trigger_spec = NULL;
+static const char* core_path = NULL;
+static const char* record_path = NULL;
+static const char* replay_path = NULL;
 
-static int pointer_size = sizeof(void*); /* DBDB there has to be an official place to get this from */
-
-typedef Elf64_Addr TARGET_ADDRESS;
-
-struct _symbol_entry {
-	TARGET_ADDRESS value;
-	struct _symbol_entry *next;
-	char *name;
-};
+/* Everything that only lives for one snapshot (symbol strings, file names,
+   thread arrays) comes from snapshot_arena, which is reset after each dump.
+   The process' view of its modules comes from module_arena and goes away
+   with the process_info.
+ */
+static arena snapshot_arena;
+static arena module_arena;
 
-typedef struct _symbol_entry symbol_entry;
+/* Module images outlive any one process (see find_module_image) */
+static arena image_arena;
 
+/* A corrupt link map can loop, so don't walk it forever */
+#define MAX_LINK_MAP_ENTRIES 65536
 
-typedef struct _process_info {
-	int pid;
-	int threads_present_flag;
-	TARGET_ADDRESS link_map_head;
-	TARGET_ADDRESS link_map_current; /* Used to iterate through the link map */
-	symbol_entry *symbols;
-	int *thread_pids;
-	int initial_thread_id;
-	int manager_thread_id;
-} process_info;
+static int pointer_size = sizeof(void*); /* DBDB there has to be an official place to get this from */
 
 
 static void msleep(int msecs)
@@ -108,7 +130,7 @@ static int attach_target(int thepid)
 	int x;
 
 	log(DEBUG, "Attaching to the target process...\n");
-	ret = ptrace(PTRACE_ATTACH, thepid, NULL, NULL);
+	ret = counted_ptrace(PTRACE_ATTACH, thepid, NULL, NULL);
 
 	if (0 != ret && 0 != errno) {
 		ret = errno;	
@@ -149,7 +171,7 @@ static int attach_thread(int threadpid)
 	int waitstatus;
 
 	log(DEBUG, "Attaching to the target thread %d...\n", threadpid);
-	ret = ptrace(PTRACE_ATTACH, threadpid, NULL, NULL);
+	ret = counted_ptrace(PTRACE_ATTACH, threadpid, NULL, NULL);
 
 	if (0 != ret && 0 != errno) {
 		perror("ptrace(PTRACE_ATTACH)");
@@ -162,7 +184,7 @@ static int attach_thread(int threadpid)
 		}
 	}
 	
-	return errno;
+	return 0;
 }
 
 static int detatch_target(process_info *pi)
@@ -175,12 +197,12 @@ static int detatch_target(process_info *pi)
 		for (x = 1; (pi->thread_pids)[x];x++) {
 			thread_pid = (pi->thread_pids)[x];
 			log(DEBUG, "Detatching from thread %d\n", thread_pid);
-			ret = ptrace(PTRACE_CONT, thread_pid, 1, 0);
-			log(DEBUG, "ptrace(PTRACE_CONT) returned: %ld\n", ret);
+			ret = counted_ptrace(PTRACE_DETACH, thread_pid, 0, 0);
+			log(DEBUG, "ptrace(PTRACE_DETACH) returned: %ld\n", ret);
 		}
 	}
 	log(DEBUG, "Detaching from target...\n");
-	ret = ptrace(PTRACE_DETACH, pi->pid, 0, 0);
+	ret = counted_ptrace(PTRACE_DETACH, pi->pid, 0, 0);
 	log(DEBUG, "ptrace(PTRACE_DETACH) returned: %ld\n", ret);
 	return ret;
 }
@@ -190,89 +212,301 @@ process_info *pi_alloc(int pid)
 	process_info* ret = (process_info*)calloc(sizeof(process_info),1);
 	if (NULL != ret) {
 		ret->pid = pid;
+		ret->peek_pid = pid;
+		ret->mem_fd = -1;
 	}
 	return ret;
 }
 
 void pi_free(process_info *pi)
 {
+	arena_reset(&module_arena);
+	if (pi->mem_fd >= 0) {
+		close(pi->mem_fd);
+	}
 	free(pi);
 }
 
 /* Symbol table helper functions */
 
-void add_new_symbol(process_info *pi, symbol_entry *symbol)
+/* Module images are shared by every process that maps the same file. They
+   are keyed by device and inode, hold symbol values relative to the file's
+   link address, and are never modified once loaded; each process only adds
+   its own load bias through a process_module.
+ */
+
+static module_image *module_images = NULL;
+
+module_image *find_module_image(struct stat *st)
+{
+	module_image *image = NULL;
+	for (image = module_images; image; image = image->next) {
+		if (image->dev == st->st_dev && image->ino == st->st_ino) {
+			if (image->mtime == st->st_mtime && image->size == st->st_size) {
+				return image;
+			}
+			log(DEBUG, "%s changed on disk, reloading it\n", image->path);
+		}
+	}
+	return NULL;
+}
+
+int add_process_module(process_info *pi, module_image *image, TARGET_ADDRESS bias)
+{
+	process_module *module = NULL;
+	if (pi->number_of_modules == pi->modules_size) {
+		int size = pi->modules_size ? pi->modules_size * 2 : 32;
+		process_module *modules = (process_module*) arena_alloc(&module_arena, size * sizeof(process_module));
+		if (NULL == modules) {
+			log(ERROR, "Failed to allocate process modules\n");
+			return ENOMEM;
+		}
+		if (pi->number_of_modules) {
+			memcpy(modules, pi->modules, pi->number_of_modules * sizeof(process_module));
+		}
+		pi->modules = modules;
+		pi->modules_size = size;
+	}
+	module = &pi->modules[pi->number_of_modules++];
+	module->image = image;
+	module->bias = bias;
+	pi->module_ranges = NULL;
+	pi->number_of_module_ranges = 0;
+	return 0;
+}
+
+/* Where a file's PT_LOAD segments want to be: from the page its first one
+   starts in, so that the load bias is the difference to where that page was
+   found mapped, to the end of its last one */
+static int read_link_extent(const char *path, TARGET_ADDRESS *start, TARGET_ADDRESS *end)
+{
+	Elf64_Ehdr header;
+	Elf64_Phdr phdr;
+	int ret = ENOEXEC;
+	int fd = open(path, O_RDONLY);
+	int x;
+	if (fd < 0) {
+		return errno;
+	}
+	if (sizeof(header) == pread(fd, &header, sizeof(header), 0) && 0 == memcmp(header.e_ident, ELFMAG, SELFMAG)) {
+		for (x = 0; x < header.e_phnum; x++) {
+			if (sizeof(phdr) != pread(fd, &phdr, sizeof(phdr), header.e_phoff + x * sizeof(phdr))) {
+				break;
+			}
+			if (PT_LOAD != phdr.p_type) {
+				continue;
+			}
+			if (ret) {
+				*start = (phdr.p_vaddr - phdr.p_offset) & ~(TARGET_ADDRESS)(getpagesize() - 1);
+				ret = 0;
+			}
+			*end = phdr.p_vaddr + phdr.p_memsz;
+		}
+	}
+	close(fd);
+	return ret;
+}
+
+static int add_module_range(module_range **ranges, int *number, int *size, TARGET_ADDRESS start, TARGET_ADDRESS end, int module)
+{
+	if (*number && (*ranges)[*number - 1].module == module && (*ranges)[*number - 1].end == start) {
+		(*ranges)[*number - 1].end = end;
+		return 0;
+	}
+	if (*number == *size) {
+		int new_size = *size ? *size * 2 : 64;
+		module_range *temp = (module_range*) arena_alloc(&module_arena, new_size * sizeof(module_range));
+		if (NULL == temp) {
+			log(ERROR, "Failed to allocate module ranges\n");
+			return ENOMEM;
+		}
+		if (*number) {
+			memcpy(temp, *ranges, *number * sizeof(module_range));
+		}
+		*ranges = temp;
+		*size = new_size;
+	}
+	(*ranges)[*number].start = start;
+	(*ranges)[*number].end = end;
+	(*ranges)[*number].module = module;
+	(*number)++;
+	return 0;
+}
+
+static int compare_module_ranges(const void *a, const void *b)
+{
+	const module_range *x = (const module_range*)a;
+	const module_range *y = (const module_range*)b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+/* Where a module sits in the address space: its file's extent moved by its
+   bias, or for files we can't read (perf maps), its first to last symbol */
+static void get_module_extent(process_module *module, TARGET_ADDRESS *start, TARGET_ADDRESS *end)
 {
-	symbol_entry *temp = pi->symbols;
-	pi->symbols = symbol;
-	symbol->next = temp;
+	module_image *image = module->image;
+	if (image->link_end) {
+		*start = image->link_start + module->bias;
+		*end = image->link_end + module->bias;
+	} else if (image->number_of_symbols) {
+		*start = image->symbols[0].value + module->bias;
+		*end = image->symbols[image->number_of_symbols - 1].value + module->bias + 1;
+	} else {
+		*start = *end = 0;
+	}
 }
 
-int symbol_entry_from_asymbol(symbol_entry **outsym, asymbol *insym, TARGET_ADDRESS base_address)
+/* Index the address space by module, so that an address is only looked up
+   in the symbols of the module it belongs to. Each mapping goes to the first
+   module whose extent covers it, clipped to that extent; mappings of no
+   module (heap, stacks, code we have no symbols for) are in space. Without
+   the maps, the extents are used as they are. */
+int grok_module_ranges(process_info *pi)
 {
+	module_range *ranges = NULL;
+	int number = 0, size = 0;
+	TARGET_ADDRESS start, end;
 	int ret = 0;
-	int size = 0;
-	
-	size = sizeof(symbol_entry) + strlen(bfd_asymbol_name(insym)) + 1;
-	*outsym = (symbol_entry*) malloc(size);
-	if (NULL == *outsym) {
+	int x, y;
+
+	if (NULL != pi->module_ranges || 0 == pi->number_of_modules) {
+		return 0;
+	}
+	if (grok_memory_maps(pi) || 0 == pi->number_of_maps) {
+		for (y = 0; y < pi->number_of_modules && !ret; y++) {
+			get_module_extent(&pi->modules[y], &start, &end);
+			if (start < end) {
+				ret = add_module_range(&ranges, &number, &size, start, end, y);
+			}
+		}
+		if (number) {
+			qsort(ranges, number, sizeof(module_range), compare_module_ranges);
+		}
+	} else {
+		for (x = 0; x < pi->number_of_maps && !ret; x++) {
+			memory_map *map = &pi->maps[x];
+			for (y = 0; y < pi->number_of_modules; y++) {
+				get_module_extent(&pi->modules[y], &start, &end);
+				if (start < map->end && end > map->start) {
+					ret = add_module_range(&ranges, &number, &size,
+						start > map->start ? start : map->start, end < map->end ? end : map->end, y);
+					break;
+				}
+			}
+		}
+	}
+	if (ret) {
+		return ret;
+	}
+	log(DEBUG, "Indexed %d modules in %d address ranges\n", pi->number_of_modules, number);
+	pi->module_ranges = ranges;
+	pi->number_of_module_ranges = number;
+	return 0;
+}
+
+process_module *find_process_module(process_info *pi, TARGET_ADDRESS address)
+{
+	int low = 0;
+	int high;
+	if (grok_module_ranges(pi)) {
+		return NULL;
+	}
+	high = pi->number_of_module_ranges - 1;
+	while (low <= high) {
+		int middle = low + (high - low) / 2;
+		if (address < pi->module_ranges[middle].start) {
+			high = middle - 1;
+		} else if (address >= pi->module_ranges[middle].end) {
+			low = middle + 1;
+		} else {
+			return &pi->modules[pi->module_ranges[middle].module];
+		}
+	}
+	return NULL;
+}
+
+int symbol_entry_from_asymbol(symbol_entry *outsym, asymbol *insym)
+{
+	outsym->name = arena_strdup(&image_arena, bfd_asymbol_name(insym));
+	if (NULL == outsym->name) {
 		log(ERROR, "Failed to allocate space for symbol\n");
 		return ENOMEM;
 	}
-	(*outsym)->name = (char*)(*outsym) + sizeof(symbol_entry);
-	
-	(*outsym)->value = bfd_asymbol_value(insym) + base_address;
-	
-	strcpy( (*outsym)->name ,bfd_asymbol_name(insym));
-	
-	return ret;
+	outsym->value = bfd_asymbol_value(insym);
+	return 0;
+}
+
+static int compare_symbol_entries(const void *a, const void *b)
+{
+	const symbol_entry *x = (const symbol_entry*)a;
+	const symbol_entry *y = (const symbol_entry*)b;
+	return (x->value > y->value) - (x->value < y->value);
 }
 
 int get_symbol_address(TARGET_ADDRESS *address, process_info *pi, char *symbol)
 {
 	int found = 0;
-	symbol_entry *sym = NULL;
+	int x, y;
 	log(DEBUG, "Fetching address for symbol: %s\n", symbol);
-	for (sym = pi->symbols; sym; sym = sym->next) {
-		if (0 == strcmp(sym->name,symbol)) {
-			log(DEBUG, "Found symbol, value: 0x%lx\n", sym->value);
-			found = 1;
-			*address = sym->value;
+	for (x = 0; x < pi->number_of_modules; x++) {
+		module_image *image = pi->modules[x].image;
+		for (y = 0; y < image->number_of_symbols; y++) {
+			if (0 == strcmp(image->symbols[y].name,symbol)) {
+				*address = image->symbols[y].value + pi->modules[x].bias;
+				log(DEBUG, "Found symbol, value: 0x%lx\n", *address);
+				found = 1;
+			}
 		}
 	}
 	return found;
 }
 
-static int max_symbol_distance = 1024 * 256; /* Addresses more than 256K from a symbol are in space */
+/* The last symbol at or below address in a module's sorted table */
+symbol_entry *find_module_symbol(module_image *image, TARGET_ADDRESS address)
+{
+	int low = 0;
+	int high = image->number_of_symbols - 1;
+	symbol_entry *hit = NULL;
+	while (low <= high) {
+		int middle = low + (high - low) / 2;
+		if (image->symbols[middle].value <= address) {
+			hit = &image->symbols[middle];
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+	return hit;
+}
 
 int get_symbol_for_address(char** symbol, process_info *pi, TARGET_ADDRESS address, int include_difference)
 {
 	int ret = 0;
-	int distance = max_symbol_distance;
+	TARGET_ADDRESS distance = 0;
+	process_module *module = find_process_module(pi, address);
 	symbol_entry *hit = NULL;
-	symbol_entry *sym = NULL;
 	*symbol = NULL;
-	/* Dumb implementation---linear scan through the symbols */
-	for (sym = pi->symbols; sym; sym = sym->next) {		
-		int d = (address - sym->value);
-		if ( (d > 0) && (d < distance)) {
-			distance = d;
-			hit = sym;
+	if (NULL != module) {
+		hit = find_module_symbol(module->image, address - module->bias);
+		/* An empty name marks the end of a sized (JIT) symbol */
+		if (NULL != hit && !hit->name[0]) {
+			hit = NULL;
 		}
 	}
-	if (distance < max_symbol_distance) {
-		*symbol = malloc(strlen(hit->name) + 30);
+	if (NULL != hit) {
+		distance = address - module->bias - hit->value;
+		*symbol = arena_alloc(&snapshot_arena, strlen(hit->name) + 30);
 		if (NULL == *symbol) {
 			log(ERROR, "Failed to allocate symbol string\n");
 			return ENOMEM;
 		}
 		if (distance && include_difference) {
-			sprintf(*symbol,"%s + %d",hit->name,distance);
+			sprintf(*symbol,"%s + %ld",hit->name,distance);
 		} else {
 			sprintf(*symbol,"%s",hit->name);
 		}
 	} else {
-		*symbol = strdup("");
+		*symbol = arena_strdup(&snapshot_arena, "");
 		ret = -1;
 	}
 	return ret;
@@ -285,12 +519,21 @@ int get_symbol_for_address(char** symbol, process_info *pi, TARGET_ADDRESS addre
 TARGET_ADDRESS read_target_pointer(TARGET_ADDRESS *value, process_info *pi, TARGET_ADDRESS address)
 {
 	TARGET_ADDRESS ret = 0;
-	ret = ptrace(PTRACE_PEEKDATA, pi->pid, address, 0);
-	if (errno) {
-		ret = errno;
+	count_bytes_read(sizeof(*value));
+	if (pi->ops) {
+		ret = pi->ops->read_block(pi, (char*)value, sizeof(*value), address);
 	} else {
-		*value = (TARGET_ADDRESS) ret;
-		ret = 0;
+		errno = 0; /* PEEK requests return data, so errno is the only error indication */
+		ret = counted_ptrace(PTRACE_PEEKDATA, pi->peek_pid, address, 0);
+		if (errno) {
+			ret = errno;
+		} else {
+			*value = (TARGET_ADDRESS) ret;
+			ret = 0;
+		}
+	}
+	if (!ret) {
+		record_target_read((char*)value, sizeof(*value), address);
 	}
 	return ret;
 }
@@ -298,12 +541,21 @@ TARGET_ADDRESS read_target_pointer(TARGET_ADDRESS *value, process_info *pi, TARG
 TARGET_ADDRESS read_target_word(TARGET_ADDRESS *value, process_info *pi, TARGET_ADDRESS address)
 {
 	TARGET_ADDRESS ret = 0;
-	ret = ptrace(PTRACE_PEEKDATA, pi->pid, address, 0);
-	if (errno) {
-		ret = errno;
+	count_bytes_read(sizeof(*value));
+	if (pi->ops) {
+		ret = pi->ops->read_block(pi, (char*)value, sizeof(*value), address);
 	} else {
-		*value = ret;
-		ret = 0;
+		errno = 0;
+		ret = counted_ptrace(PTRACE_PEEKDATA, pi->peek_pid, address, 0);
+		if (errno) {
+			ret = errno;
+		} else {
+			*value = ret;
+			ret = 0;
+		}
+	}
+	if (!ret) {
+		record_target_read((char*)value, sizeof(*value), address);
 	}
 	return ret;
 }
@@ -311,7 +563,8 @@ TARGET_ADDRESS read_target_word(TARGET_ADDRESS *value, process_info *pi, TARGET_
 TARGET_ADDRESS read_target_userpointer(TARGET_ADDRESS *value, int thepid, TARGET_ADDRESS address)
 {
 	TARGET_ADDRESS ret = 0;
-	ret = ptrace(PTRACE_PEEKUSER, thepid, address, 0);
+	errno = 0;
+	ret = counted_ptrace(PTRACE_PEEKUSER, thepid, address, 0);
 	if (errno) {
 		ret = errno;
 	} else {
@@ -327,12 +580,35 @@ int read_target_byte(char *value, process_info *pi, TARGET_ADDRESS address)
 	/* Read a word at the target address, word aligned */
 	TARGET_ADDRESS aligned_address = address & ~(pointer_size - 1);
 	int byte = address - aligned_address;
-	ret = ptrace(PTRACE_PEEKDATA, pi->pid, aligned_address);
-	if (errno) {
-		ret = errno;
+	count_bytes_read(1);
+	if (pi->ops) {
+		ret = pi->ops->read_block(pi, value, 1, address);
 	} else {
-		*value = (ret >> (byte*8)) & 0xff; 
-		ret = 0;
+		errno = 0;
+		ret = counted_ptrace(PTRACE_PEEKDATA, pi->peek_pid, aligned_address, 0);
+		if (errno) {
+			ret = errno;
+		} else {
+			*value = (ret >> (byte*8)) & 0xff; 
+			ret = 0;
+		}
+	}
+	if (!ret) {
+		record_target_read(value, 1, address);
+	}
+	return ret;
+}
+
+int read_target_registers(struct user_regs_struct *regs, process_info *pi, int thepid)
+{
+	int ret = 0;
+	if (pi->ops) {
+		ret = pi->ops->read_registers(pi, regs, thepid);
+	} else if (counted_ptrace(PTRACE_GETREGS, thepid, NULL, regs) < 0) {
+		ret = errno;
+	}
+	if (!ret) {
+		record_target_registers(thepid, regs);
 	}
 	return ret;
 }
@@ -344,16 +620,138 @@ int read_target_memory(char *value, size_t length, process_info *pi, TARGET_ADDR
 	size_t offset = 0;
 	for (offset = 0; offset < length; offset++ ) {
 		ret = read_target_byte(value+offset, pi, address + offset);
-		if (errno) {
-			ret = errno;
+		if (ret) {
 			break;
-		} else {
-			ret = 0;
 		}
 	}
 	return ret; 
 }
 
+/* Bulk reads go through /proc/<pid>/mem, one syscall for the whole block
+   instead of a ptrace() per byte. If the file can't be opened we fall back to
+   read_target_memory.
+ */
+int read_target_block(char *value, size_t length, process_info *pi, TARGET_ADDRESS address)
+{
+	ssize_t count = 0;
+	int ret = 0;
+
+	if (pi->ops) {
+		count_bytes_read(length);
+		ret = pi->ops->read_block(pi, value, length, address);
+		if (!ret) {
+			record_target_read(value, length, address);
+		}
+		return ret;
+	}
+	if (-1 == pi->mem_fd) {
+		char file_name[64];
+		sprintf(file_name, "/proc/%d/mem", pi->pid);
+		pi->mem_fd = open(file_name, O_RDONLY);
+		if (pi->mem_fd < 0) {
+			log(DEBUG, "Failed to open %s: %s\n", file_name, strerror(errno));
+			pi->mem_fd = -2;
+		}
+	}
+	if (pi->mem_fd < 0) {
+		return read_target_memory(value, length, pi, address);
+	}
+	count = pread(pi->mem_fd, value, length, (off_t)address);
+	if (count < 0) {
+		return errno;
+	}
+	count_bytes_read(count);
+	if ((size_t)count != length) {
+		return EIO;
+	}
+	record_target_read(value, length, address);
+	return 0;
+}
+
+/* Read /proc/<pid>/maps. The kernel lists mappings sorted by address, which
+   find_memory_map relies on. */
+int grok_memory_maps(process_info *pi)
+{
+	char file_name[64];
+	char line[PATH_MAX + 128];
+	FILE *fp = NULL;
+	int maps_size = 0;
+
+	if (NULL != pi->maps) {
+		return 0;
+	}
+	if (pi->ops && pi->ops->grok_maps) {
+		return pi->ops->grok_maps(pi);
+	}
+	sprintf(file_name, "/proc/%d/maps", pi->pid);
+	fp = fopen(file_name, "r");
+	if (NULL == fp) {
+		int ret = errno;
+		log(ERROR, "Failed to open %s: %s\n", file_name, strerror(ret));
+		return ret;
+	}
+	while (NULL != fgets(line, sizeof(line), fp)) {
+		memory_map *map = NULL;
+		TARGET_ADDRESS start, end, offset;
+		char perms[8];
+		int path_offset = 0;
+		char *newline = NULL;
+
+		if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms, &offset, &path_offset) < 4) {
+			continue;
+		}
+		if (pi->number_of_maps == maps_size) {
+			int size = maps_size ? maps_size * 2 : 64;
+			memory_map *maps = (memory_map*) arena_alloc(&module_arena, size * sizeof(memory_map));
+			if (NULL == maps) {
+				log(ERROR, "Failed to allocate memory maps\n");
+				fclose(fp);
+				return ENOMEM;
+			}
+			if (pi->number_of_maps) {
+				memcpy(maps, pi->maps, pi->number_of_maps * sizeof(memory_map));
+			}
+			pi->maps = maps;
+			maps_size = size;
+		}
+		newline = strchr(line + path_offset, '\n');
+		if (NULL != newline) {
+			*newline = '\0';
+		}
+		map = &pi->maps[pi->number_of_maps++];
+		map->start = start;
+		map->end = end;
+		map->offset = offset;
+		map->executable = ('x' == perms[2]);
+		map->path = arena_strdup(&module_arena, line + path_offset);
+		if (NULL == map->path) {
+			fclose(fp);
+			return ENOMEM;
+		}
+	}
+	fclose(fp);
+	log(DEBUG, "Found %d mappings in %s\n", pi->number_of_maps, file_name);
+	record_memory_maps(pi);
+	return 0;
+}
+
+memory_map *find_memory_map(process_info *pi, TARGET_ADDRESS address)
+{
+	int low = 0;
+	int high = pi->number_of_maps - 1;
+	while (low <= high) {
+		int middle = low + (high - low) / 2;
+		if (address < pi->maps[middle].start) {
+			high = middle - 1;
+		} else if (address >= pi->maps[middle].end) {
+			low = middle + 1;
+		} else {
+			return &pi->maps[middle];
+		}
+	}
+	return NULL;
+}
+
 int read_target_string(char **value, process_info *pi, TARGET_ADDRESS address)
 {
 	int ret = 0;
@@ -374,7 +772,7 @@ int read_target_string(char **value, process_info *pi, TARGET_ADDRESS address)
 	} while (byte);
 	log(DEBUG, "read_target_string from address 0x%lx, length=%d\n", address, length);
 	/* Now allocate memory for the string and terminator */
-	*value = malloc(length + 1);
+	*value = arena_alloc(&snapshot_arena, length + 1);
 	if (NULL == *value) {
 		log(ERROR, "Failed to allocate string buffer in read_target_string\n");
 		return ENOMEM;
@@ -390,534 +788,3099 @@ int read_target_string(char **value, process_info *pi, TARGET_ADDRESS address)
 	return ret;
 }
 
-void grok_and_print_program_counter(TARGET_ADDRESS pc, process_info *pi)
+/* End of target memory read helper functions */
+
+/* Stack capture helper functions. Walking only records raw program counters
+   and arguments; symbols are resolved for the whole batch afterwards. */
+
+stack_frame *thread_stack_add_frame(thread_stack *ts)
 {
-	char *symbol = NULL;
-	int ret = 0;
-	/* Get the symbol for this address */
-	ret = get_symbol_for_address(&symbol,pi,pc,0);
-	if (ret) {
-		log(INFO, "0x%016lx \n", pc);
-	} else {	
-		log(INFO, "0x%016lx in %s \n", pc, symbol);
+	if (ts->number_of_frames == ts->frames_size) {
+		int size = ts->frames_size ? ts->frames_size * 2 : 32;
+		stack_frame *frames = (stack_frame*) arena_alloc(&snapshot_arena, size * sizeof(stack_frame));
+		if (NULL == frames) {
+			log(ERROR, "Failed to allocate stack frames\n");
+			return NULL;
+		}
+		if (ts->number_of_frames) {
+			memcpy(frames, ts->frames, ts->number_of_frames * sizeof(stack_frame));
+		}
+		ts->frames = frames;
+		ts->frames_size = size;
 	}
+	memset(&ts->frames[ts->number_of_frames], 0, sizeof(stack_frame));
+	return &ts->frames[ts->number_of_frames++];
 }
 
-/* We should get argument information from the debug data, but in the meantime we
-   have to make do with the frame pointers. The compiler seems to set the frame pointer
-   to 32-byte boundaries, so even when there is one argument, it looks like there are 6.
-   For now, let's set a maximum number of arguments we want to print.
- */
-
-static TARGET_ADDRESS maximum_number_of_arguments = 4;
-
-int grok_and_print_function_arguments(TARGET_ADDRESS previous_bp,TARGET_ADDRESS next_bp, process_info *pi)
+int grok_function_arguments(stack_frame *frame, TARGET_ADDRESS previous_bp, TARGET_ADDRESS next_bp, process_info *pi)
 {
 	TARGET_ADDRESS ret = 0;
 	TARGET_ADDRESS x = 0;
 	TARGET_ADDRESS number_of_arguments = ((next_bp - previous_bp) / pointer_size) - 2;
 	
 	log(DEBUG, "Found %ld arguments\n", number_of_arguments);
-	if (number_of_arguments > maximum_number_of_arguments) {
-		number_of_arguments = maximum_number_of_arguments;
-	}
-	log(INFO, "(\n");
-	for (x = 2; x < (number_of_arguments + 2); x++) {
-		TARGET_ADDRESS parameter = 0;
-		TARGET_ADDRESS argument_pointer = previous_bp + (pointer_size * x);
-		log(DEBUG, "Reading argument from address 0x%016lx:", argument_pointer);
-		ret = read_target_word(&parameter, pi, argument_pointer);
+	if (number_of_arguments > MAXIMUM_NUMBER_OF_ARGUMENTS) {
+		number_of_arguments = MAXIMUM_NUMBER_OF_ARGUMENTS;
+	}
+	for (x = 0; x < number_of_arguments; x++) {
+		TARGET_ADDRESS argument_pointer = previous_bp + (pointer_size * (x + 2));
+		log(DEBUG, "Reading argument from address 0x%016lx\n", argument_pointer);
+		ret = read_target_word(&frame->arguments[x], pi, argument_pointer);
 		if (ret) {
 			log(ERROR, "Failed to read parameter from target: %s\n", strerror(ret));
 			return ret;
-		} else {
-			log(INFO, "  0x%016lx\n", parameter);
 		}
+		frame->number_of_arguments++;
 	}
-	log(INFO, ")\n");
 	return ret;
 }
 
-TARGET_ADDRESS grok_and_print_thread_stack(process_info *pi, int thepid)
+/* Frame chain cache helper functions */
+
+/* The outer frames of a thread, from main through its event loop, rarely
+   change between samples, yet walking them again costs two reads per frame
+   plus the arguments. Each thread's last frame pointer chain is kept. When a
+   walk comes to a frame record at the same stack address, holding the same
+   saved BP and return address as in the last chain, the chain from there out
+   is the one walked before: the frames above a live frame can't change under
+   it. The rest is copied from the cache instead of read from the target.
+
+   Reused frames keep the argument words read when they were first walked. */
+
+typedef struct _frame_chain {
+	int pid;
+	int tid;
+	unsigned long last_used;
+	int reached_top;
+	int number_of_frames;
+	int frames_size;
+	stack_frame *frames; /* Innermost first, bp strictly increasing */
+} frame_chain;
+
+/* Chains of threads not walked for a while are dropped past this many */
+#define MAX_FRAME_CHAINS 4096
+
+static frame_chain *frame_chains = NULL; /* Sorted by tid */
+static int number_of_frame_chains = 0;
+static int frame_chains_size = 0;
+static unsigned long frame_chain_clock = 0;
+
+static int compare_frame_chains(const void *a, const void *b)
 {
-	TARGET_ADDRESS ret = 0;
-	TARGET_ADDRESS ip;
-	TARGET_ADDRESS bp;
-	TARGET_ADDRESS previous_bp;
-	TARGET_ADDRESS previous_ip;
-	log(DEBUG, "RIP: %d, RBP: %d, pi->pid: %d\n", RIP, RBP, pi->pid);
-	/* Get the IP and the BP */
-	ret = read_target_userpointer(&ip,thepid,RIP * pointer_size);
-	if (ret) {
-		log(DEBUG, "Failed to read RIP from target: %s\n", strerror(ret));
-			return ret;
-	} else {
-		log(DEBUG, "Read RIP: 0x%lx\n", ip);
+	return ((const frame_chain*)a)->tid - ((const frame_chain*)b)->tid;
+}
+
+/* A tid seen in another process before is a thread that has gone, and so
+   is the chain cached for it */
+static frame_chain *find_frame_chain(int pid, int tid)
+{
+	frame_chain key;
+	frame_chain *chain = NULL;
+	key.tid = tid;
+	if (0 == number_of_frame_chains) {
+		return NULL;
 	}
-	ret = read_target_userpointer(&bp,thepid,RBP * pointer_size);
-	if (ret) {
-		log(DEBUG, "Failed to read RBP from target: %s\n", strerror(ret));
-			return ret;
-	} else {
-		log(DEBUG, "Read RBP: 0x%lx\n", bp);
+	chain = (frame_chain*) bsearch(&key, frame_chains, number_of_frame_chains, sizeof(frame_chain), compare_frame_chains);
+	if (NULL != chain && chain->pid != pid) {
+		chain->pid = pid;
+		chain->number_of_frames = 0;
 	}
-	/* walk up the stack */
-	previous_bp = bp;
-	previous_ip = ip;
-	while (1) {
-		
-		TARGET_ADDRESS next_bp;
-		TARGET_ADDRESS next_ip;
-		
-		ret = read_target_pointer(&next_bp,pi,previous_bp);
-		if (ret) {
-			log(ERROR, "Failed to read next BP from target: errno: %ld (%s)\n", ret, strerror(ret));
-			return ret;
-		} else {
-			log(DEBUG, "Read next BP: 0x%lx\n", next_bp);
-		}
-		
-		ret = read_target_pointer(&next_ip,pi,previous_bp + pointer_size);
-		if (ret) {
-			log(ERROR, "Failed to read next IP from target: %s\n", strerror(ret));
-			return ret;
-		} else {
-			log(DEBUG, "Read next IP: 0x%lx\n", next_ip);
-		}
-		
-		grok_and_print_program_counter(previous_ip, pi);
-		
-		if (NULL == (void*)next_bp) {
-			log(DEBUG, "Reached the top of the stack\n");
-			log(INFO, "\n");
-			break;
-		} else {
-			ret = grok_and_print_function_arguments(previous_bp, next_bp, pi);
-			if (ret) {
-				return ret;
-			}
+	return chain;
+}
+
+/* Keep the most recently walked half */
+static void evict_frame_chains(void)
+{
+	unsigned long cutoff = frame_chain_clock - MAX_FRAME_CHAINS / 2;
+	int x, y;
+	for (x = 0, y = 0; x < number_of_frame_chains; x++) {
+		if (frame_chains[x].last_used < cutoff) {
+			free(frame_chains[x].frames);
+			continue;
 		}
-		
-		previous_bp = next_bp;
-		previous_ip = next_ip;
+		frame_chains[y++] = frame_chains[x];
 	}
-	return ret;
+	number_of_frame_chains = y;
 }
 
-int grok_and_print_stacks(process_info *pi)
+static frame_chain *add_frame_chain(int pid, int tid)
 {
-	int ret = 0;
-	if (pi->threads_present_flag) {
-		int thread_pid;
-		int x;
-		for (x = 0; (pi->thread_pids)[x] ; x++) {
-			char *thread_name = "";
-			thread_pid = (pi->thread_pids)[x];
-			if (thread_pid == pi->initial_thread_id) {
-				thread_name = " (initial thread)";
-			} else {
-				if (thread_pid == pi->manager_thread_id) {
-					thread_name = " (manager thread)";
-				}
-			}
-			log(INFO, "LWP %d%s:\n", thread_pid, thread_name);
-			ret = grok_and_print_thread_stack(pi,thread_pid);
-			if (ret) {
-				break;
+	frame_chain *chain = NULL;
+	int x;
+
+	if (number_of_frame_chains >= MAX_FRAME_CHAINS) {
+		evict_frame_chains();
+	}
+	if (number_of_frame_chains == frame_chains_size) {
+		int size = frame_chains_size ? frame_chains_size * 2 : 64;
+		frame_chain *temp = (frame_chain*) realloc(frame_chains, size * sizeof(frame_chain));
+		if (NULL == temp) {
+			return NULL;
+		}
+		frame_chains = temp;
+		frame_chains_size = size;
+	}
+	for (x = number_of_frame_chains; x > 0 && frame_chains[x - 1].tid > tid; x--);
+	memmove(&frame_chains[x + 1], &frame_chains[x], (number_of_frame_chains - x) * sizeof(frame_chain));
+	number_of_frame_chains++;
+	chain = &frame_chains[x];
+	memset(chain, 0, sizeof(*chain));
+	chain->pid = pid;
+	chain->tid = tid;
+	return chain;
+}
+
+/* Remember a thread's chain for the next walk. Only chains going strictly up
+   the stack are kept, so that their frame records can be searched. */
+static void store_frame_chain(int pid, thread_stack *ts)
+{
+	frame_chain *chain = find_frame_chain(pid, ts->pid);
+	int x;
+
+	for (x = 1; x < ts->number_of_frames; x++) {
+		if (ts->frames[x].bp <= ts->frames[x - 1].bp) {
+			if (NULL != chain) {
+				chain->number_of_frames = 0;
 			}
+			return;
 		}
-	} else {
-		ret = grok_and_print_thread_stack(pi,pi->pid);
 	}
-	return ret;
+	if (NULL == chain) {
+		chain = add_frame_chain(pid, ts->pid);
+		if (NULL == chain) {
+			return;
+		}
+	}
+	if (ts->number_of_frames > chain->frames_size) {
+		stack_frame *temp = (stack_frame*) realloc(chain->frames, ts->number_of_frames * sizeof(stack_frame));
+		if (NULL == temp) {
+			chain->number_of_frames = 0;
+			return;
+		}
+		chain->frames = temp;
+		chain->frames_size = ts->number_of_frames;
+	}
+	memcpy(chain->frames, ts->frames, ts->number_of_frames * sizeof(stack_frame));
+	chain->number_of_frames = ts->number_of_frames;
+	chain->reached_top = ts->reached_top;
+	chain->last_used = ++frame_chain_clock;
 }
 
-/* End of target memory read helper functions */
+static int compare_frame_bps(const void *a, const void *b)
+{
+	TARGET_ADDRESS x = ((const stack_frame*)a)->bp;
+	TARGET_ADDRESS y = ((const stack_frame*)b)->bp;
+	return (x > y) - (x < y);
+}
 
-int grok_threads(process_info *pi)
+/* If the frame record at bp, holding next_bp and next_ip, is where the cached
+   chain was, and so is the caller's record at next_bp, finish ts from the
+   cache and return 1. One record alone isn't enough: two callers with frames
+   of the same size leave the same record for a function they both call. */
+static int reuse_frame_chain(thread_stack *ts, stack_frame *frame, frame_chain *chain, process_info *pi, TARGET_ADDRESS next_bp, TARGET_ADDRESS next_ip)
 {
-	TARGET_ADDRESS ret = 0;
-	int thread_test_positive = 0;
-	TARGET_ADDRESS loops = 0;
-	
-	/* Magic interaction with the pthread library here, copied from GDB */
-	
-	static char* magic_names[] = {
-		"__pthread_threads_debug",
-		"__pthread_handles",
-		"__pthread_initial_thread",
-		"__pthread_manager_thread",
-		"__pthread_sizeof_handle",
-		"__pthread_offsetof_descr",
-		"__pthread_offsetof_pid",
-		"__pthread_handles_num",
-		NULL
-	};
-	
-	static TARGET_ADDRESS magic_addresses[9] = {0};
-		
-	thread_test_positive = 1;
-	for (loops = 0; NULL != magic_names[loops]; loops++) {
-		ret = get_symbol_address(&magic_addresses[loops],pi,magic_names[loops]);
-		if (!ret) {
-			/* Failed to find one */
-			thread_test_positive = 0;
-			log(DEBUG, "Failed to find thread symbol %s\n", magic_names[loops]);
+	stack_frame *cached = NULL;
+	TARGET_ADDRESS caller_bp;
+	TARGET_ADDRESS caller_ip;
+	int reused = 0;
+	int x;
+
+	cached = (stack_frame*) bsearch(frame, chain->frames, chain->number_of_frames, sizeof(stack_frame), compare_frame_bps);
+	if (NULL == cached) {
+		return 0;
+	}
+	x = cached - chain->frames;
+	if (x + 2 >= chain->number_of_frames || chain->frames[x + 1].bp != next_bp || chain->frames[x + 1].pc != next_ip) {
+		return 0;
+	}
+	if (read_target_pointer(&caller_bp, pi, next_bp) || read_target_pointer(&caller_ip, pi, next_bp + pointer_size) ||
+		chain->frames[x + 2].bp != caller_bp || chain->frames[x + 2].pc != caller_ip) {
+		return 0;
+	}
+	for (x++; x < chain->number_of_frames && ts->number_of_frames < MAX_STACK_DEPTH; x++) {
+		stack_frame *copy = thread_stack_add_frame(ts);
+		if (NULL == copy) {
 			break;
-		} else {
-			log(DEBUG, "Read thread symbol %s  -> 0x%lx\n", magic_names[loops], magic_addresses[loops]);
 		}
+		*copy = chain->frames[x];
+		reused++;
 	}
+	ts->reached_top = chain->reached_top && x == chain->number_of_frames;
+	log(DEBUG, "Reused %d outer frames of thread %d\n", reused, ts->pid);
+	count_reused_frames(reused);
+	return 1;
+}
 
-	
-	if (thread_test_positive) {
-		/* we think that we have threads */
-		TARGET_ADDRESS number_of_threads = 0;
-		int *thread_pid_array = NULL;
+/* End of frame chain cache helper functions */
+
+/* A process replaced its image (exec) under the same pid */
+static void forget_frame_chains(int pid)
+{
+	int x;
+	for (x = 0; x < number_of_frame_chains; x++) {
+		if (frame_chains[x].pid == pid) {
+			frame_chains[x].number_of_frames = 0;
+		}
+	}
+}
+
+TARGET_ADDRESS grok_thread_stack(thread_stack *ts, process_info *pi, int thepid)
+{
+	TARGET_ADDRESS ret = 0;
+	struct user_regs_struct regs;
+	TARGET_ADDRESS previous_bp;
+	TARGET_ADDRESS previous_ip;
+	TARGET_ADDRESS previous_sp;
+	frame_chain *chain = NULL;
+
+	ts->pid = thepid;
+	log(DEBUG, "pi->pid: %d\n", pi->pid);
+	if (frame_cache_option) {
+		chain = find_frame_chain(pi->pid, thepid);
+	}
+	/* Get the IP, SP and BP */
+	ret = read_target_registers(&regs, pi, thepid);
+	if (ret) {
+		log(DEBUG, "Failed to read registers from target: %s\n", strerror(ret));
+			return ret;
+	} else {
+		log(DEBUG, "Read RIP: 0x%llx, RSP: 0x%llx, RBP: 0x%llx\n", regs.rip, regs.rsp, regs.rbp);
+	}
+	/* walk up the stack */
+	previous_bp = regs.rbp;
+	previous_ip = regs.rip;
+	previous_sp = regs.rsp;
+	while (ts->number_of_frames < MAX_STACK_DEPTH) {
 		
-		TARGET_ADDRESS handle_array = magic_addresses[1];
-		TARGET_ADDRESS pid_offset = 0;
-		TARGET_ADDRESS descriptor_offset = 0;
-		TARGET_ADDRESS handle_size = 0;
-		TARGET_ADDRESS initial_thread_descriptor, manager_thread_descriptor;
+		TARGET_ADDRESS next_bp;
+		TARGET_ADDRESS next_ip;
+		stack_frame *frame;
 		
-		/* How many ? */
-		ret = read_target_word(&number_of_threads,pi,magic_addresses[7]);
-		if (ret) {
-			log(ERROR, "Failed to read number of threads from target: %s\n", strerror(ret));
-			return ret;
-		} else {
-			log(DEBUG, "Found %ld threads\n", number_of_threads);
-		}
-				
-		thread_pid_array = (int*) calloc(number_of_threads + 1, sizeof(int));
-		if (NULL == thread_pid_array) {
-			log(ERROR, "Failed to allocate thread pid array\n");
+		/* The current IP is good even if its frame record turns out not to be */
+		frame = thread_stack_add_frame(ts);
+		if (NULL == frame) {
 			return ENOMEM;
 		}
+		frame->pc = previous_ip;
+		frame->sp = previous_sp;
+		frame->bp = previous_bp;
+		frame->number_of_arguments = -1;
 		
-		ret = read_target_pointer(&initial_thread_descriptor,pi,magic_addresses[2]);
-		if (ret) {
-			log(ERROR, "Failed to read initial thread descriptor from target: %s\n", strerror(ret));
-			return ret;
-		} else {
-			log(DEBUG, "Initial thread descriptor: 0x%08lx\n", initial_thread_descriptor);
-		}
-		ret = read_target_pointer(&manager_thread_descriptor,pi,magic_addresses[3]);
-		if (ret) {
-			log(ERROR, "Failed to read manager thread descriptor from target: %s\n", strerror(ret));
-			return ret;
-		} else {
-			log(DEBUG, "Manager thread descriptor: 0x%08lx\n", manager_thread_descriptor);
-		}
-		ret = read_target_word(&handle_size,pi,magic_addresses[4]);
-		if (ret) {
-			log(ERROR, "Failed to read handle size from target: %s\n", strerror(ret));
-			return ret;
-		} else {
-			log(DEBUG, "Handle Size: %ld\n", handle_size);
-		}
-		ret = read_target_word(&pid_offset,pi,magic_addresses[6]);
+		ret = read_target_pointer(&next_bp,pi,previous_bp);
 		if (ret) {
-			log(ERROR, "Failed to read pid offset from target: %s\n", strerror(ret));
+			log(ERROR, "Failed to read next BP from target: errno: %ld (%s)\n", ret, strerror(ret));
 			return ret;
 		} else {
-			log(DEBUG, "Pid offset: %ld\n", pid_offset);
+			log(DEBUG, "Read next BP: 0x%lx\n", next_bp);
 		}
-		ret = read_target_word(&descriptor_offset,pi,magic_addresses[5]);
+		
+		ret = read_target_pointer(&next_ip,pi,previous_bp + pointer_size);
 		if (ret) {
-			log(ERROR, "Failed to read descriptor offset from target: %s\n", strerror(ret));
+			log(ERROR, "Failed to read next IP from target: %s\n", strerror(ret));
 			return ret;
 		} else {
-			log(DEBUG, "Descriptor offset: %ld\n", descriptor_offset);
+			log(DEBUG, "Read next IP: 0x%lx\n", next_ip);
 		}
-
-		/* Fill in the pid array, attaching as we go */
 		
-		for (loops = 0; loops < number_of_threads; loops++) {
-			TARGET_ADDRESS descriptor_address;
-			TARGET_ADDRESS thread_pid = 0;
-			ret = read_target_pointer(&descriptor_address,pi,handle_array + descriptor_offset + (handle_size * loops));
-			if (ret) {
-				log(ERROR, "Failed to read descriptor address from target: %s\n", strerror(ret));
-				return ret;
-			} else {
-				log(DEBUG, "Descriptor Address: 0x%lx\n", descriptor_address);
-			}
-			ret = read_target_word(&thread_pid,pi,descriptor_address + pid_offset);
+		if (NULL == (void*)next_bp) {
+			log(DEBUG, "Reached the top of the stack\n");
+			ts->reached_top = 1;
+			break;
+		} else {
+			frame->number_of_arguments = 0;
+			ret = grok_function_arguments(frame, previous_bp, next_bp, pi);
 			if (ret) {
-				log(ERROR, "Failed to read thread pid from target: %s\n", strerror(ret));
 				return ret;
-			} else {
-				log(DEBUG, "Thread PID: %ld\n", thread_pid);
-			}
-			
-			if (descriptor_address == initial_thread_descriptor) {
-				pi->initial_thread_id = thread_pid;
-			} else {
-				if (descriptor_address == manager_thread_descriptor) {
-					pi->manager_thread_id = thread_pid;
-				}
-			}
-			
-			if ((int)thread_pid != pi->pid) {
-				ret = attach_thread(thread_pid);
-				if (ret) {
-					log(ERROR, "Failed to attach to target thread %ld : %s\n", thread_pid, strerror(ret));
-					return ret;
-				}
 			}
-			
-			thread_pid_array[loops] = thread_pid;
+		}
+
+		if (NULL != chain && chain->number_of_frames && reuse_frame_chain(ts, frame, chain, pi, next_bp, next_ip)) {
+			break;
 		}
 		
-		pi->thread_pids = thread_pid_array;
-		pi->threads_present_flag = 1;
+		/* The caller's stack pointer is just above the saved BP and return address */
+		previous_sp = previous_bp + 2 * pointer_size;
+		previous_bp = next_bp;
+		previous_ip = next_ip;
+	}
+	if (frame_cache_option && !ret) {
+		store_frame_chain(pi->pid, ts);
 	}
-	
 	return ret;
 }
 
-int process_symbol(process_info *pi, asymbol *sym, TARGET_ADDRESS base_address)
+/* Capture the stacks of all threads. A thread whose walk fails keeps the
+   frames found so far, and we go on with the next one. */
+int grok_stacks(thread_stack **stacks, int *number_of_stacks, process_info *pi)
 {
 	int ret = 0;
-	symbol_entry *outsym = NULL;
-	log(DEBUG, "Groking symbol: %s -> 0x%lx\n", bfd_asymbol_name(sym), bfd_asymbol_value(sym) + base_address);
-	ret = symbol_entry_from_asymbol(&outsym,sym, base_address);
-	if (!ret) {
-		add_new_symbol(pi,outsym);
+	int single_thread[2] = { pi->pid, 0 };
+	int *thread_pids = pi->threads_present_flag ? pi->thread_pids : single_thread;
+	int x;
+
+	for (x = 0; thread_pids[x]; x++);
+	*number_of_stacks = x;
+	*stacks = (thread_stack*) arena_calloc(&snapshot_arena, x, sizeof(thread_stack));
+	if (NULL == *stacks) {
+		log(ERROR, "Failed to allocate thread stacks\n");
+		return ENOMEM;
+	}
+	for (x = 0; thread_pids[x]; x++) {
+		TARGET_ADDRESS walk = unwind_thread_stack(&(*stacks)[x], pi, thread_pids[x], unwinder_option);
+		if (walk) {
+			ret = walk;
+		}
 	}
 	return ret;
 }
 
+/* End of stack capture helper functions */
 
-int get_file_symbols(process_info *pi, char* filename, TARGET_ADDRESS base_address)
+/* Batch symbolization helper functions */
+
+typedef struct _pc_symbol {
+	TARGET_ADDRESS pc;
+	module_image *image; /* NULL when the address is in no module */
+	symbol_entry *symbol; /* NULL when the address is in space */
+	TARGET_ADDRESS offset;
+} pc_symbol;
+
+typedef struct _symbol_map {
+	pc_symbol *entries;
+	int number_of_entries;
+} symbol_map;
+
+static int compare_addresses(const void *a, const void *b)
+{
+	TARGET_ADDRESS x = *(const TARGET_ADDRESS*)a;
+	TARGET_ADDRESS y = *(const TARGET_ADDRESS*)b;
+	return (x > y) - (x < y);
+}
+
+/* Resolve the program counters of any number of captured stacks at once.
+   The unique PCs are sorted, then each one is looked up in the symbol table
+   of the module whose range it falls in, and nowhere else.
+ */
+static int resolve_symbol_map(symbol_map *map, process_info *pi, thread_stack *stacks, int number_of_stacks)
 {
 	int ret = 0;
-	char *target = NULL;
-	bfd *file;
-	
-	log(DEBUG, "get_file_symbols for %s\n", filename);
-	
-	file = bfd_openr (filename, target);
-	if (NULL == file) {
-		const char *errmsg = bfd_errmsg (bfd_get_error ());
-		log(ERROR, "Failed to open file: %s (%s)\n", filename, errmsg);
-		return -1;
+	TARGET_ADDRESS *pcs = NULL;
+	int number_of_pcs = 0;
+	int unique = 0;
+	int x, y;
+
+	map->entries = NULL;
+	map->number_of_entries = 0;
+
+	for (x = 0; x < number_of_stacks; x++) {
+		number_of_pcs += stacks[x].number_of_frames;
 	}
-	log(DEBUG, "opened file ok\n");
-	/* We have to do this otherwise bfd crashes */
-	bfd_check_format(file,bfd_object);
-	/* Now get the symbols */
-	
-	{
-		long storage_needed;
-		asymbol **symbol_table;
-		long number_of_symbols;
-		long i;
-		int dynamic = 0;
+	if (!number_of_pcs) {
+		return 0;
+	}
+	pcs = (TARGET_ADDRESS*) arena_alloc(&snapshot_arena, number_of_pcs * sizeof(TARGET_ADDRESS));
+	map->entries = (pc_symbol*) arena_alloc(&snapshot_arena, number_of_pcs * sizeof(pc_symbol));
+	if (NULL == pcs || NULL == map->entries) {
+		log(ERROR, "Failed to allocate symbol map\n");
+		return ENOMEM;
+	}
+	number_of_pcs = 0;
+	for (x = 0; x < number_of_stacks; x++) {
+		for (y = 0; y < stacks[x].number_of_frames; y++) {
+			pcs[number_of_pcs++] = stacks[x].frames[y].pc;
+		}
+	}
+	qsort(pcs, number_of_pcs, sizeof(TARGET_ADDRESS), compare_addresses);
 
-		storage_needed = bfd_get_symtab_upper_bound (file);
+	for (x = 0; x < number_of_pcs; x++) {
+		if (unique && pcs[x] == map->entries[unique - 1].pc) {
+			continue;
+		}
+		map->entries[unique].pc = pcs[x];
+		map->entries[unique].image = NULL;
+		map->entries[unique].symbol = NULL;
+		map->entries[unique].offset = 0;
+		unique++;
+	}
+	map->number_of_entries = unique;
 
-		if (storage_needed == 0) {
-			log(DEBUG, "storage needed == 0, trying dynamic\n");
-			dynamic = 1;
-			storage_needed = bfd_get_dynamic_symtab_upper_bound (file);
-			if (storage_needed == 0) {
-				log(DEBUG, "storage needed still == 0, give up\n");
-				return -1;
-			}
-        	}
-		log(DEBUG, "storage needed = %ld\n", storage_needed);
-		symbol_table = (asymbol **) malloc (storage_needed);
-		if (NULL == symbol_table) {
-			log(ERROR,"failed to allocate symbol table buffer\n");
-			return ENOMEM;
+	for (x = 0; x < unique; x++) {
+		pc_symbol *entry = &map->entries[x];
+		process_module *module = find_process_module(pi, entry->pc);
+		symbol_entry *symbol = NULL;
+		if (NULL == module) {
+			continue;
 		}
-       
-        number_of_symbols = dynamic ? 
-            bfd_canonicalize_dynamic_symtab (file, symbol_table) :
-			bfd_canonicalize_symtab (file, symbol_table);
+		entry->image = module->image;
+		symbol = find_module_symbol(module->image, entry->pc - module->bias);
+		/* An empty name marks the end of a sized (JIT) symbol */
+		if (NULL != symbol && symbol->name[0]) {
+			entry->symbol = symbol;
+			entry->offset = entry->pc - module->bias - symbol->value;
+		}
+	}
+	log(DEBUG, "Resolved %d unique addresses out of %d frames\n", unique, number_of_pcs);
+	return ret;
+}
+
+int grok_symbol_map(symbol_map *map, process_info *pi, thread_stack *stacks, int number_of_stacks)
+{
+	struct timespec start;
+	int ret = 0;
+	start_timer(&start);
+	ret = resolve_symbol_map(map, pi, stacks, number_of_stacks);
+	stop_timer(&start, STATS_SYMBOLIZE);
+	return ret;
+}
+
+pc_symbol *lookup_symbol_map(symbol_map *map, TARGET_ADDRESS pc)
+{
+	int low = 0;
+	int high = map->number_of_entries - 1;
+	while (low <= high) {
+		int middle = low + (high - low) / 2;
+		if (map->entries[middle].pc == pc) {
+			return &map->entries[middle];
+		}
+		if (map->entries[middle].pc < pc) {
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+	return NULL;
+}
+
+/* End of batch symbolization helper functions */
+
+void print_program_counter(TARGET_ADDRESS pc, symbol_map *map)
+{
+	pc_symbol *entry = lookup_symbol_map(map, pc);
+	if (OUTPUT_JSON == output_format) {
+		output_json("{\"pc\":\"0x%lx\"", pc);
+		if (NULL != entry && NULL != entry->image) {
+			output_json(",\"module\":");
+			output_json_string(entry->image->path);
+		}
+		if (NULL != entry && NULL != entry->symbol) {
+			output_json(",\"symbol\":");
+			output_json_string(entry->symbol->name);
+			output_json(",\"offset\":%lu", entry->offset);
+		}
+		output_json("}");
+	} else if (OUTPUT_FOLDED == output_format) {
+		char address[32];
+		if (NULL != entry && NULL != entry->symbol) {
+			output_folded_frame(entry->symbol->name, strlen(entry->symbol->name), "");
+		} else {
+			sprintf(address, "0x%lx", pc);
+			output_folded_frame(address, strlen(address), "");
+		}
+	} else if (NULL == entry || NULL == entry->symbol) {
+		output("0x%016lx \n", pc);
+	} else {	
+		output("0x%016lx in %s \n", pc, entry->symbol->name);
+	}
+}
+
+/* Kernel frames go above the user ones, innermost first like them; in the
+   folded format they go after them, with the usual _[k] suffix */
+static void print_kernel_stack(kernel_stack *ks)
+{
+	char state[4] = { '[', ks->state, ']', '\0' };
+	int x;
+
+	output("state %c, wchan %s\n", ks->state, ks->wchan ? ks->wchan : "-");
+	for (x = 0; x < ks->number_of_frames; x++) {
+		output("[kernel] %s\n", ks->frames[x]);
+	}
+	output_json(",\"state\":\"%c\"", ks->state);
+	if (ks->wchan) {
+		output_json(",\"wchan\":");
+		output_json_string(ks->wchan);
+	}
+	output_json(",\"kernel_frames\":[");
+	for (x = 0; x < ks->number_of_frames; x++) {
+		if (x) {
+			output_json(",");
+		}
+		output_json_string(ks->frames[x]);
+	}
+	output_json("]");
+	/* The state is the root of the folded line, so that flame graphs split
+	   off-CPU time by it first */
+	output_folded_frame(state, 3, "");
+}
+
+static void print_folded_kernel_stack(kernel_stack *ks)
+{
+	int x;
+	for (x = ks->number_of_frames - 1; x >= 0; x--) {
+		output_folded_frame(ks->frames[x], strcspn(ks->frames[x], "+"), "_[k]");
+	}
+	if (0 == ks->number_of_frames && ks->wchan) {
+		output_folded_frame(ks->wchan, strlen(ks->wchan), "_[k]");
+	}
+}
+
+/* Ends the JSON object output_json_thread started, and the folded line the
+   caller may have started with the process name */
+void print_thread_stack(thread_stack *ts, symbol_map *map)
+{
+	struct timespec start;
+	int x, y;
+	start_timer(&start);
+	if (NULL != ts->kernel) {
+		print_kernel_stack(ts->kernel);
+	}
+	output_json(",\"frames\":[");
+	for (x = 0; x < ts->number_of_frames; x++) {
+		stack_frame *frame = &ts->frames[x];
+		if (x) {
+			output_json(",");
+		}
+		if (OUTPUT_FOLDED != output_format) {
+			print_program_counter(frame->pc, map);
+		}
+		if (frame->number_of_arguments < 0) {
+			continue;
+		}
+		output("(\n");
+		for (y = 0; y < frame->number_of_arguments; y++) {
+			output("  0x%016lx\n", frame->arguments[y]);
+		}
+		output(")\n");
+	}
+	output_json("]}\n");
+	if (OUTPUT_FOLDED == output_format) {
+		/* Folded lines run from the outermost frame in */
+		for (x = ts->number_of_frames - 1; x >= 0; x--) {
+			print_program_counter(ts->frames[x].pc, map);
+		}
+		if (NULL != ts->kernel) {
+			print_folded_kernel_stack(ts->kernel);
+		}
+		output_folded(" %d\n", ts->samples ? ts->samples : 1);
+	}
+	if (ts->reached_top) {
+		output("\n");
+	}
+	stop_timer(&start, STATS_OUTPUT);
+}
+
+/* The root of each folded line; the pid when the process has no name */
+static void grok_process_name(int pid, char *name, size_t size)
+{
+	char file_name[64];
+	FILE *fp = NULL;
+
+	snprintf(name, size, "%d", pid);
+	sprintf(file_name, "/proc/%d/comm", pid);
+	fp = fopen(file_name, "r");
+	if (NULL == fp) {
+		return;
+	}
+	if (NULL != fgets(name, size, fp)) {
+		name[strcspn(name, "\n")] = '\0';
+	}
+	fclose(fp);
+}
+
+/* The part of a dump that needs the threads stopped: their registers and
+   stacks. The walk keeps the raw PCs and argument words, so nothing after it
+   reads the target's memory. */
+static int grok_process_stacks(thread_stack **stacks, int *number_of_stacks, process_info *pi)
+{
+	int ret = 0;
+
+	if (blocked_option) {
+		ret = grok_blocked_stacks(stacks, number_of_stacks, pi);
+	} else if (stagger_option) {
+		ret = grok_staggered_stacks(stacks, number_of_stacks, pi);
+	} else {
+		ret = grok_stacks(stacks, number_of_stacks, pi);
+	}
+	if (NULL != *stacks) {
+		record_threads(pi, *stacks, *number_of_stacks);
+	}
+	return ret;
+}
+
+/* Symbolize and write out stacks taken by grok_process_stacks; the target
+   may be running again */
+static int print_process_stacks(process_info *pi, thread_stack *stacks, int number_of_stacks)
+{
+	symbol_map map;
+	char name[64] = "";
+	int x;
+
+	if (grok_symbol_map(&map, pi, stacks, number_of_stacks)) {
+		return ENOMEM;
+	}
+	if (OUTPUT_FOLDED == output_format) {
+		grok_process_name(pi->pid, name, sizeof(name));
+	}
+	for (x = 0; x < number_of_stacks; x++) {
+		char *thread_name = "";
+		if (kernel_option) {
+			stacks[x].kernel = find_kernel_stack(stacks[x].pid);
+		}
+		output_folded_frame(name, strlen(name), "");
+		output_json_thread(pi->pid, stacks[x].pid);
+		if (pi->threads_present_flag) {
+			if (stacks[x].pid == pi->initial_thread_id) {
+				thread_name = " (initial thread)";
+				output_json(",\"thread\":\"initial\"");
+			} else {
+				if (stacks[x].pid == pi->manager_thread_id) {
+					thread_name = " (manager thread)";
+					output_json(",\"thread\":\"manager\"");
+				}
+			}
+			output("LWP %d%s:\n", stacks[x].pid, thread_name);
+		}
+		print_thread_stack(&stacks[x], &map);
+	}
+	/* Threads whose walk failed are printed as far as it got */
+	return output_flush();
+}
+
+int grok_and_print_stacks(process_info *pi)
+{
+	int ret = 0;
+	thread_stack *stacks = NULL;
+	int number_of_stacks = 0;
+
+	ret = grok_process_stacks(&stacks, &number_of_stacks, pi);
+	if (NULL == stacks) {
+		return ret;
+	}
+	return print_process_stacks(pi, stacks, number_of_stacks);
+}
+
+/* Pipelined attach helper functions */
+
+/* Attaching to threads one at a time costs a full round trip through the
+   scheduler for each: the thread has to run to notice the SIGSTOP before
+   waitpid returns. Instead every thread is seized and interrupted up front,
+   and the stops are collected as they come from a single waitpid(-1) loop,
+   so the target stops in about the time its slowest thread takes.
+
+   Seized threads report the threads they create (PTRACE_O_TRACECLONE), and
+   those start out traced. Threads created by ones not seized yet are picked
+   up by listing /proc/<pid>/task again, until a listing has nothing new.
+ */
+
+typedef struct _attaching_thread {
+	int pid;
+	int stopped;
+} attaching_thread;
+
+typedef struct _attach_set {
+	attaching_thread *threads; /* Sorted by pid */
+	int number_of_threads;
+	int size;
+	int pending; /* Seized but not stopped yet */
+} attach_set;
+
+static int compare_attaching_threads(const void *a, const void *b)
+{
+	return ((const attaching_thread*)a)->pid - ((const attaching_thread*)b)->pid;
+}
+
+static attaching_thread *find_attaching_thread(attach_set *set, int thepid)
+{
+	attaching_thread key;
+	key.pid = thepid;
+	return (attaching_thread*) bsearch(&key, set->threads, set->number_of_threads,
+		sizeof(attaching_thread), compare_attaching_threads);
+}
+
+static int add_attaching_thread(attach_set *set, int thepid, int stopped)
+{
+	int x;
+	if (set->number_of_threads == set->size) {
+		int size = set->size ? set->size * 2 : 64;
+		attaching_thread *temp = (attaching_thread*) realloc(set->threads, size * sizeof(attaching_thread));
+		if (NULL == temp) {
+			return ENOMEM;
+		}
+		set->threads = temp;
+		set->size = size;
+	}
+	for (x = set->number_of_threads; x > 0 && set->threads[x - 1].pid > thepid; x--) {
+		set->threads[x] = set->threads[x - 1];
+	}
+	set->threads[x].pid = thepid;
+	set->threads[x].stopped = stopped;
+	set->number_of_threads++;
+	if (!stopped) {
+		set->pending++;
+	}
+	return 0;
+}
+
+static void remove_attaching_thread(attach_set *set, attaching_thread *thread)
+{
+	if (!thread->stopped) {
+		set->pending--;
+	}
+	set->number_of_threads--;
+	memmove(thread, thread + 1, (set->threads + set->number_of_threads - thread) * sizeof(attaching_thread));
+}
+
+static void attaching_thread_stopped(attach_set *set, attaching_thread *thread)
+{
+	if (!thread->stopped) {
+		thread->stopped = 1;
+		set->pending--;
+	}
+}
+
+/* Seize and interrupt every thread in /proc/<pid>/task not seized already,
+   except the initial one which attach_target has stopped */
+static int seize_task_threads(process_info *pi, attach_set *set, int *number_seized)
+{
+	char task_dir_name[64];
+	DIR *task_dir = NULL;
+	struct dirent *entry = NULL;
+	int ret = 0;
+
+	*number_seized = 0;
+	sprintf(task_dir_name, "/proc/%d/task", pi->pid);
+	task_dir = opendir(task_dir_name);
+	if (NULL == task_dir) {
+		ret = errno;
+		log(ERROR, "Failed to open %s: %s\n", task_dir_name, strerror(ret));
+		return ret;
+	}
+	while (NULL != (entry = readdir(task_dir))) {
+		int thread_pid = atoi(entry->d_name);
+		if (thread_pid <= 0 || thread_pid == pi->pid || find_attaching_thread(set, thread_pid)) {
+			continue;
+		}
+		if (counted_ptrace(PTRACE_SEIZE, thread_pid, 0, PTRACE_O_TRACECLONE) < 0 ||
+			counted_ptrace(PTRACE_INTERRUPT, thread_pid, 0, 0) < 0) {
+			ret = errno;
+			if (ESRCH == ret) {
+				/* The thread exited while we were listing them */
+				log(DEBUG, "Thread %d is gone\n", thread_pid);
+				ret = 0;
+				continue;
+			}
+			log(ERROR, "Failed to attach to target thread %d : %s\n", thread_pid, strerror(ret));
+			break;
+		}
+		ret = add_attaching_thread(set, thread_pid, 0);
+		if (ret) {
+			break;
+		}
+		(*number_seized)++;
+	}
+	closedir(task_dir);
+	return ret;
+}
+
+/* Handle one waitpid() report while attaching */
+static int handle_attach_event(process_info *pi, attach_set *set, int thepid, int status)
+{
+	attaching_thread *thread = NULL;
+	int event = status >> 16;
+	unsigned long message = 0;
+	int ret = 0;
+
+	if (thepid == pi->pid) {
+		/* The initial thread's SIGSTOP, if attach_target gave up waiting for it */
+		return 0;
+	}
+	thread = find_attaching_thread(set, thepid);
+	if (WIFEXITED(status) || WIFSIGNALED(status)) {
+		log(DEBUG, "Thread %d exited while we were attaching\n", thepid);
+		if (thread) {
+			remove_attaching_thread(set, thread);
+		}
+		return 0;
+	}
+	if (!WIFSTOPPED(status)) {
+		return 0;
+	}
+	if (NULL == thread) {
+		/* A new thread can report before its parent's clone event does */
+		log(DEBUG, "New thread %d\n", thepid);
+		return add_attaching_thread(set, thepid, 1);
+	}
+	if (PTRACE_EVENT_CLONE == event) {
+		counted_ptrace(PTRACE_GETEVENTMSG, thepid, 0, &message);
+		if (NULL == find_attaching_thread(set, (int)message)) {
+			log(DEBUG, "Thread %d created thread %lu\n", thepid, message);
+			ret = add_attaching_thread(set, (int)message, 0);
+			/* add_attaching_thread may have moved the array */
+			thread = find_attaching_thread(set, thepid);
+		}
+	} else if (!event && SIGSTOP != WSTOPSIG(status)) {
+		/* A signal on its way in: let it through, the interrupt still comes */
+		counted_ptrace(PTRACE_CONT, thepid, 0, WSTOPSIG(status));
+		return 0;
+	}
+	/* PTRACE_EVENT_STOP, the clone event, or a SIGSTOP that is ours */
+	attaching_thread_stopped(set, thread);
+	return ret;
+}
+
+static int attach_task_threads(process_info *pi, int **thread_pid_array, int *number_of_threads)
+{
+	attach_set set;
+	struct timespec start, end;
+	int number_seized = 0;
+	int status = 0;
+	int ret = 0;
+	int x;
+	unsigned long ns;
+
+	memset(&set, 0, sizeof(set));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		ret = seize_task_threads(pi, &set, &number_seized);
+	} while (!ret && number_seized);
+
+	while (set.pending) {
+		int thepid = waitpid(-1, &status, __WALL);
+		if (thepid < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			ret = errno;
+			log(ERROR, "Failed to wait for target threads: %s\n", strerror(ret));
+			break;
+		}
+		ret = handle_attach_event(pi, &set, thepid, status);
+		if (ret) {
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*thread_pid_array = (int*) arena_calloc(&snapshot_arena, set.number_of_threads + 2, sizeof(int));
+	if (NULL == *thread_pid_array) {
+		log(ERROR, "Failed to allocate thread pid array\n");
+		free(set.threads);
+		return ENOMEM;
+	}
+	(*thread_pid_array)[0] = pi->pid;
+	for (x = 0; x < set.number_of_threads; x++) {
+		(*thread_pid_array)[x + 1] = set.threads[x].pid;
+	}
+	*number_of_threads = set.number_of_threads + 1;
+	free(set.threads);
+
+	ns = (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec;
+	count_attached_threads(*number_of_threads, ns);
+	log(DEBUG, "Attached to %d threads in %.3f ms, %.0f threads/s\n", *number_of_threads,
+		ns / 1e6, ns ? *number_of_threads * 1e9 / ns : 0.0);
+	return ret;
+}
+
+/* End of pipelined attach helper functions */
+
+static int list_task_threads(process_info *pi, int **thread_pid_array, int *number_of_threads)
+{
+	int ret = 0;
+	char task_dir_name[64];
+	DIR *task_dir = NULL;
+	struct dirent *entry = NULL;
+	int array_size = 16;
+
+	sprintf(task_dir_name, "/proc/%d/task", pi->pid);
+	task_dir = opendir(task_dir_name);
+	if (NULL == task_dir) {
+		ret = errno;
+		log(ERROR, "Failed to open %s: %s\n", task_dir_name, strerror(ret));
+		return ret;
+	}
+
+	*thread_pid_array = (int*) arena_calloc(&snapshot_arena, array_size + 1, sizeof(int));
+	if (NULL == *thread_pid_array) {
+		log(ERROR, "Failed to allocate thread pid array\n");
+		closedir(task_dir);
+		return ENOMEM;
+	}
+	(*thread_pid_array)[(*number_of_threads)++] = pi->pid;
+
+	while (NULL != (entry = readdir(task_dir))) {
+		int thread_pid = atoi(entry->d_name);
+		if (thread_pid <= 0 || thread_pid == pi->pid) {
+			continue;
+		}
+		if (*number_of_threads == array_size) {
+			int *temp = (int*) arena_alloc(&snapshot_arena, (array_size * 2 + 1) * sizeof(int));
+			if (NULL == temp) {
+				log(ERROR, "Failed to grow thread pid array\n");
+				ret = ENOMEM;
+				break;
+			}
+			memcpy(temp, *thread_pid_array, *number_of_threads * sizeof(int));
+			*thread_pid_array = temp;
+			array_size *= 2;
+		}
+		(*thread_pid_array)[(*number_of_threads)++] = thread_pid;
+	}
+	closedir(task_dir);
+	log(DEBUG, "Found %d threads in %s\n", *number_of_threads, task_dir_name);
+	return ret;
+}
+
+/* NPTL doesn't export the LinuxThreads debug symbols, so when they are missing
+   we take the thread list from /proc/<pid>/task instead. The initial thread
+   always goes first in the array, the same as detatch_target expects.
+   Staggered sampling only wants the list, and attaches to threads itself.
+ */
+int grok_task_threads(process_info *pi, int attach)
+{
+	int ret = 0;
+	int *thread_pid_array = NULL;
+	int number_of_threads = 0;
+
+	if (attach) {
+		ret = attach_task_threads(pi, &thread_pid_array, &number_of_threads);
+	} else {
+		ret = list_task_threads(pi, &thread_pid_array, &number_of_threads);
+	}
+	if (NULL == thread_pid_array) {
+		return ret;
+	}
+	thread_pid_array[number_of_threads] = 0;
+
+	/* Keep whatever we attached to, so that detatch_target can let go of it */
+	pi->thread_pids = thread_pid_array;
+	pi->initial_thread_id = pi->pid;
+	pi->threads_present_flag = 1;
+	return ret;
+}
+
+/* Stop one thread on its own, wherever it is */
+static int stop_one_thread(int thepid)
+{
+	struct timespec start;
+	int waitstatus;
+	int ret = 0;
+	start_timer(&start);
+	if (counted_ptrace(PTRACE_ATTACH, thepid, NULL, NULL) < 0) {
+		ret = errno;
+	}
+	while (!ret && waitpid(thepid, &waitstatus, __WALL) < 0) {
+		if (EINTR != errno) {
+			ret = errno;
+		}
+	}
+	stop_timer(&start, STATS_ATTACH);
+	return ret;
+}
+
+/* Staggered sampling: instead of freezing the whole process for the dump,
+   stop, walk and resume one thread at a time. The stacks are no longer a
+   consistent snapshot of the process, but no thread is held for longer than
+   its own walk. The target must already be detached when this is called.
+ */
+int grok_staggered_stacks(thread_stack **stacks, int *number_of_stacks, process_info *pi)
+{
+	int ret = 0;
+	long longest_pause = 0;
+	int x;
+
+	ret = grok_task_threads(pi, 0);
+	if (ret) {
+		return ret;
+	}
+	for (x = 0; pi->thread_pids[x]; x++);
+	*number_of_stacks = 0;
+	*stacks = (thread_stack*) arena_calloc(&snapshot_arena, x, sizeof(thread_stack));
+	if (NULL == *stacks) {
+		log(ERROR, "Failed to allocate thread stacks\n");
+		return ENOMEM;
+	}
+	for (x = 0; pi->thread_pids[x]; x++) {
+		int thread_pid = pi->thread_pids[x];
+		struct timespec start, end;
+		long pause;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (stop_one_thread(thread_pid)) {
+			log(DEBUG, "Thread %d is gone\n", thread_pid);
+			continue;
+		}
+		pi->peek_pid = thread_pid;
+		unwind_thread_stack(&(*stacks)[*number_of_stacks], pi, thread_pid, unwinder_option);
+		counted_ptrace(PTRACE_DETACH, thread_pid, 0, 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		pause = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+		if (pause > longest_pause) {
+			longest_pause = pause;
+		}
+		(*number_of_stacks)++;
+	}
+	pi->peek_pid = pi->pid;
+	log(DEBUG, "Sampled %d threads one at a time, longest pause %ld us\n", *number_of_stacks, longest_pause);
+	return ret;
+}
+
+/* Blocked sampling: threads sitting in a system call are walked from a copy
+   of their stack without being stopped at all (see nonstop.c). Only the ones
+   that are running get attached to, one at a time as in staggered sampling.
+   pi must have been set up with open_blocked_target.
+ */
+int grok_blocked_stacks(thread_stack **stacks, int *number_of_stacks, process_info *pi)
+{
+	int ret = 0;
+	target_ops *ops = pi->ops;
+	int number_stopped = 0;
+	int x;
+
+	ret = grok_task_threads(pi, 0);
+	if (ret) {
+		return ret;
+	}
+	for (x = 0; pi->thread_pids[x]; x++);
+	*number_of_stacks = 0;
+	*stacks = (thread_stack*) arena_calloc(&snapshot_arena, x, sizeof(thread_stack));
+	if (NULL == *stacks) {
+		log(ERROR, "Failed to allocate thread stacks\n");
+		return ENOMEM;
+	}
+	for (x = 0; pi->thread_pids[x]; x++) {
+		int thread_pid = pi->thread_pids[x];
+		thread_stack *ts = &(*stacks)[*number_of_stacks];
+		unwind_thread_stack(ts, pi, thread_pid, UNWINDER_FP);
+		if (0 == ts->number_of_frames) {
+			/* Running, woke up while we looked, or its frame chain
+			   couldn't be found from the copy */
+			memset(ts, 0, sizeof(*ts));
+			if (stop_one_thread(thread_pid)) {
+				log(DEBUG, "Thread %d is gone\n", thread_pid);
+				continue;
+			}
+			pi->ops = NULL;
+			pi->peek_pid = thread_pid;
+			unwind_thread_stack(ts, pi, thread_pid, unwinder_option);
+			counted_ptrace(PTRACE_DETACH, thread_pid, 0, 0);
+			pi->ops = ops;
+			number_stopped++;
+		}
+		(*number_of_stacks)++;
+	}
+	pi->peek_pid = pi->pid;
+	log(DEBUG, "Sampled %d threads, stopped %d of them\n", *number_of_stacks, number_stopped);
+	return ret;
+}
+
+int grok_threads(process_info *pi)
+{
+	TARGET_ADDRESS ret = 0;
+	int thread_test_positive = 0;
+	TARGET_ADDRESS loops = 0;
+	
+	/* Magic interaction with the pthread library here, copied from GDB */
+	
+	static char* magic_names[] = {
+		"__pthread_threads_debug",
+		"__pthread_handles",
+		"__pthread_initial_thread",
+		"__pthread_manager_thread",
+		"__pthread_sizeof_handle",
+		"__pthread_offsetof_descr",
+		"__pthread_offsetof_pid",
+		"__pthread_handles_num",
+		NULL
+	};
+	
+	static TARGET_ADDRESS magic_addresses[9] = {0};
+		
+	thread_test_positive = 1;
+	for (loops = 0; NULL != magic_names[loops]; loops++) {
+		ret = get_symbol_address(&magic_addresses[loops],pi,magic_names[loops]);
+		if (!ret) {
+			/* Failed to find one */
+			thread_test_positive = 0;
+			log(DEBUG, "Failed to find thread symbol %s\n", magic_names[loops]);
+			break;
+		} else {
+			log(DEBUG, "Read thread symbol %s  -> 0x%lx\n", magic_names[loops], magic_addresses[loops]);
+		}
+	}
+
+	
+	if (thread_test_positive) {
+		/* we think that we have threads */
+		TARGET_ADDRESS number_of_threads = 0;
+		int *thread_pid_array = NULL;
+		
+		TARGET_ADDRESS handle_array = magic_addresses[1];
+		TARGET_ADDRESS pid_offset = 0;
+		TARGET_ADDRESS descriptor_offset = 0;
+		TARGET_ADDRESS handle_size = 0;
+		TARGET_ADDRESS initial_thread_descriptor, manager_thread_descriptor;
+		
+		/* How many ? */
+		ret = read_target_word(&number_of_threads,pi,magic_addresses[7]);
+		if (ret) {
+			log(ERROR, "Failed to read number of threads from target: %s\n", strerror(ret));
+			return ret;
+		} else {
+			log(DEBUG, "Found %ld threads\n", number_of_threads);
+		}
+				
+		thread_pid_array = (int*) arena_calloc(&snapshot_arena, number_of_threads + 1, sizeof(int));
+		if (NULL == thread_pid_array) {
+			log(ERROR, "Failed to allocate thread pid array\n");
+			return ENOMEM;
+		}
+		
+		ret = read_target_pointer(&initial_thread_descriptor,pi,magic_addresses[2]);
+		if (ret) {
+			log(ERROR, "Failed to read initial thread descriptor from target: %s\n", strerror(ret));
+			return ret;
+		} else {
+			log(DEBUG, "Initial thread descriptor: 0x%08lx\n", initial_thread_descriptor);
+		}
+		ret = read_target_pointer(&manager_thread_descriptor,pi,magic_addresses[3]);
+		if (ret) {
+			log(ERROR, "Failed to read manager thread descriptor from target: %s\n", strerror(ret));
+			return ret;
+		} else {
+			log(DEBUG, "Manager thread descriptor: 0x%08lx\n", manager_thread_descriptor);
+		}
+		ret = read_target_word(&handle_size,pi,magic_addresses[4]);
+		if (ret) {
+			log(ERROR, "Failed to read handle size from target: %s\n", strerror(ret));
+			return ret;
+		} else {
+			log(DEBUG, "Handle Size: %ld\n", handle_size);
+		}
+		ret = read_target_word(&pid_offset,pi,magic_addresses[6]);
+		if (ret) {
+			log(ERROR, "Failed to read pid offset from target: %s\n", strerror(ret));
+			return ret;
+		} else {
+			log(DEBUG, "Pid offset: %ld\n", pid_offset);
+		}
+		ret = read_target_word(&descriptor_offset,pi,magic_addresses[5]);
+		if (ret) {
+			log(ERROR, "Failed to read descriptor offset from target: %s\n", strerror(ret));
+			return ret;
+		} else {
+			log(DEBUG, "Descriptor offset: %ld\n", descriptor_offset);
+		}
+
+		/* Fill in the pid array, attaching as we go */
+		
+		for (loops = 0; loops < number_of_threads; loops++) {
+			TARGET_ADDRESS descriptor_address;
+			TARGET_ADDRESS thread_pid = 0;
+			ret = read_target_pointer(&descriptor_address,pi,handle_array + descriptor_offset + (handle_size * loops));
+			if (ret) {
+				log(ERROR, "Failed to read descriptor address from target: %s\n", strerror(ret));
+				return ret;
+			} else {
+				log(DEBUG, "Descriptor Address: 0x%lx\n", descriptor_address);
+			}
+			ret = read_target_word(&thread_pid,pi,descriptor_address + pid_offset);
+			if (ret) {
+				log(ERROR, "Failed to read thread pid from target: %s\n", strerror(ret));
+				return ret;
+			} else {
+				log(DEBUG, "Thread PID: %ld\n", thread_pid);
+			}
+			
+			if (descriptor_address == initial_thread_descriptor) {
+				pi->initial_thread_id = thread_pid;
+			} else {
+				if (descriptor_address == manager_thread_descriptor) {
+					pi->manager_thread_id = thread_pid;
+				}
+			}
+			
+			if ((int)thread_pid != pi->pid) {
+				ret = attach_thread(thread_pid);
+				if (ret) {
+					log(ERROR, "Failed to attach to target thread %ld : %s\n", thread_pid, strerror(ret));
+					return ret;
+				}
+			}
+			
+			thread_pid_array[loops] = thread_pid;
+		}
+		
+		pi->thread_pids = thread_pid_array;
+		pi->threads_present_flag = 1;
+	} else {
+		ret = grok_task_threads(pi, 1);
+	}
+	
+	return ret;
+}
+
+/* Futex contention helper functions */
+
+typedef struct _futex_waiters {
+	TARGET_ADDRESS address;
+	int owner;
+	int number_of_waiters;
+	int *waiter_pids;
+} futex_waiters;
+
+/* Read the syscall a stopped thread sits in. ORIG_RAX is -1 when the thread
+   was stopped in user space. If the registers can't be read, fall back to
+   /proc/<tid>/syscall, which works as long as the thread is blocked.
+ */
+int read_thread_syscall(long *number, TARGET_ADDRESS *args, int number_of_args, int thepid, int tgid)
+{
+	static const int arg_registers[] = { RDI, RSI, RDX, R10, R8, R9 };
+	TARGET_ADDRESS value = 0;
+	int ret = 0;
+	int x;
+
+	ret = read_target_userpointer(&value, thepid, ORIG_RAX * pointer_size);
+	if (!ret) {
+		*number = (long)value;
+		for (x = 0; x < number_of_args && x < 6; x++) {
+			ret = read_target_userpointer(&args[x], thepid, arg_registers[x] * pointer_size);
+			if (ret) {
+				break;
+			}
+		}
+	}
+
+	if (ret) {
+		char file_name[64];
+		char line[256];
+		FILE *fp;
+
+		log(DEBUG, "Failed to read syscall registers of %d: %s\n", thepid, strerror(ret));
+		sprintf(file_name, "/proc/%d/task/%d/syscall", tgid, thepid);
+		fp = fopen(file_name, "r");
+		if (NULL == fp) {
+			return errno;
+		}
+		if (NULL == fgets(line, sizeof(line), fp)) {
+			fclose(fp);
+			return EIO;
+		}
+		fclose(fp);
+		if (0 == strncmp(line, "running", 7)) {
+			*number = -1;
+			return 0;
+		}
+		{
+			TARGET_ADDRESS a[6] = {0};
+			if (sscanf(line, "%ld %lx %lx %lx %lx %lx %lx", number,
+					&a[0], &a[1], &a[2], &a[3], &a[4], &a[5]) < 1) {
+				return EIO;
+			}
+			for (x = 0; x < number_of_args && x < 6; x++) {
+				args[x] = a[x];
+			}
+		}
+		ret = 0;
+	}
+	return ret;
+}
+
+static int futex_op_is_wait(TARGET_ADDRESS op)
+{
+	switch (op & FUTEX_CMD_MASK) {
+		case FUTEX_WAIT:
+		case FUTEX_WAIT_BITSET:
+		case FUTEX_LOCK_PI:
+		case FUTEX_WAIT_REQUEUE_PI:
+#ifdef FUTEX_LOCK_PI2
+		case FUTEX_LOCK_PI2:
+#endif
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+static int is_target_thread(process_info *pi, int thepid)
+{
+	int x;
+	if (!pi->threads_present_flag) {
+		return thepid == pi->pid;
+	}
+	for (x = 0; (pi->thread_pids)[x]; x++) {
+		if ((pi->thread_pids)[x] == thepid) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Work out who holds the lock behind a futex word. PI futexes carry the
+   owner TID in the word itself. For a glibc pthread_mutex_t the futex word
+   is __lock, which is 1 or 2 while it is held, waited on with a plain
+   FUTEX_WAIT, and the owner TID lives in __owner two ints further on.
+   Anything else (condition variables, semaphores) has no owner.
+ */
+int grok_futex_owner(process_info *pi, TARGET_ADDRESS address, TARGET_ADDRESS op)
+{
+	TARGET_ADDRESS word = 0;
+	int cmd = op & FUTEX_CMD_MASK;
+	int lock = 0;
+	int owner = 0;
+
+	if (read_target_word(&word, pi, address)) {
+		return 0;
+	}
+	lock = (int)(word & 0xffffffff);
+
+	if (cmd != FUTEX_WAIT && cmd != FUTEX_WAIT_BITSET && (lock & FUTEX_TID_MASK)) {
+		/* PI futex, owner is in the word */
+		owner = lock & FUTEX_TID_MASK;
+		return is_target_thread(pi, owner) ? owner : 0;
+	}
+	if (cmd != FUTEX_WAIT || (1 != lock && 2 != lock)) {
+		return 0;
+	}
+	/* __owner follows __lock and __count */
+	if (read_target_word(&word, pi, address + 2 * sizeof(int))) {
+		return 0;
+	}
+	owner = (int)(word & 0xffffffff);
+	if (owner > 0 && is_target_thread(pi, owner)) {
+		return owner;
+	}
+	return 0;
+}
+
+static int compare_futex_waiters(const void *a, const void *b)
+{
+	const futex_waiters *fa = a;
+	const futex_waiters *fb = b;
+	if (fa->number_of_waiters != fb->number_of_waiters) {
+		return fb->number_of_waiters - fa->number_of_waiters;
+	}
+	return (fa->address > fb->address) - (fa->address < fb->address);
+}
+
+int grok_and_print_futex_contention(process_info *pi)
+{
+	int ret = 0;
+	int single_thread[2] = { pi->pid, 0 };
+	int *thread_pids = pi->threads_present_flag ? pi->thread_pids : single_thread;
+	futex_waiters *groups = NULL;
+	int number_of_groups = 0;
+	int number_of_threads = 0;
+	int blocked = 0;
+	int x, y;
+
+	for (x = 0; thread_pids[x]; x++) {
+		number_of_threads++;
+	}
+	/* At most one group per thread */
+	groups = (futex_waiters*) arena_calloc(&snapshot_arena, number_of_threads, sizeof(futex_waiters));
+	if (NULL == groups) {
+		log(ERROR, "Failed to allocate futex groups\n");
+		return ENOMEM;
+	}
+
+	for (x = 0; thread_pids[x]; x++) {
+		TARGET_ADDRESS args[2] = {0};
+		long number = -1;
+		int thread_pid = thread_pids[x];
+
+		ret = read_thread_syscall(&number, args, 2, thread_pid, pi->pid);
+		if (ret) {
+			log(ERROR, "Failed to read syscall of thread %d: %s\n", thread_pid, strerror(ret));
+			continue;
+		}
+		if (SYS_futex != number || !futex_op_is_wait(args[1])) {
+			continue;
+		}
+		log(DEBUG, "LWP %d waits on futex 0x%lx, op %ld\n", thread_pid, args[0], args[1]);
+		blocked++;
+
+		for (y = 0; y < number_of_groups; y++) {
+			if (groups[y].address == args[0]) {
+				break;
+			}
+		}
+		if (y == number_of_groups) {
+			groups[y].address = args[0];
+			groups[y].owner = grok_futex_owner(pi, args[0], args[1]);
+			groups[y].waiter_pids = (int*) arena_alloc(&snapshot_arena, number_of_threads * sizeof(int));
+			if (NULL == groups[y].waiter_pids) {
+				log(ERROR, "Failed to allocate waiter array\n");
+				return ENOMEM;
+			}
+			number_of_groups++;
+		}
+		groups[y].waiter_pids[groups[y].number_of_waiters++] = thread_pid;
+	}
+	ret = 0;
+
+	qsort(groups, number_of_groups, sizeof(futex_waiters), compare_futex_waiters);
+
+	output("Futex contention: %d of %d threads blocked on %d futexes\n",
+		blocked, number_of_threads, number_of_groups);
+	for (y = 0; y < number_of_groups; y++) {
+		char *symbol = NULL;
+		get_symbol_for_address(&symbol, pi, groups[y].address, 1);
+		output_json_object(pi->pid);
+		output_json(",\"futex\":\"0x%lx\",\"symbol\":", groups[y].address);
+		output_json_string(symbol);
+		if (groups[y].owner) {
+			output("futex 0x%016lx %s: %d waiters, owner LWP %d\n", groups[y].address,
+				symbol, groups[y].number_of_waiters, groups[y].owner);
+			output_json(",\"owner\":%d", groups[y].owner);
+		} else {
+			output("futex 0x%016lx %s: %d waiters, owner unknown\n", groups[y].address,
+				symbol, groups[y].number_of_waiters);
+		}
+		output_json(",\"waiters\":[");
+		for (x = 0; x < groups[y].number_of_waiters; x++) {
+			output("  LWP %d\n", groups[y].waiter_pids[x]);
+			output_json("%s%d", x ? "," : "", groups[y].waiter_pids[x]);
+		}
+		output_json("]}\n");
+	}
+	output_flush();
+	return ret;
+}
+
+/* End of futex contention helper functions */
+
+module_image *load_module_image(char* filename, struct stat *st)
+{
+	char *target = NULL;
+	bfd *file;
+	module_image *image = NULL;
+	
+	log(DEBUG, "load_module_image for %s\n", filename);
+	
+	file = bfd_openr (filename, target);
+	if (NULL == file) {
+		const char *errmsg = bfd_errmsg (bfd_get_error ());
+		log(ERROR, "Failed to open file: %s (%s)\n", filename, errmsg);
+		return NULL;
+	}
+	log(DEBUG, "opened file ok\n");
+	/* We have to do this otherwise bfd crashes */
+	bfd_check_format(file,bfd_object);
+	/* Now get the symbols */
+	
+	{
+		long storage_needed;
+		asymbol **symbol_table;
+		long number_of_symbols;
+		long i;
+		int dynamic = 0;
+
+		storage_needed = bfd_get_symtab_upper_bound (file);
+
+		if (storage_needed == 0) {
+			log(DEBUG, "storage needed == 0, trying dynamic\n");
+			dynamic = 1;
+			storage_needed = bfd_get_dynamic_symtab_upper_bound (file);
+			if (storage_needed == 0) {
+				log(DEBUG, "storage needed still == 0, give up\n");
+				bfd_close (file);
+				return NULL;
+			}
+        	}
+		log(DEBUG, "storage needed = %ld\n", storage_needed);
+		symbol_table = (asymbol **) arena_alloc (&snapshot_arena, storage_needed);
+		if (NULL == symbol_table) {
+			log(ERROR,"failed to allocate symbol table buffer\n");
+			bfd_close (file);
+			return NULL;
+		}
+       
+        number_of_symbols = dynamic ? 
+            bfd_canonicalize_dynamic_symtab (file, symbol_table) :
+			bfd_canonicalize_symtab (file, symbol_table);
+
+		log(DEBUG, "found %ld symbols\n", number_of_symbols);
+
+		image = (module_image*) arena_calloc(&image_arena, 1, sizeof(module_image));
+		if (NULL != image && number_of_symbols > 0) {
+			image->symbols = (symbol_entry*) arena_alloc(&image_arena, number_of_symbols * sizeof(symbol_entry));
+		}
+		if (NULL == image || (number_of_symbols > 0 && NULL == image->symbols)) {
+			log(ERROR, "Failed to allocate module image\n");
+			bfd_close (file);
+			return NULL;
+		}
+		
+		for (i = 0; i < number_of_symbols; i++) {
+			if (!symbol_entry_from_asymbol(&image->symbols[image->number_of_symbols], symbol_table[i])) {
+				image->number_of_symbols++;
+			}
+		}
+		qsort(image->symbols, image->number_of_symbols, sizeof(symbol_entry), compare_symbol_entries);
+	}
+	
+	if (bfd_close (file) == false) {
+		log(ERROR, "Error closing file: %s\n", filename);
+		return NULL;
+	}
+
+	image->dev = st->st_dev;
+	image->ino = st->st_ino;
+	image->mtime = st->st_mtime;
+	image->size = st->st_size;
+	image->path = arena_strdup(&image_arena, filename);
+	read_link_extent(filename, &image->link_start, &image->link_end);
+	image->next = module_images;
+	module_images = image;
+	return image;
+}
+
+int get_file_symbols(process_info *pi, char* filename, TARGET_ADDRESS base_address)
+{
+	struct stat st;
+	struct timespec start;
+	module_image *image = NULL;
+	
+	log(DEBUG, "get_file_symbols for %s\n", filename);
+	start_timer(&start);
+
+	if (stat(filename, &st)) {
+		log(ERROR, "Failed to open file: %s (%s)\n", filename, strerror(errno));
+		return -1;
+	}
+	image = find_module_image(&st);
+	if (NULL != image) {
+		log(DEBUG, "Reusing %d symbols loaded from %s\n", image->number_of_symbols, image->path);
+		count_module(filename, image->number_of_symbols, 1, stop_timer(&start, STATS_SYMBOLS));
+	} else {
+		image = load_module_image(filename, &st);
+		if (NULL == image) {
+			return -1;
+		}
+		count_module(filename, image->number_of_symbols, 0, stop_timer(&start, STATS_SYMBOLS));
+	}
+	return add_process_module(pi, image, base_address);
+}
+
+int dynamic_libs_present(process_info *pi)
+{
+	int ret = 0;
+	/* If the symbol "_DYNAMIC" is present in the executable, then we return true and set the link map head in the pi. */
+	TARGET_ADDRESS dynamic;
+	
+	ret = get_symbol_address(&dynamic,pi,"_DYNAMIC");
+	if (ret) {
+		/* Find the entry in the DYNAMIC array which has the valid entry we need. */
+		int keep_looking = 1;
+		int found_it = 0;
+		TARGET_ADDRESS r_debug_address;
+		while (keep_looking) {
+			ElfW(Dyn) thisdyn;
+			ret = read_target_memory((char*)&thisdyn, sizeof( ElfW(Dyn)), pi, dynamic);
+			if (ret) {
+				log(ERROR, "Error %d (%s) reading from DYNAMIC array\n", ret, strerror(ret));
+				return 0;
+			} else {
+				if (debug_option) {
+					log(INFO, "Read ElfW(Dyn) from address 0x%lx, tag=%ld, value=0x%lx\n",
+						dynamic, thisdyn.d_tag, thisdyn.d_un.d_ptr);
+				}
+			}
+			if (DT_NULL == thisdyn.d_tag) {
+				log(DEBUG, "Found a DT_NULL entry\n");
+				keep_looking = 0;
+			}
+			if (DT_DEBUG == thisdyn.d_tag) {
+				log(DEBUG, "Found r_debug in _DYNAMIC array.\n");
+				r_debug_address = thisdyn.d_un.d_ptr;
+				keep_looking = 0;
+				found_it = 1;
+			}
+			dynamic += sizeof( ElfW(Dyn));
+		}
+		if (!found_it) {
+			log(DEBUG, "Didn't find r_debug in _DYNAMIC array.\n");
+			return 0;		
+		}
+		if (0 == r_debug_address) {
+			/* Stopped at exec, before the dynamic loader has run */
+			log(DEBUG, "r_debug isn't set up yet.\n");
+			return 0;
+		}
+
+		{
+			/* Get the link map head */
+			TARGET_ADDRESS link_map_address;
+			int r_map_offset = offsetof(struct r_debug, r_map);
+			/* Now we've found the r_debug structure, get the link map from it. */
+			ret = read_target_pointer(&link_map_address, pi, r_debug_address + r_map_offset );
+			if (ret) {
+				log(DEBUG, "Failed to read link map address.\n");
+			} else {
+				log(DEBUG, "Read r_map: 0x%lx\n", link_map_address);
+				pi->r_debug_address = r_debug_address;
+				pi->link_map_head = link_map_address;
+				pi->link_map_current = link_map_address;
+			}
+		}
+		ret = 1;
+	} else {
+		log(DEBUG, "No _DYNAMIC symbol found in executable\n");
+		ret = 0;
+	}
+	return ret;
+}
+
+int get_next_so_file_name(char** file_name, process_info *pi, TARGET_ADDRESS *base_address, int *more)
+{
+	int ret = 0;
+	struct link_map lm; 
+	/* Are we at the end of the list ? */
+	if (NULL == (void*)pi->link_map_current) {
+		*more = 0;
+		return 0;
+	} else {
+		*more = 1;
+	}
+	/* Dereference the current pointer to get the filename */
+	ret = read_target_memory((void*)&lm,sizeof(lm),pi,pi->link_map_current);
+	if (ret) {
+		log(ERROR, "Failed to read link map structure from target.\n");
+		return ret;
+	} else {
+		log(DEBUG, "Read link_map entry from address 0x%lx, base=0x%lx, name=0x%lx, next=0x%lx\n",
+			(TARGET_ADDRESS)lm.l_addr, pi->link_map_current, (TARGET_ADDRESS)lm.l_name, (TARGET_ADDRESS)lm.l_next);
+	}
+	ret = read_target_string(file_name,pi,(TARGET_ADDRESS)lm.l_name);
+	if (ret) {
+		log(ERROR, "Failed to copy filename from target.\n");
+		return ret;
+	} else {
+		log(DEBUG, "Copied filename: '%s' from target\n", *file_name);
+	}
+	*base_address = (TARGET_ADDRESS)lm.l_addr;
+	/* Advance down the linked list */
+	pi->link_map_current = (TARGET_ADDRESS)lm.l_next;
+	return ret;
+}
+
+/* A cheap fingerprint of the loaded libraries: every link map entry's
+   address, bias and name pointer, hashed. Comparing it to the one taken when
+   the symbols were loaded tells whether dlopen or dlclose ran in between,
+   at the cost of one read per library. EAGAIN while the dynamic linker is
+   in the middle of changing the list. */
+static int grok_link_map_generation(process_info *pi, TARGET_ADDRESS *generation)
+{
+	struct r_debug debug;
+	struct link_map lm;
+	TARGET_ADDRESS hash = 14695981039346656037UL;
+	TARGET_ADDRESS entry;
+	int x;
+	int ret = 0;
+
+	ret = read_target_block((char*)&debug, sizeof(debug), pi, pi->r_debug_address);
+	if (ret) {
+		return ret;
+	}
+	if (RT_CONSISTENT != debug.r_state) {
+		return EAGAIN;
+	}
+	entry = (TARGET_ADDRESS)debug.r_map;
+	for (x = 0; entry && x < MAX_LINK_MAP_ENTRIES; x++) {
+		ret = read_target_block((char*)&lm, sizeof(lm), pi, entry);
+		if (ret) {
+			return ret;
+		}
+		hash = (hash ^ entry) * 1099511628211UL;
+		hash = (hash ^ (TARGET_ADDRESS)lm.l_addr) * 1099511628211UL;
+		hash = (hash ^ (TARGET_ADDRESS)lm.l_name) * 1099511628211UL;
+		entry = (TARGET_ADDRESS)lm.l_next;
+	}
+	*generation = hash;
+	return 0;
+}
+
+/* A position independent executable is loaded anywhere, like a library.
+   Its bias is where the start of its file is mapped, less where it would be
+   without one: 0 for an ordinary executable. */
+static TARGET_ADDRESS grok_exe_bias(process_info *pi, const char *exe_file_name)
+{
+	char link_name[64];
+	char exe_path[PATH_MAX];
+	const char *mapped_path = pi->exe_path;
+	TARGET_ADDRESS start = 0, end = 0;
+	ssize_t length;
+	int x;
+
+	if (NULL == mapped_path) {
+		sprintf(link_name, "/proc/%d/exe", pi->pid);
+		length = readlink(link_name, exe_path, sizeof(exe_path) - 1);
+		if (length < 0) {
+			return 0;
+		}
+		exe_path[length] = '\0';
+		mapped_path = exe_path;
+	}
+	if (grok_memory_maps(pi) || read_link_extent(exe_file_name, &start, &end)) {
+		return 0;
+	}
+	for (x = 0; x < pi->number_of_maps; x++) {
+		if (0 == pi->maps[x].offset && 0 == strcmp(pi->maps[x].path, mapped_path)) {
+			log(DEBUG, "Executable mapped at 0x%lx, bias 0x%lx\n", pi->maps[x].start, pi->maps[x].start - start);
+			return pi->maps[x].start - start;
+		}
+	}
+	return 0;
+}
+
+int grok_symbols(process_info *pi)
+{
+	int ret = 0;
+	/* There are symbols in the executable, and also in any dynamic libraries it has loaded 
+	   So we first get the executable's symbols, then look for dynamic libraries and get those too.
+	 */
+	/* First fill in the process executable file */
+	char exe_file_name[PATH_MAX];
+	
+	if (pi->exe_path) {
+		snprintf(exe_file_name, sizeof(exe_file_name), "%s", pi->exe_path);
+	} else {
+		sprintf(exe_file_name,"/proc/%d/exe",pi->pid);
+	}
+	log(DEBUG, "Fetching symbols from executable: %s\n", exe_file_name);
+	ret = get_file_symbols(pi,exe_file_name,grok_exe_bias(pi,exe_file_name));
+	if (!ret) {
+		if (dynamic_libs_present(pi)) {
+			int more_libs_to_check = 1;
+			char *so_file_name = NULL;
+			TARGET_ADDRESS base_address;
+			/* Taken first, so that a change during the walk shows up later */
+			if (grok_link_map_generation(pi, &pi->link_map_generation)) {
+				pi->link_map_generation = 0;
+			}
+			while(more_libs_to_check) {
+				ret = get_next_so_file_name(&so_file_name,pi,&base_address,&more_libs_to_check);
+				if (ret) {
+					return ret;
+				}
+				if (!more_libs_to_check) {
+					break;
+				}
+				if (strlen(so_file_name) > 0) {
+					log(DEBUG, "Fetching symbols from shared object: %s\n", so_file_name);
+					get_file_symbols(pi,so_file_name, base_address);
+				} else {
+					log(DEBUG, "Skipping zero length so file name\n");
+				}
+			}
+		}
+	}
+	if (!ret) {
+		/* JIT compiled code, which has no file to read symbols from */
+		grok_perf_map(pi);
+	}
+	return ret;
+}
+
+/* Drop the modules and everything derived from them, for grok_symbols to
+   start over. The images stay cached, so unchanged files aren't read again. */
+static void forget_symbols(process_info *pi)
+{
+	pi->number_of_modules = 0;
+	pi->module_ranges = NULL;
+	pi->number_of_module_ranges = 0;
+	pi->maps = NULL;
+	pi->number_of_maps = 0;
+	pi->link_map_head = 0;
+	pi->link_map_current = 0;
+	pi->r_debug_address = 0;
+	pi->link_map_generation = 0;
+}
+
+/* Load the symbols while the target is still running, so that stopping it
+   only has to cover the stacks. Nothing is attached to PEEKDATA through yet,
+   so memory is read the way blocked sampling reads it. */
+static int preload_symbols(process_info *pi)
+{
+	int ret = 0;
+	open_blocked_target(pi);
+	ret = grok_symbols(pi);
+	pi->ops = NULL;
+	if (ret) {
+		log(DEBUG, "Failed to load symbols before attaching: %s\n", strerror(ret));
+		forget_symbols(pi);
+	}
+	return ret;
+}
+
+/* Once attached, make sure the preloaded symbols still describe the target,
+   and load them again if libraries came or went in the meantime */
+static int reconcile_symbols(process_info *pi)
+{
+	TARGET_ADDRESS generation = 0;
+	int ret = 0;
+
+	if (pi->number_of_modules) {
+		if (0 == pi->r_debug_address) {
+			/* No dynamic linker, or it hasn't run yet; JIT code may
+			   have been added all the same */
+			return grok_perf_map(pi);
+		}
+		ret = grok_link_map_generation(pi, &generation);
+		if (!ret && generation == pi->link_map_generation) {
+			log(DEBUG, "The link map hasn't changed since the symbols were loaded\n");
+			return grok_perf_map(pi);
+		}
+		log(DEBUG, "The link map changed since the symbols were loaded, loading them again\n");
+		forget_symbols(pi);
+	}
+	return grok_symbols(pi);
+}
+
+/* A core file has no live link map to walk, but its NT_FILE note lists every
+   mapped file; the mapping of offset 0 gives each one's load address */
+int grok_core_symbols(process_info *pi)
+{
+	memory_map *files = NULL;
+	int number_of_files = 0;
+	int x, y;
+
+	grok_core_files_mapped(pi, &files, &number_of_files);
+	for (x = 0; x < number_of_files; x++) {
+		TARGET_ADDRESS base = 0, end = 0;
+		int seen = 0;
+		if (0 != files[x].offset) {
+			continue;
+		}
+		for (y = 0; y < x && !seen; y++) {
+			seen = 0 == files[y].offset && 0 == strcmp(files[y].path, files[x].path);
+		}
+		if (seen || read_link_extent(files[x].path, &base, &end)) {
+			continue;
+		}
+		log(DEBUG, "Fetching symbols from mapped file: %s\n", files[x].path);
+		get_file_symbols(pi, files[x].path, files[x].start - base);
+	}
+	return 0;
+}
+
+static void fatal(char* s)
+{
+	log(ERROR, "lsstack: fatal error: %s\n", s);
+	exit(0);
+}
+
+static void usage()
+{
+	printf("lsstack: [-v] [-D] [--stats] [--full-walk] [-f] [-s] [-b] [-K] [-H] [-t trigger] [-k snapshots] [-n threads] [-u unwinder] [-p peridod_in_ms] [-j jitter_percent] [-o file_to_append] [-F format] [-R recording] {<pid> [<pid> ...] | -e program arguments | -A pid | -C core | -P recording}\n");
+	printf("  --stats  print ptrace, read, symbol loading and timing counters at exit,\n");
+	printf("      or after every iteration with -p\n");
+	printf("  --full-walk  walk every frame of every sample; by default a frame pointer\n");
+	printf("      walk stops where a thread's chain joins the one of its last sample\n");
+	printf("  -f  report threads blocked in futex waits, grouped by lock address\n");
+	printf("  -s  stop and sample one thread at a time instead of the whole process;\n");
+	printf("      stacks are no longer a consistent snapshot (ignored with -f)\n");
+	printf("  -b  like -s, but threads blocked in a system call are walked from\n");
+	printf("      /proc/<tid>/syscall and a copy of their stack without being stopped;\n");
+	printf("      only running threads are attached to (frame pointers only)\n");
+	printf("  -K  show each thread's state, wait channel and kernel frames (these take\n");
+	printf("      root) above its user frames, read just before the process is stopped\n");
+	printf("  -H  report how deep each thread's stack is and has ever been (the lowest\n");
+	printf("      page of its mapping ever touched), with its stack, to size stacks by\n");
+	printf("  -t  poll /proc every -p ms (100 by default) without attaching, and dump only\n");
+	printf("      while one of these holds: cpu=PERCENT, running=MS (a thread stayed\n");
+	printf("      runnable that long), threads=+N (threads added since the last dump);\n");
+	printf("      conditions are comma separated, e.g. -t cpu=90,running=500\n");
+	printf("  -k  take this many snapshots -p ms apart (500 by default) and report stuck\n");
+	printf("      and spinning threads, and the distinct stacks of the others\n");
+	printf("  -n  only stop and walk the N threads that used the most CPU time since the\n");
+	printf("      last sample (since they started, without -p), weighted by that time\n");
+	printf("  -A  read the samples a process started with LD_PRELOAD=liblsstack-agent.so\n");
+	printf("      takes of itself (every LSSTACK_AGENT_PERIOD_MS ms of CPU time, 10 by\n");
+	printf("      default), and print them counted by stack every -p ms (1000 by\n");
+	printf("      default); the process is never stopped (frame pointers only)\n");
+	printf("  -C  print the stacks of the threads in an ELF core file\n");
+	printf("  -R  log every register set and memory range read from the targets to a file\n");
+	printf("  -P  replay a file written with -R: the same dumps, from the logged reads\n");
+	printf("      alone (frame pointers only)\n");
+	printf("  -F  legacy (default): stacks as log lines on stderr; text: the same lines\n");
+	printf("      without the log prefix, on stdout; json: JSON Lines on stdout, one\n");
+	printf("      object per thread with its frames' module, symbol and offset; folded:\n");
+	printf("      one 'process;outer;...;inner 1' line per thread, for flame graphs\n");
+	printf("  -p  sample every this many ms, against fixed deadlines: a slow sample\n");
+	printf("      doesn't push the later ones back, and skipped deadlines are reported\n");
+	printf("  -j  move each deadline by up to this percentage of -p either way (at most\n");
+	printf("      50), so sampling doesn't lock onto periodic work in the target\n");
+	printf("  -u  fp, libunwind, snapshot or auto (default): auto walks frame pointers and\n");
+	printf("      switches to table-driven unwinding in modules built without them\n");
+	printf("lsstack: [options] -d socket\n");
+	printf("  serve 'dump <pid>' and 'profile <pid> <seconds>' requests on a Unix socket,\n");
+	printf("  keeping symbols and unwind strategies loaded between them (-p sets the\n");
+	printf("  profile sampling period, 100ms by default)\n");
+	printf("lsstack: -c socket dump <pid> | -c socket profile <pid> <seconds>\n");
+	printf("  send a request to a running daemon and print the reply\n");
+	exit(1);
+}
+
+/* The value of the option at *option_position, which is stepped over */
+static char *option_value(int argc, char **argv, int *option_position)
+{
+	if (*option_position + 1 >= argc) {
+		usage();
+	}
+	return argv[++*option_position];
+}
+
+/* Stuck thread helper functions */
+
+typedef struct _thread_progress {
+	int pid;
+	thread_stack **stacks; /* One per snapshot, NULL where the thread was missing */
+	unsigned long *ticks; /* utime + stime at each snapshot */
+} thread_progress;
+
+/* Whether two stacks agree from frame 'from' outwards */
+static int same_frames(thread_stack *a, thread_stack *b, int from)
+{
+	int x;
+	if (a->number_of_frames != b->number_of_frames) {
+		return 0;
+	}
+	for (x = from; x < a->number_of_frames; x++) {
+		if (a->frames[x].pc != b->frames[x].pc) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static thread_progress *find_thread_progress(thread_progress *threads, int number_of_threads, int thepid)
+{
+	int x;
+	for (x = 0; x < number_of_threads; x++) {
+		if (threads[x].pid == thepid) {
+			return &threads[x];
+		}
+	}
+	return NULL;
+}
+
+/* Take a number of snapshots some time apart and report, for each thread,
+   whether it is stuck (the same stack every time and no CPU time used),
+   spinning (using CPU while its callers never change) or neither, in which
+   case only its distinct stacks are printed. Everything stays in
+   snapshot_arena until the end so that symbols are resolved once over all
+   the snapshots.
+ */
+int grok_and_print_progress(int pid, int number_of_snapshots, int period)
+{
+	int ret = 0;
+	process_info *pi = NULL;
+	thread_progress *threads = NULL;
+	int number_of_threads = 0;
+	int threads_size = 0;
+	thread_stack *all_stacks = NULL;
+	int number_of_all_stacks = 0;
+	symbol_map map;
+	schedule s;
+	int stuck = 0, spinning = 0, moving = 0;
+	int x, y, z;
+
+	ret = start_schedule(&s, period, jitter_option);
+	if (ret) {
+		return ret;
+	}
+	for (x = 0; x < number_of_snapshots; x++) {
+		thread_stack *stacks = NULL;
+		int number_of_stacks = 0;
+
+		if (x) {
+			wait_for_deadline(&s);
+		}
+		if (NULL == pi) {
+			pi = pi_alloc(pid);
+			if (NULL == pi) fatal("failed to allocate process info structure\n");
+			preload_symbols(pi);
+		}
+		ret = attach_target(pid);
+		if (ret) {
+			break;
+		}
+		reconcile_symbols(pi);
+		grok_threads(pi);
+		grok_stacks(&stacks, &number_of_stacks, pi);
+		for (y = 0; y < number_of_stacks; y++) {
+			thread_progress *tp = find_thread_progress(threads, number_of_threads, stacks[y].pid);
+			char file_name[64];
+			char state;
+			long unused;
+			if (NULL == tp) {
+				if (number_of_threads == threads_size) {
+					thread_progress *temp;
+					threads_size = threads_size ? threads_size * 2 : 32;
+					temp = (thread_progress*) arena_alloc(&snapshot_arena, threads_size * sizeof(thread_progress));
+					if (NULL == temp) {
+						ret = ENOMEM;
+						break;
+					}
+					if (number_of_threads) {
+						memcpy(temp, threads, number_of_threads * sizeof(thread_progress));
+					}
+					threads = temp;
+				}
+				tp = &threads[number_of_threads++];
+				tp->pid = stacks[y].pid;
+				tp->stacks = (thread_stack**) arena_calloc(&snapshot_arena, number_of_snapshots, sizeof(thread_stack*));
+				tp->ticks = (unsigned long*) arena_calloc(&snapshot_arena, number_of_snapshots, sizeof(unsigned long));
+				if (NULL == tp->stacks || NULL == tp->ticks) {
+					ret = ENOMEM;
+					break;
+				}
+			}
+			tp->stacks[x] = &stacks[y];
+			sprintf(file_name, "/proc/%d/task/%d/stat", pid, stacks[y].pid);
+			read_stat_file(file_name, &state, &tp->ticks[x], &unused);
+		}
+		number_of_all_stacks += number_of_stacks;
+		detatch_target(pi);
+		pi->threads_present_flag = 0;
+		if (ret) {
+			break;
+		}
+	}
+	stop_schedule(&s);
+	if (0 == x) {
+		log(ERROR, "Failed to attach to the target process %d: %s\n", pid, strerror(ret));
+		pi_free(pi);
+		return ret;
+	}
+	if (x < number_of_snapshots) {
+		log(INFO, "Process %d: only %d of %d snapshots taken\n", pid, x, number_of_snapshots);
+		number_of_snapshots = x;
+	}
+
+	/* One symbol map over every snapshot */
+	all_stacks = (thread_stack*) arena_alloc(&snapshot_arena, (number_of_all_stacks + 1) * sizeof(thread_stack));
+	if (NULL == all_stacks) {
+		pi_free(pi);
+		return ENOMEM;
+	}
+	number_of_all_stacks = 0;
+	for (y = 0; y < number_of_threads; y++) {
+		for (x = 0; x < number_of_snapshots; x++) {
+			if (threads[y].stacks[x]) {
+				all_stacks[number_of_all_stacks++] = *threads[y].stacks[x];
+			}
+		}
+	}
+	if (grok_symbol_map(&map, pi, all_stacks, number_of_all_stacks)) {
+		pi_free(pi);
+		return ENOMEM;
+	}
+
+	for (y = 0; y < number_of_threads; y++) {
+		thread_progress *tp = &threads[y];
+		thread_stack *first = NULL;
+		int present = 0, same_stack = 1, same_callers = 1;
+		unsigned long first_ticks = 0, last_ticks = 0;
+		for (x = 0; x < number_of_snapshots; x++) {
+			if (NULL == tp->stacks[x]) {
+				continue;
+			}
+			if (NULL == first) {
+				first = tp->stacks[x];
+				first_ticks = tp->ticks[x];
+			} else {
+				same_stack = same_stack && same_frames(first, tp->stacks[x], 0);
+				same_callers = same_callers && same_frames(first, tp->stacks[x], 1);
+			}
+			last_ticks = tp->ticks[x];
+			present++;
+		}
+		if (present < 2) {
+			log(DEBUG, "LWP %d was only seen in %d snapshot(s)\n", tp->pid, present);
+			continue;
+		}
+		if (same_stack && last_ticks == first_ticks) {
+			stuck++;
+			output("LWP %d: stuck, same stack in %d snapshots and no CPU time used\n", tp->pid, present);
+			output_json_thread(pid, tp->pid);
+			output_json(",\"state\":\"stuck\",\"snapshots\":%d", present);
+			print_thread_stack(first, &map);
+		} else if (same_callers && last_ticks != first_ticks) {
+			spinning++;
+			output("LWP %d: spinning, same callers in %d snapshots and %lu ticks of CPU time used\n",
+				tp->pid, present, last_ticks - first_ticks);
+			output_json_thread(pid, tp->pid);
+			output_json(",\"state\":\"spinning\",\"snapshots\":%d,\"ticks\":%lu", present, last_ticks - first_ticks);
+			print_thread_stack(first, &map);
+		} else {
+			moving++;
+			output("LWP %d: making progress, %lu ticks of CPU time used\n", tp->pid, last_ticks - first_ticks);
+			for (x = 0; x < number_of_snapshots; x++) {
+				int seen = 0;
+				if (NULL == tp->stacks[x]) {
+					continue;
+				}
+				for (z = 0; z < x && !seen; z++) {
+					seen = tp->stacks[z] && same_frames(tp->stacks[z], tp->stacks[x], 0);
+				}
+				if (!seen) {
+					output_json_thread(pid, tp->pid);
+					output_json(",\"state\":\"moving\",\"snapshot\":%d,\"ticks\":%lu", x, last_ticks - first_ticks);
+					print_thread_stack(tp->stacks[x], &map);
+				}
+			}
+		}
+	}
+	output("Process %d, %d snapshots: %d stuck, %d spinning, %d making progress\n",
+		pid, number_of_snapshots, stuck, spinning, moving);
+	output_flush();
+	pi_free(pi);
+	arena_reset(&snapshot_arena);
+	return 0;
+}
+
+/* End of stuck thread helper functions */
+
+/* CPU-weighted sampling: only stop and walk the threads that used the most
+   CPU time since the last sample (or since they started, for the first one),
+   and weight each stack by the ticks it stands for. Idle threads are never
+   attached to, so this is cheap on processes with thousands of threads.
+ */
+static int dump_busy_threads(int pid)
+{
+	int ret = 0;
+	process_info *pi = NULL;
+	int *busy_pids = NULL;
+	unsigned long *busy_ticks = NULL;
+	unsigned long total_ticks = 0;
+	int number_of_busy = 0;
+	int number_of_stopped = 0;
+	thread_stack *stacks = NULL;
+	symbol_map map;
+	char name[64] = "";
+	int x;
+
+	busy_pids = (int*) arena_calloc(&snapshot_arena, top_option + 1, sizeof(int));
+	busy_ticks = (unsigned long*) arena_calloc(&snapshot_arena, top_option, sizeof(unsigned long));
+	stacks = (thread_stack*) arena_calloc(&snapshot_arena, top_option, sizeof(thread_stack));
+	if (NULL == busy_pids || NULL == busy_ticks || NULL == stacks) {
+		return ENOMEM;
+	}
+	ret = grok_busy_threads(pid, top_option, busy_pids, busy_ticks, &number_of_busy);
+	if (ret) {
+		return ret;
+	}
+	if (0 == number_of_busy) {
+		output("Process %d: no thread used CPU time since the last sample\n", pid);
+		output_flush();
+		arena_reset(&snapshot_arena);
+		return 0;
+	}
+
+	pi = pi_alloc(pid);
+	if (NULL == pi) fatal("failed to allocate process info structure\n");
+	preload_symbols(pi);
+
+	/* Stop just the busy threads; any of them will do for reading memory */
+	for (x = 0; x < number_of_busy; x++) {
+		if (stop_one_thread(busy_pids[x])) {
+			log(DEBUG, "Thread %d is gone\n", busy_pids[x]);
+			continue;
+		}
+		busy_pids[number_of_stopped] = busy_pids[x];
+		busy_ticks[number_of_stopped] = busy_ticks[x];
+		total_ticks += busy_ticks[x];
+		number_of_stopped++;
+	}
+	busy_pids[number_of_stopped] = 0;
+	if (0 == number_of_stopped) {
+		pi_free(pi);
+		arena_reset(&snapshot_arena);
+		return 0;
+	}
+
+	pi->peek_pid = busy_pids[0];
+	reconcile_symbols(pi);
+	for (x = 0; x < number_of_stopped; x++) {
+		unwind_thread_stack(&stacks[x], pi, busy_pids[x], unwinder_option);
+	}
+	for (x = 0; x < number_of_stopped; x++) {
+		counted_ptrace(PTRACE_DETACH, busy_pids[x], 0, 0);
+	}
+
+	if (!grok_symbol_map(&map, pi, stacks, number_of_stopped)) {
+		if (OUTPUT_FOLDED == output_format) {
+			grok_process_name(pid, name, sizeof(name));
+		}
+		for (x = 0; x < number_of_stopped; x++) {
+			/* Folded lines are weighted by the CPU time, not counted once */
+			stacks[x].samples = busy_ticks[x];
+			output_folded_frame(name, strlen(name), "");
+			output("LWP %d: %lu ticks, %lu%% of the sampled CPU time\n", busy_pids[x],
+				busy_ticks[x], busy_ticks[x] * 100 / total_ticks);
+			output_json_thread(pid, busy_pids[x]);
+			output_json(",\"ticks\":%lu", busy_ticks[x]);
+			print_thread_stack(&stacks[x], &map);
+		}
+		output_flush();
+	} else {
+		ret = ENOMEM;
+	}
+	pi_free(pi);
+	arena_reset(&snapshot_arena);
+	return ret;
+}
+
+/* -H: how deep each thread's stack is now and has ever been, next to its
+   stack as it is now, to size thread stacks by. The depths are measured from
+   the page tables once the process runs again; they can only have grown in
+   the meantime. */
+static int dump_stack_usage(int pid)
+{
+	int ret = 0;
+	process_info *pi = NULL;
+	thread_stack *stacks = NULL;
+	int number_of_stacks = 0;
+	stack_usage *usage = NULL;
+	TARGET_ADDRESS deepest = 0, largest = 0, enough = 0;
+	symbol_map map;
+	int x;
+
+	pi = pi_alloc(pid);
+	if (NULL == pi) fatal("failed to allocate process info structure\n");
+	preload_symbols(pi);
+	ret = attach_target(pid);
+	if (ret) {
+		pi_free(pi);
+		arena_reset(&snapshot_arena);
+		return ret;
+	}
+	reconcile_symbols(pi);
+	grok_threads(pi);
+	grok_stacks(&stacks, &number_of_stacks, pi);
+	detatch_target(pi);
+	if (NULL == stacks) {
+		pi_free(pi);
+		arena_reset(&snapshot_arena);
+		return ENOMEM;
+	}
+
+	/* Threads started since the symbols were loaded have new stack mappings */
+	pi->maps = NULL;
+	pi->number_of_maps = 0;
+	pi->module_ranges = NULL;
+	pi->number_of_module_ranges = 0;
+	grok_memory_maps(pi);
+	usage = (stack_usage*) arena_calloc(&snapshot_arena, number_of_stacks, sizeof(stack_usage));
+	if (NULL == usage || grok_symbol_map(&map, pi, stacks, number_of_stacks)) {
+		pi_free(pi);
+		arena_reset(&snapshot_arena);
+		return ENOMEM;
+	}
+	for (x = 0; x < number_of_stacks; x++) {
+		if (0 == stacks[x].number_of_frames || grok_stack_usage(&usage[x], pi, stacks[x].frames[0].sp)) {
+			log(DEBUG, "No stack mapping found for thread %d\n", stacks[x].pid);
+			continue;
+		}
+		if (usage[x].peak_depth > deepest) {
+			deepest = usage[x].peak_depth;
+		}
+		if (usage[x].end - usage[x].start > largest) {
+			largest = usage[x].end - usage[x].start;
+		}
+	}
+
+	for (x = 0; x < number_of_stacks; x++) {
+		stack_usage *u = &usage[x];
+		output("LWP %d: stack 0x%016lx-0x%016lx, %lu KB, %lu KB deep now, %lu KB at most (%s)\n",
+			stacks[x].pid, u->start, u->end, (u->end - u->start) / 1024, u->depth / 1024, u->peak_depth / 1024,
+			stack_usage_method_name(u->method));
+		output_json_thread(pid, stacks[x].pid);
+		output_json(",\"stack_start\":\"0x%lx\",\"stack_size\":%lu,\"depth\":%lu,\"peak_depth\":%lu,\"method\":\"%s\"",
+			u->start, u->end - u->start, u->depth, u->peak_depth, stack_usage_method_name(u->method));
+		print_thread_stack(&stacks[x], &map);
+	}
+	/* Twice the deepest, in 64 KB steps */
+	enough = (2 * deepest + 0xffff) & ~(TARGET_ADDRESS)0xffff;
+	output("Process %d: %d threads, deepest stack %lu KB of the %lu KB largest; %lu KB holds it twice over\n",
+		pid, number_of_stacks, deepest / 1024, largest / 1024, enough / 1024);
+	output_flush();
+	pi_free(pi);
+	arena_reset(&snapshot_arena);
+	return 0;
+}
+
+/* Print the stacks of every thread in a core file. Only the frame pointer
+   walk is available, the libunwind backends need a live process. */
+static int dump_core(const char *path)
+{
+	int ret = 0;
+	process_info *pi = pi_alloc(0);
+	if (NULL == pi) fatal("failed to allocate process info structure\n");
+
+	ret = open_core_file(pi, path);
+	if (ret) {
+		free(pi);
+		return ret;
+	}
+	if (UNWINDER_FP != unwinder_option) {
+		log(DEBUG, "Using the frame pointer unwinder for core files\n");
+		unwinder_option = UNWINDER_FP;
+	}
+	/* Both would look for the core's pid among the live processes */
+	stagger_option = 0;
+	blocked_option = 0;
+	grok_core_symbols(pi);
+	ret = grok_and_print_stacks(pi);
+	close_core_file(pi);
+	pi_free(pi);
+	arena_reset(&snapshot_arena);
+	return ret;
+}
+
+/* Print the stacks of every dump in a recording, from the recorded reads
+   alone. Like a core file it has no process behind it to ask for unwind
+   tables, so only the frame pointer walk replays. */
+static int dump_replay(const char *path)
+{
+	int number_of_processes = 0;
+	int ret = 0;
+	int x;
+
+	ret = open_replay_file(path, &number_of_processes);
+	if (UNWINDER_FP != unwinder_option) {
+		log(DEBUG, "Using the frame pointer unwinder for replay\n");
+		unwinder_option = UNWINDER_FP;
+	}
+	stagger_option = 0;
+	blocked_option = 0;
+	for (x = 0; !ret && x < number_of_processes; x++) {
+		process_info *pi = pi_alloc(0);
+		if (NULL == pi) fatal("failed to allocate process info structure\n");
+		open_replay_process(pi, x);
+		grok_symbols(pi);
+		ret = grok_and_print_stacks(pi);
+		pi_free(pi);
+		arena_reset(&snapshot_arena);
+	}
+	close_replay_file();
+	return ret;
+}
+
+/* Attach to one process, print its stacks and let it go again. Module images
+   stay loaded in image_arena afterwards, so later processes (or later polls of
+   the same one, or later daemon requests) mapping the same files skip reading
+   their symbol tables.
+ */
+int dump_process(int pid)
+{
+	int ret = 0;
+	struct timespec start;
+	process_info *pi = NULL;
+	thread_stack *stacks = NULL;
+	int number_of_stacks = 0;
+
+	if (blocked_option && !futex_option) {
+		/* Nothing is attached to up front, or at all if every thread is blocked */
+		pi = pi_alloc(pid);
+		if (NULL == pi) fatal("failed to allocate process info structure\n");
+		open_blocked_target(pi);
+		record_process(pi);
+		ret = grok_symbols(pi);
+		if (!ret) {
+			if (kernel_option) {
+				grok_kernel_stacks(pid);
+			}
+			ret = grok_and_print_stacks(pi);
+		}
+		pi_free(pi);
+		arena_reset(&snapshot_arena);
+		return ret;
+	}
+
+	pi = pi_alloc(pid);
+	if (NULL == pi) fatal("failed to allocate process info structure\n");
+	record_process(pi);
+
+	/* Symbols are loaded while the target runs, so that it is only stopped
+	   for as long as it takes to capture the stacks */
+	ret = preload_symbols(pi);
+	
+	if (stagger_option && !futex_option) {
+		/* Threads are stopped one by one from here. Without the symbols, the
+		   process is attached to just long enough to load them. */
+		if (ret) {
+			ret = attach_target(pid);
+			if (!ret) {
+				ret = grok_symbols(pi);
+				detatch_target(pi);
+			}
+		}
+		if (kernel_option) {
+			grok_kernel_stacks(pid);
+		}
+		ret = grok_and_print_stacks(pi);
+	} else {
+		/* Once stopped, every thread's kernel stack is the ptrace stop */
+		if (kernel_option) {
+			grok_kernel_stacks(pid);
+		}
+
+		/* See if we can attach to the target */
+		start_timer(&start);
+		ret = attach_target(pid);
+		if (ret) {
+			pi_free(pi);
+			arena_reset(&snapshot_arena);
+			return ret;
+		}
+		stop_timer(&start, STATS_ATTACH);
+		
+		log(DEBUG, "Attached to target process\n");
+		
+		ret = reconcile_symbols(pi);
+		if (ret) {
+			log(ERROR, "Failed to load the symbols of process %d again, its stacks will be printed without them\n", pid);
+		}
+
+		start_timer(&start);
+		ret = grok_threads(pi);
+		stop_timer(&start, STATS_ATTACH);
+
+		if (futex_option) {
+			ret = grok_and_print_futex_contention(pi);
+			detatch_target(pi);
+		} else {
+			/* The target only stays stopped for the walk, not for
+			   symbolizing or for however long the output takes */
+			ret = grok_process_stacks(&stacks, &number_of_stacks, pi);
+			detatch_target(pi);
+			if (NULL != stacks) {
+				ret = print_process_stacks(pi, stacks, number_of_stacks);
+			}
+		}
+	}
+	
+	pi_free(pi);
+	arena_reset(&snapshot_arena);
+	
+	log(DEBUG, "Detatched from target process\n");
+	return ret;
+}
+
+/* Launch and follow helper functions */
+
+/* Every task we trace in -e mode, threads and child processes alike */
+typedef struct _followed_task {
+	int pid;
+	int tgid;
+	int new_task; /* Still owes us the SIGSTOP every new tracee starts with */
+	int in_vfork; /* Can't stop until its vfork child execs or exits */
+	int sample_pending; /* Sent SIGSTOP for a sample, waiting for the stop */
+	int stopped;
+} followed_task;
+
+static followed_task *followed_tasks = NULL;
+static int number_of_followed_tasks = 0;
+static int followed_tasks_size = 0;
+
+static followed_task *find_followed_task(int thepid)
+{
+	int x;
+	for (x = 0; x < number_of_followed_tasks; x++) {
+		if (followed_tasks[x].pid == thepid) {
+			return &followed_tasks[x];
+		}
+	}
+	return NULL;
+}
+
+static followed_task *add_followed_task(int thepid, int tgid)
+{
+	followed_task *task = NULL;
+	if (number_of_followed_tasks == followed_tasks_size) {
+		int size = followed_tasks_size ? followed_tasks_size * 2 : 32;
+		followed_task *temp = (followed_task*) realloc(followed_tasks, size * sizeof(followed_task));
+		if (NULL == temp) {
+			fatal("failed to allocate followed tasks\n");
+		}
+		followed_tasks = temp;
+		followed_tasks_size = size;
+	}
+	task = &followed_tasks[number_of_followed_tasks++];
+	memset(task, 0, sizeof(*task));
+	task->pid = thepid;
+	task->tgid = tgid;
+	return task;
+}
+
+static void remove_followed_task(followed_task *task)
+{
+	*task = followed_tasks[--number_of_followed_tasks];
+}
+
+static int read_task_tgid(int thepid)
+{
+	char file_name[64];
+	char line[128];
+	int tgid = thepid;
+	FILE *fp = NULL;
+	sprintf(file_name, "/proc/%d/status", thepid);
+	fp = fopen(file_name, "r");
+	if (NULL == fp) {
+		return tgid;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (1 == sscanf(line, "Tgid: %d", &tgid)) {
+			break;
+		}
+	}
+	fclose(fp);
+	return tgid;
+}
+
+/* All the tasks we asked to stop have stopped: walk them a process at a time,
+   then let them all go again. Symbols are re-read for every sample, which is
+   cheap with the module image cache, and keeps up with dlopen() and exec. */
+static void sample_followed_tasks(int sample, long elapsed)
+{
+	int x, y;
+
+	output("Sample %d, %ld ms after start:\n", sample, elapsed);
+	for (x = 0; x < number_of_followed_tasks; x++) {
+		followed_task *first = &followed_tasks[x];
+		process_info *pi = NULL;
+		thread_stack *stacks = NULL;
+		int number_of_stacks = 0;
+		symbol_map map;
+		int seen = 0;
+
+		if (!first->stopped) {
+			continue;
+		}
+		for (y = 0; y < x && !seen; y++) {
+			seen = followed_tasks[y].stopped && followed_tasks[y].tgid == first->tgid;
+		}
+		if (seen) {
+			continue;
+		}
+		pi = pi_alloc(first->tgid);
+		if (NULL == pi) fatal("failed to allocate process info structure\n");
+		pi->peek_pid = first->pid;
+		grok_symbols(pi);
+		stacks = (thread_stack*) arena_calloc(&snapshot_arena, number_of_followed_tasks, sizeof(thread_stack));
+		if (NULL == stacks) {
+			pi_free(pi);
+			break;
+		}
+		for (y = x; y < number_of_followed_tasks; y++) {
+			if (followed_tasks[y].stopped && followed_tasks[y].tgid == first->tgid) {
+				unwind_thread_stack(&stacks[number_of_stacks++], pi, followed_tasks[y].pid, unwinder_option);
+			}
+		}
+		if (!grok_symbol_map(&map, pi, stacks, number_of_stacks)) {
+			output("Process %d:\n", pi->pid);
+			for (y = 0; y < number_of_stacks; y++) {
+				output("LWP %d%s:\n", stacks[y].pid, stacks[y].pid == pi->pid ? " (initial thread)" : "");
+				output_json_thread(pi->pid, stacks[y].pid);
+				output_json(",\"sample\":%d,\"elapsed\":%ld", sample, elapsed);
+				if (stacks[y].pid == pi->pid) {
+					output_json(",\"thread\":\"initial\"");
+				}
+				print_thread_stack(&stacks[y], &map);
+			}
+		}
+		pi_free(pi);
+	}
+	arena_reset(&snapshot_arena);
+
+	for (x = 0; x < number_of_followed_tasks; x++) {
+		followed_task *task = &followed_tasks[x];
+		if (task->stopped) {
+			counted_ptrace(PTRACE_CONT, task->pid, 0, 0);
+		}
+		task->stopped = 0;
+		task->sample_pending = 0;
+	}
+	output_flush();
+}
+
+/* Handle one waitpid() report from a tracee. Everything but the stops we
+   asked for is resumed at once; signals other than SIGSTOP are passed on. */
+static void handle_followed_event(int thepid, int status, int *started)
+{
+	followed_task *task = find_followed_task(thepid);
+	int event = status >> 16;
+	int x;
+
+	if (NULL == task) {
+		/* A new tracee can report before its parent's clone event does */
+		task = add_followed_task(thepid, read_task_tgid(thepid));
+		task->new_task = 1;
+	}
+	if (WIFEXITED(status) || WIFSIGNALED(status)) {
+		log(DEBUG, "Task %d is gone\n", thepid);
+		remove_followed_task(task);
+		return;
+	}
+	if (!WIFSTOPPED(status)) {
+		return;
+	}
+	if (event) {
+		unsigned long message = 0;
+		counted_ptrace(PTRACE_GETEVENTMSG, thepid, 0, &message);
+		switch (event) {
+			case PTRACE_EVENT_CLONE:
+			case PTRACE_EVENT_FORK:
+			case PTRACE_EVENT_VFORK:
+				if (NULL == find_followed_task((int)message)) {
+					followed_task *child = add_followed_task((int)message, read_task_tgid((int)message));
+					child->new_task = 1;
+					/* add_followed_task may have moved the array */
+					task = find_followed_task(thepid);
+				}
+				task->in_vfork = PTRACE_EVENT_VFORK == event;
+				log(DEBUG, "Task %d created %s %lu\n", thepid,
+					PTRACE_EVENT_CLONE == event ? "thread" : "process", message);
+				break;
+			case PTRACE_EVENT_VFORK_DONE:
+				task->in_vfork = 0;
+				break;
+			case PTRACE_EVENT_EXEC:
+				/* The exec'ing thread now runs as the leader and its siblings are gone */
+				for (x = 0; x < number_of_followed_tasks; ) {
+					if (followed_tasks[x].tgid == task->tgid && followed_tasks[x].pid != task->tgid) {
+						remove_followed_task(&followed_tasks[x]);
+					} else {
+						x++;
+					}
+				}
+				task = find_followed_task(thepid);
+				task->new_task = 0;
+				unwind_forget_process(task->tgid);
+				forget_frame_chains(task->tgid);
+				log(INFO, "Process %d executed a new program\n", task->tgid);
+				*started = 1;
+				break;
+		}
+		counted_ptrace(PTRACE_CONT, thepid, 0, 0);
+		return;
+	}
+	if (SIGSTOP == WSTOPSIG(status)) {
+		if (task->sample_pending) {
+			task->stopped = 1;
+			task->new_task = 0;
+			return;
+		}
+		/* Either the initial stop of a new tracee, or a stop that isn't ours.
+		   Passing SIGSTOP on would put the task in a group stop we can't tell
+		   apart from this one, so it is dropped. */
+		task->new_task = 0;
+		counted_ptrace(PTRACE_CONT, thepid, 0, 0);
+		return;
+	}
+	counted_ptrace(PTRACE_CONT, thepid, 0, WSTOPSIG(status));
+}
+
+/* -e: start the program under ptrace, follow its threads and children through
+   clone, fork and exec, and sample all of them every -p ms (10 by default)
+   from the first instruction of the program until the last of them exits. */
+static int follow_program(char **program)
+{
+	sigset_t sigchld;
+	struct timespec start, now;
+	int period = period_option ? period_option : 10;
+	long next_sample = 0;
+	int sampling = 0;
+	int started = 0;
+	int samples = 0;
+	int status = 0;
+	int child;
+
+	/* SIGCHLD stays blocked so that we can wait for it with a timeout */
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigchld, NULL);
+
+	child = fork();
+	if (child < 0) {
+		log(ERROR, "Failed to fork: %s\n", strerror(errno));
+		return errno;
+	}
+	if (0 == child) {
+		sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
+		counted_ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+		/* Wait here for the parent to set the trace options */
+		raise(SIGSTOP);
+		execvp(program[0], program);
+		log(ERROR, "Failed to execute %s: %s\n", program[0], strerror(errno));
+		_exit(127);
+	}
+	if (waitpid(child, &status, __WALL) != child || !WIFSTOPPED(status)) {
+		log(ERROR, "Child %d did not stop for tracing\n", child);
+		return ECHILD;
+	}
+	if (counted_ptrace(PTRACE_SETOPTIONS, child, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+			PTRACE_O_TRACEVFORK | PTRACE_O_TRACEVFORKDONE | PTRACE_O_TRACEEXEC) < 0) {
+		log(ERROR, "Failed to set trace options: %s\n", strerror(errno));
+		kill(child, SIGKILL);
+		return errno;
+	}
+	add_followed_task(child, child);
+	counted_ptrace(PTRACE_CONT, child, 0, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (number_of_followed_tasks) {
+		long elapsed;
+		int thepid;
+		int x;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+		if (started && !sampling && elapsed >= next_sample) {
+			for (x = 0; x < number_of_followed_tasks; x++) {
+				followed_task *task = &followed_tasks[x];
+				if (task->in_vfork) {
+					continue;
+				}
+				if (0 == syscall(SYS_tgkill, task->tgid, task->pid, SIGSTOP)) {
+					task->sample_pending = 1;
+				}
+			}
+			sampling = 1;
+			next_sample += period;
+			count_deadlines(1, 0);
+			if (next_sample < elapsed) {
+				count_deadlines(0, (elapsed - next_sample) / period + 1);
+				next_sample = elapsed + period;
+			}
+		}
+		if (sampling) {
+			int waiting = 0;
+			for (x = 0; x < number_of_followed_tasks; x++) {
+				waiting += followed_tasks[x].sample_pending && !followed_tasks[x].stopped;
+			}
+			if (!waiting) {
+				sample_followed_tasks(++samples, elapsed);
+				sampling = 0;
+				continue;
+			}
+		}
+
+		thepid = waitpid(-1, &status, __WALL | WNOHANG);
+		if (thepid < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			break;
+		}
+		if (0 == thepid) {
+			struct timespec timeout = { 0, 100 * 1000000 };
+			if (started && !sampling && next_sample > elapsed) {
+				timeout.tv_sec = (next_sample - elapsed) / 1000;
+				timeout.tv_nsec = ((next_sample - elapsed) % 1000) * 1000000;
+			}
+			sigtimedwait(&sigchld, NULL, &timeout);
+			continue;
+		}
+		handle_followed_event(thepid, status, &started);
+	}
+	log(INFO, "Followed %s to the end, %d samples\n", program[0], samples);
+	return 0;
+}
+
+/* End of launch and follow helper functions */
+
+/* Agent ring consumer helper functions */
+
+/* -A: the process samples itself through liblsstack-agent.so (agent.c), and
+   never stops. Every -p ms (1000 by default) the samples it put in its ring
+   since the last time are taken out, identical stacks counted together, and
+   symbolized from the outside, with memory read the way -b reads it. */
+
+static agent_ring *open_agent_ring(int pid, size_t *size, uint64_t *number_of_slots)
+{
+	char name[64];
+	struct stat st;
+	agent_ring *ring = NULL;
+	uint64_t slots = 0;
+	int fd;
+
+	sprintf(name, AGENT_RING_PREFIX "%d", pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		log(ERROR, "No sampling agent ring for process %d: %s (is it running with LD_PRELOAD=liblsstack-agent.so?)\n",
+			pid, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(agent_ring)) {
+		close(fd);
+		log(ERROR, "The sampling agent ring of process %d is not set up\n", pid);
+		return NULL;
+	}
+	ring = (agent_ring*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == ring) {
+		log(ERROR, "Failed to map the sampling agent ring of process %d: %s\n", pid, strerror(errno));
+		return NULL;
+	}
+	/* The slot count is used as a mask, and taken once: the process can
+	   write to the ring at any time */
+	if (AGENT_RING_MAGIC == __atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE)) {
+		slots = ring->number_of_slots;
+	}
+	if (ring->pid != pid || 0 == slots || (slots & (slots - 1))
+			|| slots > ((size_t)st.st_size - sizeof(agent_ring)) / sizeof(agent_sample)) {
+		log(ERROR, "The sampling agent ring of process %d is not set up\n", pid);
+		munmap(ring, st.st_size);
+		return NULL;
+	}
+	*size = st.st_size;
+	*number_of_slots = slots;
+	return ring;
+}
+
+/* Take the samples from *tail up to the ring's head. The ring may have gone
+   round since, and slots may be rewritten as they are copied; such samples
+   are counted in *lost. A sample still being written ends the batch, unless
+   it is so far behind the head that its writer can't be alive. */
+static int drain_agent_ring(agent_ring *ring, uint64_t slots, uint64_t *tail, thread_stack **stacks, int *number_of_stacks, unsigned long *lost)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t n;
+
+	*number_of_stacks = 0;
+	if (head - *tail > slots) {
+		*lost += head - slots - *tail;
+		*tail = head - slots;
+	}
+	*stacks = (thread_stack*) arena_calloc(&snapshot_arena, head - *tail + 1, sizeof(thread_stack));
+	if (NULL == *stacks) {
+		return ENOMEM;
+	}
+	for (n = *tail; n < head; n++) {
+		const agent_sample *slot = &ring->slots[n & (slots - 1)];
+		agent_sample sample;
+		thread_stack *ts = NULL;
+		uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		int x;
+
+		if (sequence < 2 * n + 2) {
+			if (head - n < slots / 2) {
+				break;
+			}
+			(*lost)++;
+			continue;
+		}
+		memcpy(&sample, slot, sizeof(sample));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (sequence != 2 * n + 2 || __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) {
+			(*lost)++;
+			continue;
+		}
+		if (sample.number_of_frames < 1 || sample.number_of_frames > AGENT_MAX_FRAMES) {
+			continue;
+		}
+		ts = &(*stacks)[(*number_of_stacks)++];
+		ts->pid = sample.tid;
+		ts->reached_top = 1;
+		for (x = 0; x < sample.number_of_frames; x++) {
+			stack_frame *frame = thread_stack_add_frame(ts);
+			if (NULL == frame) {
+				return ENOMEM;
+			}
+			frame->pc = sample.pcs[x];
+			frame->number_of_arguments = -1;
+		}
+	}
+	*tail = n;
+	return 0;
+}
+
+static int compare_sampled_stacks(const void *a, const void *b)
+{
+	const thread_stack *x = (const thread_stack*)a;
+	const thread_stack *y = (const thread_stack*)b;
+	int z;
+	if (x->number_of_frames != y->number_of_frames) {
+		return x->number_of_frames - y->number_of_frames;
+	}
+	for (z = 0; z < x->number_of_frames; z++) {
+		if (x->frames[z].pc != y->frames[z].pc) {
+			return x->frames[z].pc < y->frames[z].pc ? -1 : 1;
+		}
+	}
+	return 0;
+}
+
+static int compare_sample_counts(const void *a, const void *b)
+{
+	return ((const thread_stack*)b)->samples - ((const thread_stack*)a)->samples;
+}
 
-		log(DEBUG, "found %ld symbols\n", number_of_symbols);
-		
-		for (i = 0; i < number_of_symbols; i++) {
-			process_symbol (pi,symbol_table[i],base_address);
+/* Count identical stacks together, most frequent first */
+static int aggregate_sampled_stacks(thread_stack *stacks, int number_of_stacks)
+{
+	int unique = 0;
+	int x;
+
+	qsort(stacks, number_of_stacks, sizeof(thread_stack), compare_sampled_stacks);
+	for (x = 0; x < number_of_stacks; x++) {
+		if (unique && 0 == compare_sampled_stacks(&stacks[unique - 1], &stacks[x])) {
+			stacks[unique - 1].samples++;
+			continue;
 		}
+		stacks[unique] = stacks[x];
+		stacks[unique++].samples = 1;
 	}
-	
-	if (bfd_close (file) == false) {
-		log(ERROR, "Error closing file: %s\n", filename);
-		return -1;
+	qsort(stacks, unique, sizeof(thread_stack), compare_sample_counts);
+	return unique;
+}
+
+static int print_agent_samples(process_info *pi, const char *name, thread_stack *stacks, int number_of_stacks, unsigned long lost)
+{
+	symbol_map map;
+	int number_of_unique = aggregate_sampled_stacks(stacks, number_of_stacks);
+	int x;
+
+	if (grok_symbol_map(&map, pi, stacks, number_of_unique)) {
+		return ENOMEM;
 	}
-	return ret;
+	output("Process %d: %d samples, %d distinct stacks, %lu samples lost\n",
+		pi->pid, number_of_stacks, number_of_unique, lost);
+	for (x = 0; x < number_of_unique; x++) {
+		output("%d samples:\n", stacks[x].samples);
+		output_folded_frame(name, strlen(name), "");
+		output_json_object(pi->pid);
+		output_json(",\"samples\":%d", stacks[x].samples);
+		print_thread_stack(&stacks[x], &map);
+	}
+	return output_flush();
 }
 
-int dynamic_libs_present(process_info *pi)
+/* End of agent ring consumer helper functions */
+
+static int consume_agent_ring(int pid)
 {
 	int ret = 0;
-	/* If the symbol "_DYNAMIC" is present in the executable, then we return true and set the link map head in the pi. */
-	TARGET_ADDRESS dynamic;
-	
-	ret = get_symbol_address(&dynamic,pi,"_DYNAMIC");
+	int period = period_option ? period_option : 1000;
+	agent_ring *ring = NULL;
+	size_t size = 0;
+	process_info *pi = NULL;
+	uint64_t tail = 0;
+	uint64_t head = 0;
+	uint64_t slots = 0;
+	char ring_name[64];
+	schedule s;
+	char name[64];
+	int gone = 0;
+
+	ring = open_agent_ring(pid, &size, &slots);
+	if (NULL == ring) {
+		return ENOENT;
+	}
+	ret = start_schedule(&s, period, jitter_option);
 	if (ret) {
-		/* Find the entry in the DYNAMIC array which has the valid entry we need. */
-		int keep_looking = 1;
-		int found_it = 0;
-		TARGET_ADDRESS r_debug_address;
-		while (keep_looking) {
-			ElfW(Dyn) thisdyn;
-			ret = read_target_memory((char*)&thisdyn, sizeof( ElfW(Dyn)), pi, dynamic);
-			if (ret) {
-				log(ERROR, "Error %d (%s) reading from DYNAMIC array\n", ret, strerror(ret));
-				return 0;
-			} else {
-				if (debug_option) {
-					log(INFO, "Read ElfW(Dyn) from address 0x%lx, tag=%ld, value=0x%lx\n",
-						dynamic, thisdyn.d_tag, thisdyn.d_un.d_ptr);
-				}
-			}
-			if (DT_NULL == thisdyn.d_tag) {
-				log(DEBUG, "Found a DT_NULL entry\n");
-				keep_looking = 0;
-			}
-			if (DT_DEBUG == thisdyn.d_tag) {
-				log(DEBUG, "Found r_debug in _DYNAMIC array.\n");
-				r_debug_address = thisdyn.d_un.d_ptr;
-				keep_looking = 0;
-				found_it = 1;
-			}
-			dynamic += sizeof( ElfW(Dyn));
-		}
-		if (!found_it) {
-			log(DEBUG, "Didn't find r_debug in _DYNAMIC array.\n");
-			return 0;		
-		}
+		munmap(ring, size);
+		return ret;
+	}
+	pi = pi_alloc(pid);
+	if (NULL == pi) fatal("failed to allocate process info structure\n");
+	open_blocked_target(pi);
+	if (grok_symbols(pi)) {
+		log(ERROR, "Failed to load the symbols of process %d, printing raw addresses\n", pid);
+	}
+	grok_process_name(pid, name, sizeof(name));
+	/* Start with whatever the ring still holds */
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = head > slots ? head - slots : 0;
+	log(DEBUG, "Agent of process %d samples every %d ms of CPU time into %lu slots\n",
+		pid, ring->period_ms, (unsigned long)slots);
 
-		{
-			/* Get the link map head */
-			TARGET_ADDRESS link_map_address;
-			int r_map_offset = offsetof(struct r_debug, r_map);
-			/* Now we've found the r_debug structure, get the link map from it. */
-			ret = read_target_pointer(&link_map_address, pi, r_debug_address + r_map_offset );
-			if (ret) {
-				log(DEBUG, "Failed to read link map address.\n");
-			} else {
-				log(DEBUG, "Read r_map: 0x%lx\n", link_map_address);
-				pi->link_map_head = link_map_address;
-				pi->link_map_current = link_map_address;
+	while (!gone) {
+		thread_stack *stacks = NULL;
+		int number_of_stacks = 0;
+		unsigned long lost = 0;
+
+		wait_for_deadline(&s);
+		/* Whatever it wrote before it went is still in the ring */
+		gone = kill(pid, 0) && ESRCH == errno;
+		ret = drain_agent_ring(ring, slots, &tail, &stacks, &number_of_stacks, &lost);
+		if (ret) {
+			break;
+		}
+		if (number_of_stacks || lost) {
+			if (!gone) {
+				reconcile_symbols(pi);
 			}
+			print_agent_samples(pi, name, stacks, number_of_stacks, lost);
 		}
-		ret = 1;
-	} else {
-		log(DEBUG, "No _DYNAMIC symbol found in executable\n");
-		ret = 0;
+		arena_reset(&snapshot_arena);
+	}
+	if (gone) {
+		log(DEBUG, "Process %d is gone, %lu samples were cut short at %d frames\n",
+			pid, (unsigned long)ring->truncated, AGENT_MAX_FRAMES);
+		/* The agent removes its ring at exit, but not when it is killed */
+		sprintf(ring_name, AGENT_RING_PREFIX "%d", pid);
+		shm_unlink(ring_name);
 	}
+	stop_schedule(&s);
+	pi_free(pi);
+	munmap(ring, size);
 	return ret;
 }
 
-int get_next_so_file_name(char** file_name, process_info *pi, TARGET_ADDRESS *base_address, int *more)
+/* Poll the target through /proc, which doesn't stop it, and only dump its
+   stacks while a trigger condition holds. Runs until the target exits. */
+static int watch_process(int pid, trigger *t)
 {
 	int ret = 0;
-	struct link_map lm; 
-	/* Are we at the end of the list ? */
-	if (NULL == (void*)pi->link_map_current) {
-		*more = 0;
-		return 0;
-	} else {
-		*more = 1;
-	}
-	/* Dereference the current pointer to get the filename */
-	ret = read_target_memory((void*)&lm,sizeof(lm),pi,pi->link_map_current);
+	int period = period_option ? period_option : 100;
+	schedule s;
+
+	ret = reset_trigger(t, pid);
 	if (ret) {
-		log(ERROR, "Failed to read link map structure from target.\n");
+		log(ERROR, "Failed to read /proc/%d/stat: %s\n", pid, strerror(ret));
 		return ret;
-	} else {
-		log(DEBUG, "Read link_map entry from address 0x%lx, base=0x%lx, name=0x%lx, next=0x%lx\n",
-			(TARGET_ADDRESS)lm.l_addr, pi->link_map_current, (TARGET_ADDRESS)lm.l_name, (TARGET_ADDRESS)lm.l_next);
 	}
-	ret = read_target_string(file_name,pi,(TARGET_ADDRESS)lm.l_name);
+	ret = start_schedule(&s, period, jitter_option);
 	if (ret) {
-		log(ERROR, "Failed to copy filename from target.\n");
 		return ret;
-	} else {
-		log(DEBUG, "Copied filename: '%s' from target\n", *file_name);
 	}
-	*base_address = (TARGET_ADDRESS)lm.l_addr;
-	/* Advance down the linked list */
-	pi->link_map_current = (TARGET_ADDRESS)lm.l_next;
-	return ret;
-}
-
-int grok_symbols(process_info *pi)
-{
-	int ret = 0;
-	/* There are symbols in the executable, and also in any dynamic libraries it has loaded 
-	   So we first get the executable's symbols, then look for dynamic libraries and get those too.
-	 */
-	/* First fill in the process executable file */
-	char *format_string = "/proc/%d/exe";
-	char *exe_file_name = calloc(strlen(format_string) + 10 ,1);
-	
-	bfd_init();
-	
-	sprintf(exe_file_name,format_string,pi->pid);
-	log(DEBUG, "Fetching symbols from executable: %s\n", exe_file_name);
-	ret = get_file_symbols(pi,exe_file_name,0);
-	if (!ret) {
-		if (dynamic_libs_present(pi)) {
-			int more_libs_to_check = 1;
-			char *so_file_name = NULL;
-			TARGET_ADDRESS base_address;
-			while(more_libs_to_check) {
-				ret = get_next_so_file_name(&so_file_name,pi,&base_address,&more_libs_to_check);
-				if (ret) {
-					return ret;
-				}
-				if (strlen(so_file_name) > 0) {
-					log(DEBUG, "Fetching symbols from shared object: %s\n", so_file_name);
-					get_file_symbols(pi,so_file_name, base_address);
-				} else {
-					log(DEBUG, "Skipping zero length so file name\n");
-				}
-			}
+	for (;;) {
+		wait_for_deadline(&s);
+		ret = poll_trigger(t, pid);
+		if (EAGAIN == ret) {
+			continue;
+		}
+		if (ret) {
+			log(DEBUG, "Stopped watching %d: %s\n", pid, strerror(ret));
+			ret = 0;
+			break;
+		}
+		ret = dump_process(pid);
+		if (ret) {
+			log(ERROR, "Failed to dump process %d: %s\n", pid, strerror(ret));
+			break;
 		}
+		reset_trigger(t, pid);
 	}
+	stop_schedule(&s);
 	return ret;
 }
 
-static void fatal(char* s)
-{
-	log(ERROR, "lsstack: fatal error: %s\n", s);
-	exit(0);
-}
-
-static void usage()
-{
-	printf("lsstack: [-v] [-D] [-p peridod_in_ms] [-o file_to_append] {<pid> | -e program arguments}\n");
-	exit(1);
-}
-
 int main(int argc, char** argv)
 {
 	/* look for command line options */
 	int pid = 0;
 	int ret = 0;
-	process_info *pi = NULL;
+	int *pids = NULL;
+	int number_of_pids = 0;
+	schedule polling;
+	int x;
 	int option_position = 1;
 
-	struct utsname buf;
-	memset(&buf, 0, sizeof(struct utsname));
-
-	if (uname(&buf) == 0) {
-		if (strcmp(buf.machine, "x86_64") == 0) {
-			log(ERROR, "lsstack64 fails on x86_64 platform. Use unwind.");
-			return -1;
-		}
-	} else
-		log(ERROR, "uname() failed. Assuming 32-bit platform.");
-
-	while ( option_position < (argc-1) && *argv[option_position] == '-') {
+	while ( option_position < argc && *argv[option_position] == '-') {
 		switch (*(argv[option_position]+1)) {
 			case 'v':
 				current_log_level = DEBUG;
@@ -928,13 +3891,88 @@ int main(int argc, char** argv)
 			case 'e':
 				execute_option = 1;
 				break;
+			case 'f':
+				futex_option = 1;
+				break;
+			case 's':
+				stagger_option = 1;
+				break;
+			case 'b':
+				blocked_option = 1;
+				break;
+			case 't':
+				trigger_spec = option_value(argc, argv, &option_position);
+				break;
+			case 'n':
+				top_option = atoi(option_value(argc, argv, &option_position));
+				if (top_option < 1) {
+					usage();
+				}
+				break;
+			case 'k':
+				snapshots_option = atoi(option_value(argc, argv, &option_position));
+				if (snapshots_option < 2) {
+					usage();
+				}
+				break;
+			case 'u':
+				unwinder_option = find_unwinder(option_value(argc, argv, &option_position));
+				if (unwinder_option < 0) {
+					usage();
+				}
+				break;
 			case 'p':
-				++option_position;
-				period_option = atoi(argv[option_position]);
+				period_option = atoi(option_value(argc, argv, &option_position));
+				break;
+			case 'K':
+				kernel_option = 1;
+				break;
+			case 'A':
+				agent_option = 1;
+				break;
+			case 'H':
+				watermark_option = 1;
+				break;
+			case 'j':
+				jitter_option = atoi(option_value(argc, argv, &option_position));
+				if (jitter_option < 0 || jitter_option > MAXIMUM_JITTER_PERCENT) {
+					usage();
+				}
 				break;
 			case 'o':
-				++option_position;
-				append_file = argv[option_position];
+				append_file = option_value(argc, argv, &option_position);
+				break;
+			case 'F':
+				output_format = find_output_format(option_value(argc, argv, &option_position));
+				if (output_format < 0) {
+					usage();
+				}
+				break;
+			case 'C':
+				core_path = option_value(argc, argv, &option_position);
+				break;
+			case 'R':
+				record_path = option_value(argc, argv, &option_position);
+				break;
+			case 'P':
+				replay_path = option_value(argc, argv, &option_position);
+				break;
+			case 'd':
+				daemon_socket = option_value(argc, argv, &option_position);
+				break;
+			case 'c':
+				client_socket = option_value(argc, argv, &option_position);
+				break;
+			case '-':
+				if (0 == strcmp(argv[option_position], "--stats")) {
+					stats_option = 1;
+					break;
+				}
+				if (0 == strcmp(argv[option_position], "--full-walk")) {
+					frame_cache_option = 0;
+					break;
+				}
+				usage();
 				break;
 			default:
 				usage();
@@ -945,75 +3983,118 @@ int main(int argc, char** argv)
 		    break;
 		}
 	}
-	if (execute_option) {
-	    pid = fork();
-	    if (pid) {
-		execvp(argv[option_position], argv+option_position);
-		return 1;
-	    } else {
-		pid = getppid();
-		msleep(1);
+	if (append_file) {
+	    close(1);
+	    int fd = open(append_file, O_WRONLY|O_APPEND|O_CREAT, 0666);
+	    dup2(fd, 1);
+	}
+	
+	if (stats_option) {
+		atexit(print_stats);
+	}
+	bfd_init();
+	arena_init(&snapshot_arena, 64 * 1024);
+	arena_init(&module_arena, 1024 * 1024);
+	arena_init(&image_arena, 1024 * 1024);
+
+	if (core_path) {
+	    return dump_core(core_path) ? 1 : 0;
+	}
+	if (replay_path) {
+	    return dump_replay(replay_path) ? 1 : 0;
+	}
+	if (record_path) {
+	    if (open_recording(record_path)) {
+		    return 1;
 	    }
-	} else {
-	    if (option_position != (argc-1)) {
+	    atexit(close_recording);
+	}
+	if (client_socket) {
+	    if (option_position >= argc) {
+		    usage();
+	    }
+	    return send_request(client_socket, argv + option_position, argc - option_position) ? 1 : 0;
+	}
+	if (daemon_socket) {
+	    return serve_requests(daemon_socket, period_option, jitter_option) ? 1 : 0;
+	}
+	if (trigger_spec) {
+	    trigger t;
+	    if (execute_option || option_position != argc - 1 || parse_trigger(&t, trigger_spec)) {
 		    usage();
 	    }
 	    pid = atoi(argv[option_position]);
-	    if (0 == pid) {
+	    return watch_process(pid, &t) ? 1 : 0;
+	}
+	if (execute_option) {
+	    if (option_position >= argc) {
 		    usage();
 	    }
+	    return follow_program(argv + option_position) ? 1 : 0;
 	}
-
-	if (append_file) {
-	    close(1);
-	    int fd = open(append_file, O_WRONLY|O_APPEND|O_CREAT, 0666);
-	    dup2(fd, 1);
+	if (agent_option) {
+	    if (option_position != argc - 1) {
+		    usage();
+	    }
+	    pid = atoi(argv[option_position]);
+	    return consume_agent_ring(pid) ? 1 : 0;
 	}
-	
-	if (debug_option) {
-		log(INFO, "pid: %d\n", pid);
+	if (option_position >= argc) {
+		usage();
 	}
-	
-	/* check that the pesky user hasn't tried to lsstack himself */
-	if (pid == getpid()) {
-		log(ERROR, "Error: specified pid belongs to the lsstack process\n");
-		exit(1);
+	number_of_pids = argc - option_position;
+	pids = (int*) calloc(number_of_pids, sizeof(int));
+	if (NULL == pids) fatal("failed to allocate pid list\n");
+	for (x = 0; x < number_of_pids; x++) {
+		pids[x] = atoi(argv[option_position + x]);
+		if (0 == pids[x]) {
+			usage();
+		}
+		/* check that the pesky user hasn't tried to lsstack himself */
+		if (pids[x] == getpid()) {
+			log(ERROR, "Error: specified pid belongs to the lsstack process\n");
+			exit(1);
+		}
 	}
-	
-here_we_go_in_polling_mode:
 
-	/* See if we can attach to the target */
-	ret = attach_target(pid);
-	
-	if (ret) {
-		if(!period_option) {
-		    log(ERROR, "Failed to attach to the target process: %s\n", strerror(ret));
+	if (debug_option) {
+		for (x = 0; x < number_of_pids; x++) {
+			log(INFO, "pid: %d\n", pids[x]);
 		}
-		exit(1);
 	}
 	
-	log(DEBUG, "Attached to target process\n");
-	
-	pi = pi_alloc(pid);
-	if (NULL == pi) fatal("failed to allocate process info structure\n");
-		
-	ret = grok_symbols(pi);
-	
-	ret = grok_threads(pi);
-
-	ret = grok_and_print_stacks(pi);
-	
-	detatch_target(pi);
-	
-	pi_free(pi);
-	
-	log(DEBUG, "Detatched from target process\n");
+	if (snapshots_option) {
+		for (x = 0; x < number_of_pids; x++) {
+			ret = grok_and_print_progress(pids[x], snapshots_option, period_option ? period_option : 500);
+		}
+		return ret ? 1 : 0;
+	}
 
-	if(period_option) {
-	    msleep(period_option);
-	    goto here_we_go_in_polling_mode;
+	if (period_option && start_schedule(&polling, period_option, jitter_option)) {
+		return 1;
 	}
+	do {
+		for (x = 0; x < number_of_pids; x++) {
+			if (watermark_option) {
+				ret = dump_stack_usage(pids[x]);
+			} else {
+				ret = top_option ? dump_busy_threads(pids[x]) : dump_process(pids[x]);
+			}
+			if (ret) {
+				if (period_option) {
+					/* A polled target, or whoever reads the output, has gone away */
+					exit(1);
+				}
+				log(ERROR, "Failed to dump process %d: %s\n", pids[x], strerror(ret));
+			}
+		}
+		if (period_option) {
+			print_stats();
+			reset_stats();
+			wait_for_deadline(&polling);
+		}
+	} while (period_option);
 	
-	return 0;
+	return ret ? 1 : 0;
 }
 
@@ -0,0 +1,249 @@
+/*
+ * Types and helpers shared by lsstack.c and the unwinder backends
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <link.h>
+#include <sys/types.h>
+#include <sys/user.h>
+
+typedef Elf64_Addr TARGET_ADDRESS;
+
+struct _symbol_entry {
+	TARGET_ADDRESS value;
+	char *name;
+};
+
+typedef struct _symbol_entry symbol_entry;
+
+/* The symbols of one file, shared by every process that maps it */
+typedef struct _module_image {
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	char *path;
+	symbol_entry *symbols; /* Sorted by value, relative to the link address */
+	int number_of_symbols;
+	TARGET_ADDRESS link_start; /* Extent of the PT_LOAD segments, 0 and 0 if unknown */
+	TARGET_ADDRESS link_end;
+	struct _module_image *next;
+} module_image;
+
+/* A module image as loaded into one process */
+typedef struct _process_module {
+	module_image *image;
+	TARGET_ADDRESS bias;
+} process_module;
+
+/* Part of the address space owned by one module */
+typedef struct _module_range {
+	TARGET_ADDRESS start;
+	TARGET_ADDRESS end;
+	int module; /* Index into process_info.modules */
+} module_range;
+
+/* One line of /proc/<pid>/maps */
+typedef struct _memory_map {
+	TARGET_ADDRESS start;
+	TARGET_ADDRESS end;
+	TARGET_ADDRESS offset;
+	int executable;
+	char *path; /* "" for anonymous mappings */
+} memory_map;
+
+struct _process_info;
+
+/* Where target memory, registers and maps come from when it isn't a live,
+   ptrace()d process (pi->ops == NULL) */
+typedef struct _target_ops {
+	int (*read_block)(struct _process_info *pi, char *value, size_t length, TARGET_ADDRESS address);
+	int (*read_registers)(struct _process_info *pi, struct user_regs_struct *regs, int thepid);
+	int (*grok_maps)(struct _process_info *pi); /* NULL for /proc/<pid>/maps */
+} target_ops;
+
+typedef struct _process_info {
+	int pid;
+	int threads_present_flag;
+	TARGET_ADDRESS link_map_head;
+	TARGET_ADDRESS link_map_current; /* Used to iterate through the link map */
+	TARGET_ADDRESS r_debug_address; /* 0 until the dynamic linker's r_debug is found */
+	TARGET_ADDRESS link_map_generation; /* Of the link map the modules were loaded from */
+	process_module *modules;
+	int number_of_modules;
+	int modules_size;
+	module_range *module_ranges; /* Built on demand by grok_module_ranges */
+	int number_of_module_ranges;
+	memory_map *maps; /* Built on demand by grok_memory_maps */
+	int number_of_maps;
+	int mem_fd; /* /proc/<pid>/mem, opened on demand */
+	int peek_pid; /* A stopped thread for PEEKDATA; any of them sees the same memory */
+	target_ops *ops;
+	void *target; /* Private to ops */
+	int *thread_pids;
+	int initial_thread_id;
+	int manager_thread_id;
+	const char *exe_path; /* NULL for /proc/<pid>/exe */
+} process_info;
+
+/* We should get argument information from the debug data, but in the meantime we
+   have to make do with the frame pointers. The compiler seems to set the frame pointer
+   to 32-byte boundaries, so even when there is one argument, it looks like there are 6.
+   For now, let's set a maximum number of arguments we want to print.
+ */
+
+#define MAXIMUM_NUMBER_OF_ARGUMENTS 4
+
+/* A corrupt frame pointer chain can loop, so don't walk forever */
+#define MAX_STACK_DEPTH 1024
+
+typedef struct _stack_frame {
+	TARGET_ADDRESS pc;
+	TARGET_ADDRESS sp; /* Stack and frame pointer the frame runs with */
+	TARGET_ADDRESS bp;
+	int number_of_arguments; /* -1 when unknown, e.g. for the outermost frame */
+	TARGET_ADDRESS arguments[MAXIMUM_NUMBER_OF_ARGUMENTS];
+} stack_frame;
+
+/* What a thread was doing in the kernel, read just before it was stopped */
+typedef struct _kernel_stack {
+	int pid;
+	char state; /* As in /proc/<pid>/stat */
+	char *wchan; /* NULL when not waiting, or not shown */
+	char **frames; /* "function+0x62/0xa0", innermost first */
+	int number_of_frames;
+} kernel_stack;
+
+/* The kernel doesn't list more than this */
+#define MAX_KERNEL_FRAMES 64
+
+typedef struct _thread_stack {
+	int pid;
+	int reached_top;
+	int number_of_frames;
+	int frames_size;
+	stack_frame *frames;
+	kernel_stack *kernel; /* NULL unless asked for with -K */
+	int samples; /* Times the stack was seen, when counted together; 0 for once */
+} thread_stack;
+
+/* Target access, lsstack.c */
+
+TARGET_ADDRESS read_target_pointer(TARGET_ADDRESS *value, process_info *pi, TARGET_ADDRESS address);
+TARGET_ADDRESS read_target_word(TARGET_ADDRESS *value, process_info *pi, TARGET_ADDRESS address);
+int read_target_block(char *value, size_t length, process_info *pi, TARGET_ADDRESS address);
+int read_target_registers(struct user_regs_struct *regs, process_info *pi, int thepid);
+int grok_memory_maps(process_info *pi);
+memory_map *find_memory_map(process_info *pi, TARGET_ADDRESS address);
+
+/* Symbol tables, lsstack.c */
+
+int add_process_module(process_info *pi, module_image *image, TARGET_ADDRESS bias);
+int grok_module_ranges(process_info *pi);
+process_module *find_process_module(process_info *pi, TARGET_ADDRESS address);
+
+/* Stack capture, lsstack.c */
+
+stack_frame *thread_stack_add_frame(thread_stack *ts);
+TARGET_ADDRESS grok_thread_stack(thread_stack *ts, process_info *pi, int thepid);
+int grok_staggered_stacks(thread_stack **stacks, int *number_of_stacks, process_info *pi);
+int grok_blocked_stacks(thread_stack **stacks, int *number_of_stacks, process_info *pi);
+int dump_process(int pid);
+
+/* Unwinder backends, unwind.c */
+
+#define UNWINDER_FP 0
+#define UNWINDER_LIBUNWIND 1
+#define UNWINDER_SNAPSHOT 2
+#define UNWINDER_AUTO 3
+
+int find_unwinder(const char *name);
+TARGET_ADDRESS unwind_thread_stack(thread_stack *ts, process_info *pi, int thepid, int unwinder);
+void unwind_forget_process(int pid);
+
+/* Resident mode, daemon.c */
+
+int serve_requests(const char *path, int period, int jitter);
+int send_request(const char *path, char **words, int number_of_words);
+
+/* Conditional capture, trigger.c */
+
+typedef struct _trigger {
+	int cpu_percent; /* Of one CPU, summed over threads; 0 when unused */
+	int running_ms; /* A thread continuously in R state for this long */
+	int thread_growth; /* Threads added since the last capture */
+	unsigned long last_ticks;
+	long last_poll;
+	long baseline_threads;
+} trigger;
+
+int read_stat_file(const char *file_name, char *state, unsigned long *ticks, long *threads);
+int parse_trigger(trigger *t, const char *spec);
+int reset_trigger(trigger *t, int pid);
+int poll_trigger(trigger *t, int pid);
+int grok_busy_threads(int pid, int top, int *busy_pids, unsigned long *busy_ticks, int *number_of_busy);
+
+/* Core file backend, core.c */
+
+int open_core_file(process_info *pi, const char *path);
+int grok_core_files_mapped(process_info *pi, memory_map **files, int *number_of_files);
+void close_core_file(process_info *pi);
+
+/* JIT symbols, perfmap.c */
+
+int grok_perf_map(process_info *pi);
+
+/* Kernel stacks, kernel.c */
+
+int grok_kernel_stacks(int pid);
+kernel_stack *find_kernel_stack(int thepid);
+
+/* Stack high-water marks, watermark.c */
+
+#define STACK_USAGE_NONE 0 /* Only the current depth is known */
+#define STACK_USAGE_PAGEMAP 1
+#define STACK_USAGE_ZERO_SCAN 2
+
+typedef struct _stack_usage {
+	TARGET_ADDRESS start; /* The mapping the stack pointer is in */
+	TARGET_ADDRESS end;
+	TARGET_ADDRESS depth; /* From the end of the mapping to the stack pointer */
+	TARGET_ADDRESS peak_depth; /* To the lowest page ever touched */
+	int method;
+} stack_usage;
+
+int grok_stack_usage(stack_usage *usage, process_info *pi, TARGET_ADDRESS sp);
+const char *stack_usage_method_name(int method);
+
+/* Ptrace-free capture, nonstop.c */
+
+void open_blocked_target(process_info *pi);
+
+/* Record and replay, record.c */
+
+int open_recording(const char *path);
+void close_recording(void);
+int is_recording(void);
+void record_process(process_info *pi);
+void record_target_read(const char *value, size_t length, TARGET_ADDRESS address);
+void record_target_registers(int thepid, struct user_regs_struct *regs);
+void record_memory_maps(process_info *pi);
+void record_threads(process_info *pi, thread_stack *stacks, int number_of_stacks);
+int open_replay_file(const char *path, int *number_of_processes);
+int open_replay_process(process_info *pi, int index);
+void close_replay_file(void);
@@ -0,0 +1,272 @@
+/*
+ * Ptrace-free capture of threads blocked in system calls: registers from
+ * /proc/<tid>/syscall, memory through process_vm_readv
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "lsstack.h"
+#include "stats.h"
+
+/* A thread sitting in a system call can't change its user stack, so the
+   stack pointer and program counter the kernel shows in /proc/<tid>/syscall
+   are good for as long as it stays there. The top of its stack is copied in
+   one process_vm_readv and the ordinary frame pointer walk runs on the copy.
+
+   What the kernel doesn't show is RBP. The syscall wrappers in libc don't set
+   up a frame, and neither do the libc functions calling them, so the chain
+   starts at the first frame record above the stack pointer: a saved BP that
+   points further up the stack, next to a return address into code. The words
+   pointing into code below it are return addresses into the frameless
+   functions in between. The first and last of them (the wrapper's caller, and
+   the function the frame record belongs to) are spliced into the chain by
+   writing frame records for them into the copy.
+
+   The thread is checked to be in the same place once the copy is made; if it
+   has moved, or is running, ptrace is the only way to get a consistent view.
+ */
+
+#define BLOCKED_STACK_SIZE (64 * 1024)
+
+/* Room below the stack pointer for the spliced frame record */
+#define BLOCKED_STACK_SLACK 16
+
+static char blocked_stack[BLOCKED_STACK_SIZE];
+static TARGET_ADDRESS blocked_stack_start = 0;
+static size_t blocked_stack_size = 0;
+
+/* Blocked thread helper functions */
+
+/* EBUSY when the thread is running, which leaves nothing to read */
+static int read_blocked_position(process_info *pi, int thepid, TARGET_ADDRESS *sp, TARGET_ADDRESS *pc)
+{
+	char file_name[64];
+	char line[256];
+	char *last = NULL;
+	FILE *fp = NULL;
+
+	sprintf(file_name, "/proc/%d/task/%d/syscall", pi->pid, thepid);
+	fp = fopen(file_name, "r");
+	if (NULL == fp) {
+		return errno;
+	}
+	if (NULL == fgets(line, sizeof(line), fp)) {
+		fclose(fp);
+		return EIO;
+	}
+	fclose(fp);
+	if (0 == strncmp(line, "running", 7)) {
+		return EBUSY;
+	}
+	/* "nr args... sp pc", or "-1 sp pc" when blocked outside a system call */
+	last = strrchr(line, ' ');
+	if (NULL == last || last == line) {
+		return EIO;
+	}
+	*last = '\0';
+	*pc = strtoul(last + 1, NULL, 16);
+	last = strrchr(line, ' ');
+	if (NULL == last) {
+		return EIO;
+	}
+	*sp = strtoul(last + 1, NULL, 16);
+	return 0;
+}
+
+static int read_vm(process_info *pi, char *value, size_t length, TARGET_ADDRESS address)
+{
+	struct iovec local = { value, length };
+	struct iovec remote = { (void*)address, length };
+	ssize_t count = process_vm_readv(pi->pid, &local, 1, &remote, 1, 0);
+	if (count < 0) {
+		return errno;
+	}
+	return (size_t)count == length ? 0 : EIO;
+}
+
+static TARGET_ADDRESS blocked_stack_word(TARGET_ADDRESS address)
+{
+	TARGET_ADDRESS value;
+	memcpy(&value, blocked_stack + (address - blocked_stack_start), sizeof(value));
+	return value;
+}
+
+static int in_blocked_stack(TARGET_ADDRESS address)
+{
+	return address >= blocked_stack_start && address + sizeof(TARGET_ADDRESS) <= blocked_stack_start + blocked_stack_size;
+}
+
+static int is_code_address(process_info *pi, TARGET_ADDRESS address)
+{
+	memory_map *map = find_memory_map(pi, address);
+	return NULL != map && map->executable;
+}
+
+/* A saved BP at slot: pointing further up the copy (or 0 in the outermost
+   frame) and followed by a return address into code */
+static int is_frame_record(process_info *pi, TARGET_ADDRESS slot)
+{
+	TARGET_ADDRESS next_bp;
+	if (!in_blocked_stack(slot + sizeof(TARGET_ADDRESS))) {
+		return 0;
+	}
+	next_bp = blocked_stack_word(slot);
+	if (0 != next_bp && (next_bp <= slot || (next_bp & (sizeof(TARGET_ADDRESS) - 1)) || !in_blocked_stack(next_bp))) {
+		return 0;
+	}
+	return is_code_address(pi, blocked_stack_word(slot + sizeof(TARGET_ADDRESS)));
+}
+
+/* Point the word below a return address at a frame record, making a frame
+   record for the function the return address is in */
+static TARGET_ADDRESS splice_frame_record(TARGET_ADDRESS return_slot, TARGET_ADDRESS record)
+{
+	TARGET_ADDRESS slot = return_slot - sizeof(TARGET_ADDRESS);
+	memcpy(blocked_stack + (slot - blocked_stack_start), &record, sizeof(record));
+	return slot;
+}
+
+/* Find RBP for the copy. The frame record that is found belongs to the
+   function that called (through any number of frameless ones) the blocked
+   one; the lowest and the highest return address below it are spliced in. */
+static TARGET_ADDRESS recover_frame_pointer(process_info *pi, TARGET_ADDRESS sp)
+{
+	TARGET_ADDRESS first_return = 0;
+	TARGET_ADDRESS last_return = 0;
+	TARGET_ADDRESS slot;
+
+	for (slot = sp; in_blocked_stack(slot); slot += sizeof(TARGET_ADDRESS)) {
+		if (is_code_address(pi, blocked_stack_word(slot))) {
+			first_return = slot;
+			break;
+		}
+	}
+	if (!first_return || !in_blocked_stack(first_return - sizeof(TARGET_ADDRESS))) {
+		return 0;
+	}
+	last_return = first_return;
+	for (slot = first_return + sizeof(TARGET_ADDRESS); in_blocked_stack(slot); slot += sizeof(TARGET_ADDRESS)) {
+		TARGET_ADDRESS next_bp = blocked_stack_word(slot);
+		/* One more link of the chain must check out too, unless it ends here */
+		if (is_frame_record(pi, slot) && (0 == next_bp || is_frame_record(pi, next_bp))) {
+			if (last_return == first_return + sizeof(TARGET_ADDRESS)) {
+				/* No room below last_return for its record: it would
+				   overwrite first_return */
+				return 0;
+			}
+			if (last_return != first_return) {
+				slot = splice_frame_record(last_return, slot);
+			}
+			return splice_frame_record(first_return, slot);
+		}
+		if (is_code_address(pi, next_bp)) {
+			last_return = slot;
+		}
+	}
+	return 0;
+}
+
+/* End of blocked thread helper functions */
+
+/* Blocked thread target operations */
+
+static int blocked_read_block(process_info *pi, char *value, size_t length, TARGET_ADDRESS address)
+{
+	if (address >= blocked_stack_start && address + length <= blocked_stack_start + blocked_stack_size) {
+		memcpy(value, blocked_stack + (address - blocked_stack_start), length);
+		return 0;
+	}
+	return read_vm(pi, value, length, address);
+}
+
+/* The registers a frame walk needs, and the stack copy it will run on. EBUSY
+   means the thread has to be stopped to be walked: it is running, or no frame
+   record could be found to start the walk from. */
+static int blocked_read_registers(process_info *pi, struct user_regs_struct *regs, int thepid)
+{
+	TARGET_ADDRESS sp = 0, pc = 0;
+	TARGET_ADDRESS sp_after = 0, pc_after = 0;
+	memory_map *map = NULL;
+	int ret = 0;
+
+	blocked_stack_size = 0;
+	ret = grok_memory_maps(pi);
+	if (!ret) {
+		ret = read_blocked_position(pi, thepid, &sp, &pc);
+	}
+	if (ret) {
+		return ret;
+	}
+	map = find_memory_map(pi, sp);
+	if (NULL == map) {
+		return EFAULT;
+	}
+	blocked_stack_start = sp - BLOCKED_STACK_SLACK;
+	if (blocked_stack_start < map->start) {
+		blocked_stack_start = sp;
+	}
+	blocked_stack_size = map->end - blocked_stack_start;
+	if (blocked_stack_size > BLOCKED_STACK_SIZE) {
+		blocked_stack_size = BLOCKED_STACK_SIZE;
+	}
+	ret = read_vm(pi, blocked_stack, blocked_stack_size, blocked_stack_start);
+	if (!ret) {
+		count_bytes_read(blocked_stack_size);
+		ret = read_blocked_position(pi, thepid, &sp_after, &pc_after);
+	}
+	if (!ret && (sp != sp_after || pc != pc_after)) {
+		log(DEBUG, "Thread %d woke up while its stack was copied\n", thepid);
+		ret = EBUSY;
+	}
+	if (ret) {
+		blocked_stack_size = 0;
+		return ret;
+	}
+	memset(regs, 0, sizeof(*regs));
+	regs->rip = pc;
+	regs->rsp = sp;
+	regs->rbp = recover_frame_pointer(pi, sp);
+	if (0 == regs->rbp) {
+		/* Without a frame record the walk would stop at the system call */
+		log(DEBUG, "No frame record found above sp 0x%lx of thread %d\n", sp, thepid);
+		blocked_stack_size = 0;
+		return EBUSY;
+	}
+	log(DEBUG, "Thread %d blocked at pc 0x%lx, sp 0x%lx, recovered bp 0x%llx\n", thepid, pc, sp, regs->rbp);
+	return 0;
+}
+
+static target_ops blocked_ops = {
+	blocked_read_block,
+	blocked_read_registers,
+	NULL, /* The live /proc/<pid>/maps */
+};
+
+/* End of blocked thread target operations */
+
+/* Read pi's memory without attaching to it; read_target_registers then only
+   works for threads that are blocked */
+void open_blocked_target(process_info *pi)
+{
+	pi->ops = &blocked_ops;
+	blocked_stack_size = 0;
+}
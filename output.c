@@ -0,0 +1,232 @@
+/*
+ * Output layer: each snapshot is rendered into one buffer and written out
+ * with a single write()
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "output.h"
+
+/* Everything printed for a snapshot piles up here until output_flush, so
+   that a collector reading the other end of a pipe gets whole snapshots and
+   the writes cost one system call each, not one per line. Diagnostics still
+   go straight to stderr through log(). */
+
+extern int current_log_level;
+extern char *logarr[];
+
+int output_format = OUTPUT_LEGACY;
+
+static const char *output_format_names[] = { "legacy", "text", "json", "folded", NULL };
+
+static char *output_buffer = NULL;
+static size_t output_length = 0;
+static size_t output_size = 0;
+
+/* Wall clock time of the snapshot, taken when its first line is rendered */
+static struct timespec snapshot_time;
+
+/* Output buffer helper functions */
+
+static int reserve_output(size_t length)
+{
+	if (output_length + length + 1 > output_size) {
+		size_t size = output_size ? output_size : 64 * 1024;
+		char *temp = NULL;
+		while (output_length + length + 1 > size) {
+			size *= 2;
+		}
+		temp = (char*) realloc(output_buffer, size);
+		if (NULL == temp) {
+			log(ERROR, "Failed to grow the output buffer\n");
+			return ENOMEM;
+		}
+		output_buffer = temp;
+		output_size = size;
+	}
+	if (0 == output_length) {
+		clock_gettime(CLOCK_REALTIME, &snapshot_time);
+	}
+	return 0;
+}
+
+static void append_output(const char *format, va_list ap)
+{
+	va_list copy;
+	int length;
+
+	va_copy(copy, ap);
+	length = vsnprintf(NULL, 0, format, copy);
+	va_end(copy);
+	if (length < 0 || reserve_output(length)) {
+		return;
+	}
+	vsnprintf(output_buffer + output_length, length + 1, format, ap);
+	output_length += length;
+}
+
+static void append_output_format(const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	append_output(format, ap);
+	va_end(ap);
+}
+
+/* End of output buffer helper functions */
+
+int find_output_format(const char *name)
+{
+	int x;
+	for (x = 0; output_format_names[x]; x++) {
+		if (0 == strcmp(name, output_format_names[x])) {
+			return x;
+		}
+	}
+	return -1;
+}
+
+void output_line(const char *file, const char *func, int line, const char *format, ...)
+{
+	va_list ap;
+
+	if (OUTPUT_LEGACY != output_format && OUTPUT_TEXT != output_format) {
+		return;
+	}
+	if (OUTPUT_LEGACY == output_format) {
+		if (current_log_level < INFO) {
+			return;
+		}
+		append_output_format("[%s, %s(), ln %d] %s: ", file, func, line, logarr[INFO]);
+	}
+	va_start(ap, format);
+	append_output(format, ap);
+	va_end(ap);
+}
+
+void output_json(const char *format, ...)
+{
+	va_list ap;
+
+	if (OUTPUT_JSON != output_format) {
+		return;
+	}
+	va_start(ap, format);
+	append_output(format, ap);
+	va_end(ap);
+}
+
+void output_json_string(const char *value)
+{
+	const char *c = NULL;
+
+	if (OUTPUT_JSON != output_format) {
+		return;
+	}
+	/* At worst every byte becomes a \u00XX escape */
+	if (reserve_output(strlen(value) * 6 + 2)) {
+		return;
+	}
+	output_buffer[output_length++] = '"';
+	for (c = value; *c; c++) {
+		unsigned char byte = (unsigned char)*c;
+		if ('"' == byte || '\\' == byte) {
+			output_buffer[output_length++] = '\\';
+			output_buffer[output_length++] = byte;
+		} else if (byte < 0x20) {
+			output_length += sprintf(output_buffer + output_length, "\\u%04x", byte);
+		} else {
+			output_buffer[output_length++] = byte;
+		}
+	}
+	output_buffer[output_length++] = '"';
+	output_buffer[output_length] = '\0';
+}
+
+void output_json_object(int pid)
+{
+	if (OUTPUT_JSON != output_format || reserve_output(0)) {
+		return;
+	}
+	append_output_format("{\"pid\":%d,\"timestamp\":%ld.%06ld", pid,
+		(long)snapshot_time.tv_sec, snapshot_time.tv_nsec / 1000);
+}
+
+void output_json_thread(int pid, int tid)
+{
+	output_json_object(pid);
+	output_json(",\"tid\":%d", tid);
+}
+
+void output_folded(const char *format, ...)
+{
+	va_list ap;
+
+	if (OUTPUT_FOLDED != output_format) {
+		return;
+	}
+	va_start(ap, format);
+	append_output(format, ap);
+	va_end(ap);
+}
+
+void output_folded_frame(const char *name, size_t length, const char *suffix)
+{
+	size_t x;
+
+	if (OUTPUT_FOLDED != output_format || reserve_output(length + strlen(suffix) + 1)) {
+		return;
+	}
+	if (output_length && '\n' != output_buffer[output_length - 1]) {
+		output_buffer[output_length++] = ';';
+	}
+	for (x = 0; x < length; x++) {
+		char c = name[x];
+		output_buffer[output_length++] = (';' == c || ' ' == c || '\t' == c || '\n' == c) ? '_' : c;
+	}
+	strcpy(output_buffer + output_length, suffix);
+	output_length += strlen(suffix);
+}
+
+/* Write out the snapshot: the legacy format goes where log() would have put
+   it, the others to stdout (which -o points at a file) */
+int output_flush(void)
+{
+	int fd = OUTPUT_LEGACY == output_format ? 2 : 1;
+	size_t written = 0;
+	int ret = 0;
+
+	while (written < output_length) {
+		ssize_t count = write(fd, output_buffer + written, output_length - written);
+		if (count < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			ret = errno;
+			break;
+		}
+		written += count;
+	}
+	output_length = 0;
+	return ret;
+}
@@ -0,0 +1,52 @@
+/*
+ * Output layer: each snapshot is rendered into one buffer and written out
+ * with a single write()
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#define OUTPUT_LEGACY 0 /* log(INFO) lines on stderr, as always */
+#define OUTPUT_TEXT 1 /* The same lines without the log prefix, on stdout */
+#define OUTPUT_JSON 2 /* JSON Lines on stdout, one object per thread */
+#define OUTPUT_FOLDED 3 /* One "outer;...;inner 1" line per thread, for flame graphs */
+
+extern int output_format;
+
+/* A line of the text formats; nothing in JSON or folded */
+#define output(format, ...) \
+	output_line(__FILE__, __func__, __LINE__, format, ##__VA_ARGS__)
+
+int find_output_format(const char *name);
+
+void output_line(const char *file, const char *func, int line, const char *format, ...)
+	__attribute__((__format__(printf, 4, 5)));
+
+/* JSON only: raw text, a quoted and escaped string, and the start of an
+   object with the pid and the snapshot's timestamp (and the thread's id;
+   print_thread_stack ends that one) */
+void output_json(const char *format, ...) __attribute__((__format__(printf, 1, 2)));
+void output_json_string(const char *value);
+void output_json_object(int pid);
+void output_json_thread(int pid, int tid);
+
+/* Folded only: raw text, and the next frame of the line, after a ';' unless
+   it is the first, with any ';' and blanks in it replaced */
+void output_folded(const char *format, ...) __attribute__((__format__(printf, 1, 2)));
+void output_folded_frame(const char *name, size_t length, const char *suffix);
+
+int output_flush(void);
@@ -0,0 +1,296 @@
+/*
+ * JIT symbols from the /tmp/perf-<pid>.map convention used by the JVM, Node
+ * and others: one "START SIZE name" line, in hex, per generated function
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "arena.h"
+#include "lsstack.h"
+
+/* The map files only ever grow while the process lives, and can reach
+   hundreds of megabytes, so each one is read once: later calls only parse
+   the lines appended since, and merge them into the sorted table. Every
+   function also gets an end marker with an empty name at START + SIZE, so
+   that addresses past its end don't resolve to it.
+ */
+
+#define PERF_MAP_READ_SIZE (1024 * 1024)
+
+typedef struct _perf_map {
+	int pid;
+	dev_t dev;
+	ino_t ino;
+	off_t offset; /* Of the first line not read yet */
+	int skipping; /* offset is inside an overlong line; skip to its end */
+	module_image image; /* Symbols sorted, relative to 0 */
+	arena names;
+	struct _perf_map *next;
+} perf_map;
+
+/* An entry read but not merged yet; sequence keeps file order among entries
+   at the same address, which qsort alone wouldn't */
+typedef struct _perf_symbol {
+	TARGET_ADDRESS value;
+	char *name;
+	int sequence;
+} perf_symbol;
+
+static perf_map *perf_maps = NULL;
+static char perf_map_buffer[PERF_MAP_READ_SIZE];
+
+/* Perf map helper functions */
+
+static perf_map *find_perf_map(int pid)
+{
+	perf_map *map = NULL;
+	for (map = perf_maps; map; map = map->next) {
+		if (map->pid == pid) {
+			return map;
+		}
+	}
+	map = (perf_map*) calloc(1, sizeof(perf_map));
+	if (NULL == map) {
+		return NULL;
+	}
+	map->pid = pid;
+	arena_init(&map->names, 1024 * 1024);
+	map->next = perf_maps;
+	perf_maps = map;
+	return map;
+}
+
+/* A different file under the same name (the pid was reused) or a truncated
+   one means starting again */
+static void reset_perf_map(perf_map *map, struct stat *st)
+{
+	free(map->image.symbols);
+	memset(&map->image, 0, sizeof(map->image));
+	arena_free(&map->names);
+	map->dev = st->st_dev;
+	map->ino = st->st_ino;
+	map->offset = 0;
+	map->skipping = 0;
+}
+
+/* By address; at the same address end markers go first, so that a function
+   starting where another ends isn't hidden, and then in file order */
+static int compare_perf_symbols(const void *a, const void *b)
+{
+	const perf_symbol *x = (const perf_symbol*)a;
+	const perf_symbol *y = (const perf_symbol*)b;
+	if (x->value != y->value) {
+		return (x->value > y->value) - (x->value < y->value);
+	}
+	if (!x->name[0] != !y->name[0]) {
+		return x->name[0] ? 1 : -1;
+	}
+	return x->sequence - y->sequence;
+}
+
+static int add_perf_symbol(perf_symbol **symbols, int *number, int *size, TARGET_ADDRESS value, char *name)
+{
+	if (*number == *size) {
+		int new_size = *size ? *size * 2 : 1024;
+		perf_symbol *temp = (perf_symbol*) realloc(*symbols, new_size * sizeof(perf_symbol));
+		if (NULL == temp) {
+			return ENOMEM;
+		}
+		*symbols = temp;
+		*size = new_size;
+	}
+	(*symbols)[*number].value = value;
+	(*symbols)[*number].name = name;
+	(*symbols)[*number].sequence = *number;
+	(*number)++;
+	return 0;
+}
+
+/* Merge freshly read, sorted symbols into the table. On equal addresses the
+   newer function goes last, so that lookups (last symbol at or below) see it:
+   JITs reuse the addresses of code they have thrown away. */
+static int merge_perf_symbols(perf_map *map, perf_symbol *added, int number_added)
+{
+	int total = map->image.number_of_symbols + number_added;
+	symbol_entry *merged = NULL;
+	int x = 0, y = 0, z = 0;
+
+	merged = (symbol_entry*) malloc(total * sizeof(symbol_entry));
+	if (NULL == merged) {
+		return ENOMEM;
+	}
+	while (x < map->image.number_of_symbols || y < number_added) {
+		symbol_entry *old = &map->image.symbols[x];
+		if (y == number_added || (x < map->image.number_of_symbols &&
+			(old->value < added[y].value || (old->value == added[y].value && (!old->name[0] || added[y].name[0]))))) {
+			merged[z++] = *old;
+			x++;
+		} else {
+			merged[z].value = added[y].value;
+			merged[z++].name = added[y++].name;
+		}
+	}
+	free(map->image.symbols);
+	map->image.symbols = merged;
+	map->image.number_of_symbols = total;
+	return 0;
+}
+
+/* Parse complete lines from *offset on; a partly written last line is left
+   for the next call. *offset and *skipping are only advanced here: the
+   caller keeps them once the entries are merged, so that nothing read is
+   lost when that fails. */
+static int read_perf_map_lines(perf_map *map, int fd, off_t *offset, int *skipping, perf_symbol **added, int *number_added)
+{
+	int added_size = 0;
+	int ret = 0;
+
+	for (;;) {
+		ssize_t count = pread(fd, perf_map_buffer, sizeof(perf_map_buffer) - 1, *offset);
+		char *line = perf_map_buffer;
+		char *end = NULL;
+		if (count < 0) {
+			return errno;
+		}
+		if (0 == count) {
+			break;
+		}
+		perf_map_buffer[count] = '\0';
+		if (*skipping) {
+			/* The rest of an overlong line isn't an entry of its own */
+			end = strchr(line, '\n');
+			if (NULL == end) {
+				*offset += count;
+				continue;
+			}
+			line = end + 1;
+			*skipping = 0;
+		}
+		while (NULL != (end = strchr(line, '\n'))) {
+			TARGET_ADDRESS start, size;
+			int name_offset = 0;
+			*end = '\0';
+			if (2 == sscanf(line, "%lx %lx %n", &start, &size, &name_offset) && name_offset) {
+				char *name = arena_strdup(&map->names, line + name_offset);
+				if (NULL == name) {
+					return ENOMEM;
+				}
+				ret = add_perf_symbol(added, number_added, &added_size, start, name);
+				if (!ret && size) {
+					ret = add_perf_symbol(added, number_added, &added_size, start + size, "");
+				}
+				if (ret) {
+					return ret;
+				}
+			}
+			line = end + 1;
+		}
+		if (line == perf_map_buffer) {
+			/* A single line longer than the buffer, or an incomplete one */
+			if ((size_t)count < sizeof(perf_map_buffer) - 1) {
+				break;
+			}
+			log(DEBUG, "Skipping an overlong line in /tmp/perf-%d.map\n", map->pid);
+			*offset += count;
+			*skipping = 1;
+			continue;
+		}
+		*offset += line - perf_map_buffer;
+	}
+	return 0;
+}
+
+/* End of perf map helper functions */
+
+/* Bring the process' perf map up to date and add it as a module with no
+   bias, unless pi has it already. Processes without one (i.e. without a JIT)
+   cost a failed stat(). */
+int grok_perf_map(process_info *pi)
+{
+	char file_name[64];
+	struct stat st;
+	perf_map *map = NULL;
+	perf_symbol *added = NULL;
+	int number_added = 0;
+	off_t offset = 0;
+	int skipping = 0;
+	int changed = 0;
+	int fd = -1;
+	int ret = 0;
+	int x;
+
+	sprintf(file_name, "/tmp/perf-%d.map", pi->pid);
+	if (stat(file_name, &st)) {
+		return 0;
+	}
+	map = find_perf_map(pi->pid);
+	if (NULL == map) {
+		return ENOMEM;
+	}
+	if (map->dev != st.st_dev || map->ino != st.st_ino || st.st_size < map->offset) {
+		reset_perf_map(map, &st);
+		map->image.path = "[perf map]";
+		changed = 1;
+	}
+	if (st.st_size > map->offset) {
+		fd = open(file_name, O_RDONLY);
+		if (fd < 0) {
+			ret = errno;
+			log(DEBUG, "Failed to open %s: %s\n", file_name, strerror(ret));
+			return ret;
+		}
+		offset = map->offset;
+		skipping = map->skipping;
+		ret = read_perf_map_lines(map, fd, &offset, &skipping, &added, &number_added);
+		close(fd);
+		if (!ret && number_added) {
+			qsort(added, number_added, sizeof(perf_symbol), compare_perf_symbols);
+			ret = merge_perf_symbols(map, added, number_added);
+		}
+		free(added);
+		if (!ret) {
+			/* Only now are the lines read for good */
+			map->offset = offset;
+			map->skipping = skipping;
+			changed |= number_added > 0;
+			if (number_added) {
+				log(DEBUG, "Read %d perf map entries from %s, %d in total\n",
+					number_added, file_name, map->image.number_of_symbols);
+			}
+		}
+	}
+	if (ret) {
+		return ret;
+	}
+	for (x = 0; x < pi->number_of_modules; x++) {
+		if (pi->modules[x].image == &map->image) {
+			if (changed) {
+				/* Its extent may have grown */
+				pi->module_ranges = NULL;
+				pi->number_of_module_ranges = 0;
+			}
+			return 0;
+		}
+	}
+	return add_process_module(pi, &map->image, 0);
+}
@@ -0,0 +1,536 @@
+/*
+ * Record and replay: log every read made of a target to a file, and serve
+ * the same reads back from it later with no process involved
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "lsstack.h"
+
+/* A recording is a magic string followed by records, each a header and
+   'length' bytes of payload. Every dump starts with a process record; the
+   records after it, up to the next one, describe that dump:
+
+     RECORD_PROCESS    address = pid, payload = the executable's path
+     RECORD_MEMORY     address, payload = the bytes read there
+     RECORD_REGISTERS  address = thread id, payload = user_regs_struct
+     RECORD_MAP        address = start, payload = recorded_map and the path
+     RECORD_THREADS    payload = threads present flag, initial and manager
+                       thread ids, then the threads in the order walked
+
+   Replay lays each dump's memory records out as contiguous segments, so a
+   read is served as long as every byte of it was read while recording.
+ */
+
+#define RECORDING_MAGIC "LSSTACK1"
+
+#define RECORD_PROCESS 1
+#define RECORD_MEMORY 2
+#define RECORD_REGISTERS 3
+#define RECORD_MAP 4
+#define RECORD_THREADS 5
+
+typedef struct _record_header {
+	uint32_t type;
+	uint32_t length;
+	uint64_t address;
+} record_header;
+
+typedef struct _recorded_map {
+	uint64_t end;
+	uint64_t offset;
+	uint64_t executable;
+} recorded_map;
+
+static FILE *recording = NULL;
+
+/* Recording helper functions */
+
+static void write_record(uint32_t type, TARGET_ADDRESS address, const void *payload, size_t length, const void *more, size_t more_length)
+{
+	record_header header;
+	if (NULL == recording) {
+		return;
+	}
+	header.type = type;
+	header.length = length + more_length;
+	header.address = address;
+	if (1 != fwrite(&header, sizeof(header), 1, recording) ||
+		(length && 1 != fwrite(payload, length, 1, recording)) ||
+		(more_length && 1 != fwrite(more, more_length, 1, recording))) {
+		log(ERROR, "Failed to write the recording: %s, recording stopped\n", strerror(errno));
+		fclose(recording);
+		recording = NULL;
+	}
+}
+
+/* End of recording helper functions */
+
+int open_recording(const char *path)
+{
+	int ret = 0;
+	recording = fopen(path, "w");
+	if (NULL == recording) {
+		ret = errno;
+		log(ERROR, "Failed to create recording %s: %s\n", path, strerror(ret));
+		return ret;
+	}
+	/* Reads come in words; let stdio batch them */
+	setvbuf(recording, NULL, _IOFBF, 1024 * 1024);
+	fwrite(RECORDING_MAGIC, strlen(RECORDING_MAGIC), 1, recording);
+	return 0;
+}
+
+void close_recording(void)
+{
+	if (NULL != recording) {
+		fclose(recording);
+		recording = NULL;
+	}
+}
+
+int is_recording(void)
+{
+	return NULL != recording;
+}
+
+void record_process(process_info *pi)
+{
+	char file_name[64];
+	char exe_path[PATH_MAX];
+	ssize_t length;
+	if (NULL == recording) {
+		return;
+	}
+	sprintf(file_name, "/proc/%d/exe", pi->pid);
+	length = readlink(file_name, exe_path, sizeof(exe_path) - 1);
+	if (length < 0) {
+		length = 0;
+	}
+	exe_path[length] = '\0';
+	write_record(RECORD_PROCESS, pi->pid, exe_path, length + 1, NULL, 0);
+}
+
+void record_target_read(const char *value, size_t length, TARGET_ADDRESS address)
+{
+	write_record(RECORD_MEMORY, address, value, length, NULL, 0);
+}
+
+void record_target_registers(int thepid, struct user_regs_struct *regs)
+{
+	write_record(RECORD_REGISTERS, thepid, regs, sizeof(*regs), NULL, 0);
+}
+
+void record_memory_maps(process_info *pi)
+{
+	int x;
+	for (x = 0; recording && x < pi->number_of_maps; x++) {
+		memory_map *map = &pi->maps[x];
+		recorded_map rm;
+		rm.end = map->end;
+		rm.offset = map->offset;
+		rm.executable = map->executable;
+		write_record(RECORD_MAP, map->start, &rm, sizeof(rm), map->path, strlen(map->path) + 1);
+	}
+}
+
+void record_threads(process_info *pi, thread_stack *stacks, int number_of_stacks)
+{
+	int32_t *ids = NULL;
+	int x;
+	if (NULL == recording) {
+		return;
+	}
+	ids = (int32_t*) malloc((number_of_stacks + 3) * sizeof(int32_t));
+	if (NULL == ids) {
+		return;
+	}
+	ids[0] = pi->threads_present_flag;
+	ids[1] = pi->initial_thread_id;
+	ids[2] = pi->manager_thread_id;
+	for (x = 0; x < number_of_stacks; x++) {
+		ids[x + 3] = stacks[x].pid;
+	}
+	write_record(RECORD_THREADS, 0, ids, (number_of_stacks + 3) * sizeof(int32_t), NULL, 0);
+	free(ids);
+	/* The dump's reads are over; don't lose them if we are interrupted */
+	if (NULL != recording) {
+		fflush(recording);
+	}
+}
+
+/* Replay */
+
+typedef struct _replay_read {
+	TARGET_ADDRESS address;
+	size_t length;
+	const char *data;
+	int sequence;
+} replay_read;
+
+typedef struct _replay_segment {
+	TARGET_ADDRESS start;
+	size_t size;
+	char *data;
+} replay_segment;
+
+typedef struct _replay_registers {
+	int pid;
+	struct user_regs_struct regs;
+} replay_registers;
+
+typedef struct _replay_process {
+	int pid;
+	char *exe_path;
+	replay_segment *segments; /* Sorted, not overlapping */
+	int number_of_segments;
+	replay_registers *registers;
+	int number_of_registers;
+	memory_map *maps;
+	int number_of_maps;
+	int *thread_pids; /* Zero terminated */
+	int threads_present_flag;
+	int initial_thread_id;
+	int manager_thread_id;
+} replay_process;
+
+static char *replay_image = NULL;
+static replay_process *replay_processes = NULL;
+static int number_of_replay_processes = 0;
+
+/* Replay helper functions */
+
+static int compare_replay_reads(const void *a, const void *b)
+{
+	const replay_read *x = (const replay_read*)a;
+	const replay_read *y = (const replay_read*)b;
+	if (x->address != y->address) {
+		return (x->address > y->address) - (x->address < y->address);
+	}
+	return x->sequence - y->sequence;
+}
+
+/* Lay the reads out as segments. Overlapping reads saw the same memory at
+   the same moment, so it doesn't matter which one a byte is copied from. */
+static int build_replay_segments(replay_process *rp, replay_read *reads, int number_of_reads)
+{
+	int x, y;
+	qsort(reads, number_of_reads, sizeof(replay_read), compare_replay_reads);
+	rp->segments = (replay_segment*) calloc(number_of_reads + 1, sizeof(replay_segment));
+	if (NULL == rp->segments) {
+		return ENOMEM;
+	}
+	for (x = 0; x < number_of_reads; x = y) {
+		replay_segment *segment = &rp->segments[rp->number_of_segments++];
+		TARGET_ADDRESS end = reads[x].address + reads[x].length;
+		for (y = x + 1; y < number_of_reads && reads[y].address <= end; y++) {
+			if (reads[y].address + reads[y].length > end) {
+				end = reads[y].address + reads[y].length;
+			}
+		}
+		segment->start = reads[x].address;
+		segment->size = end - segment->start;
+		segment->data = (char*) malloc(segment->size);
+		if (NULL == segment->data) {
+			return ENOMEM;
+		}
+		for (; x < y; x++) {
+			memcpy(segment->data + (reads[x].address - segment->start), reads[x].data, reads[x].length);
+		}
+	}
+	return 0;
+}
+
+static void *grow_array(void *array, int number, int *size, size_t element_size)
+{
+	void *temp = NULL;
+	if (number < *size) {
+		return array;
+	}
+	temp = realloc(array, (*size ? *size * 2 : 16) * element_size);
+	if (NULL != temp) {
+		*size = *size ? *size * 2 : 16;
+	}
+	return temp;
+}
+
+/* One dump's records, from position up to the next process record */
+static int load_replay_process(replay_process *rp, size_t *position, size_t size)
+{
+	record_header *header = (record_header*)(replay_image + *position);
+	replay_read *reads = NULL;
+	int number_of_reads = 0, reads_size = 0;
+	int registers_size = 0, maps_size = 0;
+	int ret = 0;
+
+	rp->pid = header->address;
+	rp->exe_path = replay_image + *position + sizeof(record_header);
+	replay_image[*position + sizeof(record_header) + header->length - 1] = '\0';
+	*position += sizeof(record_header) + header->length;
+
+	while (!ret && *position + sizeof(record_header) <= size) {
+		char *payload = NULL;
+		header = (record_header*)(replay_image + *position);
+		payload = replay_image + *position + sizeof(record_header);
+		if (RECORD_PROCESS == header->type) {
+			break;
+		}
+		if (*position + sizeof(record_header) + header->length > size) {
+			log(ERROR, "The recording is truncated\n");
+			break;
+		}
+		*position += sizeof(record_header) + header->length;
+		switch (header->type) {
+			case RECORD_MEMORY:
+				reads = (replay_read*) grow_array(reads, number_of_reads, &reads_size, sizeof(replay_read));
+				if (NULL == reads) {
+					return ENOMEM;
+				}
+				reads[number_of_reads].address = header->address;
+				reads[number_of_reads].length = header->length;
+				reads[number_of_reads].data = payload;
+				reads[number_of_reads].sequence = number_of_reads;
+				number_of_reads++;
+				break;
+			case RECORD_REGISTERS:
+				if (header->length != sizeof(struct user_regs_struct)) {
+					break;
+				}
+				rp->registers = (replay_registers*) grow_array(rp->registers, rp->number_of_registers, &registers_size, sizeof(replay_registers));
+				if (NULL == rp->registers) {
+					return ENOMEM;
+				}
+				rp->registers[rp->number_of_registers].pid = header->address;
+				memcpy(&rp->registers[rp->number_of_registers].regs, payload, sizeof(struct user_regs_struct));
+				rp->number_of_registers++;
+				break;
+			case RECORD_MAP:
+				if (header->length <= sizeof(recorded_map)) {
+					break;
+				}
+				if (rp->number_of_maps && header->address <= rp->maps[rp->number_of_maps - 1].start) {
+					/* The maps were read again (the libraries changed); the last listing wins */
+					rp->number_of_maps = 0;
+				}
+				rp->maps = (memory_map*) grow_array(rp->maps, rp->number_of_maps, &maps_size, sizeof(memory_map));
+				if (NULL == rp->maps) {
+					return ENOMEM;
+				}
+				{
+					recorded_map rm;
+					memory_map *map = &rp->maps[rp->number_of_maps++];
+					memcpy(&rm, payload, sizeof(rm));
+					map->start = header->address;
+					map->end = rm.end;
+					map->offset = rm.offset;
+					map->executable = rm.executable;
+					map->path = payload + sizeof(rm);
+					payload[header->length - 1] = '\0';
+				}
+				break;
+			case RECORD_THREADS:
+				{
+					int32_t *ids = (int32_t*)payload;
+					int number = header->length / sizeof(int32_t) - 3;
+					int x;
+					if (number < 0) {
+						break;
+					}
+					free(rp->thread_pids);
+					rp->thread_pids = (int*) calloc(number + 1, sizeof(int));
+					if (NULL == rp->thread_pids) {
+						return ENOMEM;
+					}
+					rp->threads_present_flag = ids[0];
+					rp->initial_thread_id = ids[1];
+					rp->manager_thread_id = ids[2];
+					for (x = 0; x < number; x++) {
+						rp->thread_pids[x] = ids[x + 3];
+					}
+				}
+				break;
+		}
+	}
+	if (!ret) {
+		ret = build_replay_segments(rp, reads, number_of_reads);
+	}
+	free(reads);
+	log(DEBUG, "Replaying process %d: %d reads in %d segments, %d register sets, %d maps\n",
+		rp->pid, number_of_reads, rp->number_of_segments, rp->number_of_registers, rp->number_of_maps);
+	return ret;
+}
+
+/* End of replay helper functions */
+
+/* Replay target operations */
+
+static int replay_read_block(process_info *pi, char *value, size_t length, TARGET_ADDRESS address)
+{
+	replay_process *rp = (replay_process*)pi->target;
+	int low = 0;
+	int high = rp->number_of_segments - 1;
+	while (low <= high) {
+		int middle = low + (high - low) / 2;
+		replay_segment *segment = &rp->segments[middle];
+		if (address < segment->start) {
+			high = middle - 1;
+		} else if (address >= segment->start + segment->size) {
+			low = middle + 1;
+		} else {
+			if (address + length > segment->start + segment->size) {
+				break;
+			}
+			memcpy(value, segment->data + (address - segment->start), length);
+			return 0;
+		}
+	}
+	/* Not read while recording: a replay with other options than the recording */
+	return EIO;
+}
+
+static int replay_read_registers(process_info *pi, struct user_regs_struct *regs, int thepid)
+{
+	replay_process *rp = (replay_process*)pi->target;
+	int x;
+	for (x = 0; x < rp->number_of_registers; x++) {
+		if (rp->registers[x].pid == thepid) {
+			*regs = rp->registers[x].regs;
+			return 0;
+		}
+	}
+	return ESRCH;
+}
+
+static int replay_grok_maps(process_info *pi)
+{
+	replay_process *rp = (replay_process*)pi->target;
+	pi->maps = rp->maps;
+	pi->number_of_maps = rp->number_of_maps;
+	return 0;
+}
+
+static target_ops replay_ops = {
+	replay_read_block,
+	replay_read_registers,
+	replay_grok_maps,
+};
+
+/* End of replay target operations */
+
+int open_replay_file(const char *path, int *number_of_processes)
+{
+	struct stat st;
+	size_t position = strlen(RECORDING_MAGIC);
+	int processes_size = 0;
+	int fd = -1;
+	int ret = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		ret = errno;
+		log(ERROR, "Failed to open recording %s: %s\n", path, strerror(ret));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return ret;
+	}
+	/* Read, not mapped: the loader terminates strings in place */
+	replay_image = (char*) malloc(st.st_size + 1);
+	if (NULL == replay_image) {
+		close(fd);
+		return ENOMEM;
+	}
+	if (st.st_size != read(fd, replay_image, st.st_size)) {
+		ret = errno ? errno : EIO;
+		log(ERROR, "Failed to read recording %s: %s\n", path, strerror(ret));
+		close(fd);
+		return ret;
+	}
+	close(fd);
+	if ((size_t)st.st_size < position || memcmp(replay_image, RECORDING_MAGIC, position)) {
+		log(ERROR, "%s is not an lsstack64 recording\n", path);
+		return EINVAL;
+	}
+	while (!ret && position + sizeof(record_header) <= (size_t)st.st_size) {
+		record_header *header = (record_header*)(replay_image + position);
+		if (RECORD_PROCESS != header->type || 0 == header->length ||
+			position + sizeof(record_header) + header->length > (size_t)st.st_size) {
+			log(ERROR, "Unexpected record in %s\n", path);
+			ret = EINVAL;
+			break;
+		}
+		replay_processes = (replay_process*) grow_array(replay_processes, number_of_replay_processes,
+			&processes_size, sizeof(replay_process));
+		if (NULL == replay_processes) {
+			return ENOMEM;
+		}
+		memset(&replay_processes[number_of_replay_processes], 0, sizeof(replay_process));
+		ret = load_replay_process(&replay_processes[number_of_replay_processes++], &position, st.st_size);
+	}
+	*number_of_processes = number_of_replay_processes;
+	return ret;
+}
+
+/* Point pi at one of the recorded dumps */
+int open_replay_process(process_info *pi, int index)
+{
+	replay_process *rp = NULL;
+	if (index < 0 || index >= number_of_replay_processes) {
+		return EINVAL;
+	}
+	rp = &replay_processes[index];
+	pi->ops = &replay_ops;
+	pi->target = rp;
+	pi->pid = rp->pid;
+	pi->peek_pid = rp->pid;
+	pi->exe_path = rp->exe_path;
+	if (NULL != rp->thread_pids) {
+		pi->thread_pids = rp->thread_pids;
+		pi->threads_present_flag = rp->threads_present_flag;
+		pi->initial_thread_id = rp->initial_thread_id;
+		pi->manager_thread_id = rp->manager_thread_id;
+	}
+	return 0;
+}
+
+void close_replay_file(void)
+{
+	int x, y;
+	for (x = 0; x < number_of_replay_processes; x++) {
+		replay_process *rp = &replay_processes[x];
+		for (y = 0; y < rp->number_of_segments; y++) {
+			free(rp->segments[y].data);
+		}
+		free(rp->segments);
+		free(rp->registers);
+		free(rp->maps);
+		free(rp->thread_pids);
+	}
+	free(replay_processes);
+	free(replay_image);
+	replay_processes = NULL;
+	number_of_replay_processes = 0;
+	replay_image = NULL;
+}
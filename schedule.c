@@ -0,0 +1,123 @@
+/*
+ * Sampling schedule: absolute deadlines on a timerfd, with optional jitter
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "log.h"
+#include "stats.h"
+#include "schedule.h"
+
+/* Sleeping for the period after each sample makes the real period the
+   period plus however long the sample took, and the error adds up. The
+   deadlines here are instead start + n * period, on CLOCK_MONOTONIC, so a
+   slow sample only delays the next one. When a sample takes longer than a
+   whole period the deadlines it ran over are skipped and counted as missed,
+   rather than fired back to back.
+
+   A fixed period can also line up with periodic work in the target and keep
+   catching it at the same point. The jitter moves each deadline by a random
+   amount around its place on the grid; as the grid itself doesn't move, the
+   mean period stays the same. */
+
+/* Schedule helper functions */
+
+static long long monotonic_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Uniform in [-jitter_ns, jitter_ns] */
+static long long random_jitter(schedule *s)
+{
+	unsigned long long value;
+	if (0 == s->jitter_ns) {
+		return 0;
+	}
+	value = ((unsigned long long)random() << 31) | random();
+	return (long long)(value % (2 * s->jitter_ns + 1)) - s->jitter_ns;
+}
+
+/* End of schedule helper functions */
+
+int start_schedule(schedule *s, int period_ms, int jitter_percent)
+{
+	memset(s, 0, sizeof(*s));
+	s->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (s->fd < 0) {
+		int ret = errno;
+		log(ERROR, "Failed to create the sampling timer: %s\n", strerror(ret));
+		return ret;
+	}
+	s->period_ns = period_ms * 1000000LL;
+	s->jitter_ns = s->period_ns * jitter_percent / 100;
+	s->nominal_ns = monotonic_ns();
+	srandom(s->nominal_ns ^ getpid());
+	return 0;
+}
+
+int wait_for_deadline(schedule *s)
+{
+	struct itimerspec deadline;
+	unsigned long long expirations;
+	unsigned long missed = 0;
+	long long now = monotonic_ns();
+	long long when;
+
+	s->nominal_ns += s->period_ns;
+	while (s->nominal_ns <= now) {
+		s->nominal_ns += s->period_ns;
+		missed++;
+	}
+	if (missed) {
+		log(INFO, "Missed %lu sampling deadlines: sampling took longer than the %lld ms period\n",
+			missed, s->period_ns / 1000000);
+	}
+	s->deadlines += missed + 1;
+	s->missed += missed;
+	count_deadlines(missed + 1, missed);
+
+	/* A deadline jittered into the past fires at once */
+	when = s->nominal_ns + random_jitter(s);
+	memset(&deadline, 0, sizeof(deadline));
+	deadline.it_value.tv_sec = when / 1000000000LL;
+	deadline.it_value.tv_nsec = when % 1000000000LL;
+	if (timerfd_settime(s->fd, TFD_TIMER_ABSTIME, &deadline, NULL)) {
+		return errno;
+	}
+	while (read(s->fd, &expirations, sizeof(expirations)) < 0) {
+		if (EINTR != errno) {
+			return errno;
+		}
+	}
+	return 0;
+}
+
+void stop_schedule(schedule *s)
+{
+	if (s->fd >= 0) {
+		close(s->fd);
+		s->fd = -1;
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * Sampling schedule: absolute deadlines on a timerfd, with optional jitter
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Largest -j, which keeps each deadline after the one before it */
+#define MAXIMUM_JITTER_PERCENT 50
+
+typedef struct _schedule {
+	int fd; /* CLOCK_MONOTONIC timerfd */
+	long long period_ns;
+	long long jitter_ns; /* Each deadline moves by up to this much either way */
+	long long nominal_ns; /* The current deadline, before the jitter */
+	unsigned long deadlines;
+	unsigned long missed; /* Deadlines that passed while a sample was taken */
+} schedule;
+
+/* The first deadline is now; the caller samples, then waits for the next */
+int start_schedule(schedule *s, int period_ms, int jitter_percent);
+int wait_for_deadline(schedule *s);
+void stop_schedule(schedule *s);
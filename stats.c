@@ -0,0 +1,218 @@
+/*
+ * Counters and timers for the --stats report
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+
+#include "log.h"
+#include "stats.h"
+
+int stats_option = 0;
+stats current_stats;
+
+/* Modules whose symbols were needed since the last report */
+typedef struct _module_stats {
+	char *path;
+	int number_of_symbols;
+	int reused;
+	unsigned long ns;
+} module_stats;
+
+static module_stats *modules = NULL;
+static int number_of_modules = 0;
+static int modules_size = 0;
+
+static const char *ptrace_names[STATS_PTRACE_TYPES] = {
+	"attach", "detach", "peekdata", "peekuser", "getregs", "cont", "other"
+};
+
+static const char *timer_names[STATS_TIMERS] = {
+	"attach", "symbols", "walk", "symbolize", "output"
+};
+
+void count_ptrace_request(int request)
+{
+	int type;
+	if (!stats_option) {
+		return;
+	}
+	switch (request) {
+		case PTRACE_ATTACH:
+			type = STATS_PTRACE_ATTACH;
+			break;
+		case PTRACE_DETACH:
+			type = STATS_PTRACE_DETACH;
+			break;
+		case PTRACE_PEEKDATA:
+			type = STATS_PTRACE_PEEKDATA;
+			break;
+		case PTRACE_PEEKUSER:
+			type = STATS_PTRACE_PEEKUSER;
+			break;
+		case PTRACE_GETREGS:
+			type = STATS_PTRACE_GETREGS;
+			break;
+		case PTRACE_CONT:
+			type = STATS_PTRACE_CONT;
+			break;
+		default:
+			type = STATS_PTRACE_OTHER;
+			break;
+	}
+	current_stats.ptrace_calls[type]++;
+}
+
+void count_bytes_read(unsigned long bytes)
+{
+	current_stats.bytes_read += bytes;
+}
+
+void count_thread_frames(int number_of_frames)
+{
+	if (0 == current_stats.threads || (unsigned long)number_of_frames < current_stats.min_frames) {
+		current_stats.min_frames = number_of_frames;
+	}
+	if ((unsigned long)number_of_frames > current_stats.max_frames) {
+		current_stats.max_frames = number_of_frames;
+	}
+	current_stats.threads++;
+	current_stats.frames += number_of_frames;
+}
+
+void count_reused_frames(int number_of_frames)
+{
+	current_stats.frames_reused += number_of_frames;
+}
+
+void count_attached_threads(int number_of_threads, unsigned long ns)
+{
+	current_stats.threads_attached += number_of_threads;
+	current_stats.attach_ns += ns;
+}
+
+void count_deadlines(unsigned long deadlines, unsigned long missed)
+{
+	current_stats.deadlines += deadlines;
+	current_stats.missed_deadlines += missed;
+}
+
+void count_module(const char *path, int number_of_symbols, int reused, unsigned long ns)
+{
+	module_stats *module = NULL;
+	if (reused) {
+		current_stats.modules_reused++;
+	} else {
+		current_stats.modules_loaded++;
+		current_stats.symbols_loaded += number_of_symbols;
+	}
+	if (!stats_option) {
+		return;
+	}
+	if (number_of_modules == modules_size) {
+		int size = modules_size ? modules_size * 2 : 32;
+		module_stats *temp = (module_stats*) realloc(modules, size * sizeof(module_stats));
+		if (NULL == temp) {
+			return;
+		}
+		modules = temp;
+		modules_size = size;
+	}
+	module = &modules[number_of_modules];
+	module->path = strdup(path);
+	if (NULL == module->path) {
+		return;
+	}
+	module->number_of_symbols = number_of_symbols;
+	module->reused = reused;
+	module->ns = ns;
+	number_of_modules++;
+}
+
+void start_timer(struct timespec *start)
+{
+	if (stats_option) {
+		clock_gettime(CLOCK_MONOTONIC, start);
+	}
+}
+
+/* Add the time since start_timer to a timer, and return it in ns */
+unsigned long stop_timer(struct timespec *start, int timer)
+{
+	struct timespec now;
+	unsigned long ns;
+	if (!stats_option) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - start->tv_sec) * 1000000000UL + now.tv_nsec - start->tv_nsec;
+	current_stats.timer_ns[timer] += ns;
+	return ns;
+}
+
+void print_stats(void)
+{
+	unsigned long total = 0;
+	int x;
+
+	for (x = 0; x < STATS_PTRACE_TYPES; x++) {
+		total += current_stats.ptrace_calls[x];
+	}
+	if (!stats_option || (0 == total && 0 == current_stats.threads && 0 == number_of_modules)) {
+		return;
+	}
+	log(INFO, "Stats: %lu ptrace calls (%s %lu, %s %lu, %s %lu, %s %lu, %s %lu, %s %lu, %s %lu), %lu bytes read\n",
+		total,
+		ptrace_names[0], current_stats.ptrace_calls[0], ptrace_names[1], current_stats.ptrace_calls[1],
+		ptrace_names[2], current_stats.ptrace_calls[2], ptrace_names[3], current_stats.ptrace_calls[3],
+		ptrace_names[4], current_stats.ptrace_calls[4], ptrace_names[5], current_stats.ptrace_calls[5],
+		ptrace_names[6], current_stats.ptrace_calls[6], current_stats.bytes_read);
+	log(INFO, "Stats: %lu modules loaded with %lu symbols, %lu reused\n",
+		current_stats.modules_loaded, current_stats.symbols_loaded, current_stats.modules_reused);
+	for (x = 0; x < number_of_modules; x++) {
+		log(INFO, "Stats:   %s: %d symbols, %s, %.3f ms\n", modules[x].path, modules[x].number_of_symbols,
+			modules[x].reused ? "reused" : "loaded", modules[x].ns / 1e6);
+	}
+	log(INFO, "Stats: %s %.3f ms, %s %.3f ms, %s %.3f ms, %s %.3f ms, %s %.3f ms\n",
+		timer_names[0], current_stats.timer_ns[0] / 1e6, timer_names[1], current_stats.timer_ns[1] / 1e6,
+		timer_names[2], current_stats.timer_ns[2] / 1e6, timer_names[3], current_stats.timer_ns[3] / 1e6,
+		timer_names[4], current_stats.timer_ns[4] / 1e6);
+	if (current_stats.threads) {
+		log(INFO, "Stats: %lu threads, %lu frames (%lu reused), %lu/%.1f/%lu min/mean/max frames per thread\n",
+			current_stats.threads, current_stats.frames, current_stats.frames_reused, current_stats.min_frames,
+			(double)current_stats.frames / current_stats.threads, current_stats.max_frames);
+	}
+	if (current_stats.threads_attached && current_stats.attach_ns) {
+		log(INFO, "Stats: attached %lu threads in %.3f ms, %.0f threads/s\n",
+			current_stats.threads_attached, current_stats.attach_ns / 1e6,
+			current_stats.threads_attached * 1e9 / current_stats.attach_ns);
+	}
+	if (current_stats.deadlines) {
+		log(INFO, "Stats: %lu sampling deadlines, %lu missed\n",
+			current_stats.deadlines, current_stats.missed_deadlines);
+	}
+}
+
+void reset_stats(void)
+{
+	int x;
+	for (x = 0; x < number_of_modules; x++) {
+		free(modules[x].path);
+	}
+	number_of_modules = 0;
+	memset(&current_stats, 0, sizeof(current_stats));
+}
@@ -0,0 +1,76 @@
+/*
+ * Counters and timers for the --stats report
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#define STATS_PTRACE_ATTACH 0
+#define STATS_PTRACE_DETACH 1
+#define STATS_PTRACE_PEEKDATA 2
+#define STATS_PTRACE_PEEKUSER 3
+#define STATS_PTRACE_GETREGS 4
+#define STATS_PTRACE_CONT 5
+#define STATS_PTRACE_OTHER 6
+#define STATS_PTRACE_TYPES 7
+
+#define STATS_ATTACH 0
+#define STATS_SYMBOLS 1 /* get_file_symbols */
+#define STATS_WALK 2
+#define STATS_SYMBOLIZE 3
+#define STATS_OUTPUT 4
+#define STATS_TIMERS 5
+
+typedef struct _stats {
+	unsigned long ptrace_calls[STATS_PTRACE_TYPES];
+	unsigned long bytes_read;
+	unsigned long modules_loaded;
+	unsigned long modules_reused;
+	unsigned long symbols_loaded;
+	unsigned long threads;
+	unsigned long frames;
+	unsigned long frames_reused; /* Copied from the last sample's chain */
+	unsigned long min_frames;
+	unsigned long max_frames;
+	unsigned long threads_attached;
+	unsigned long attach_ns; /* Of the threads_attached */
+	unsigned long deadlines; /* Sampling deadlines passed */
+	unsigned long missed_deadlines; /* Of which no sample was taken at */
+	unsigned long timer_ns[STATS_TIMERS];
+} stats;
+
+extern int stats_option;
+extern stats current_stats;
+
+/* Every ptrace() in lsstack.c goes through here. A macro keeps ptrace()'s
+   variadic calling convention as it is. */
+#define counted_ptrace(request, pid, addr, data) \
+	(count_ptrace_request(request), ptrace(request, pid, addr, data))
+
+void count_ptrace_request(int request);
+void count_bytes_read(unsigned long bytes);
+void count_thread_frames(int number_of_frames);
+void count_reused_frames(int number_of_frames);
+void count_attached_threads(int number_of_threads, unsigned long ns);
+void count_deadlines(unsigned long deadlines, unsigned long missed);
+void count_module(const char *path, int number_of_symbols, int reused, unsigned long ns);
+
+void start_timer(struct timespec *start);
+unsigned long stop_timer(struct timespec *start, int timer);
+
+void print_stats(void);
+void reset_stats(void);
@@ -0,0 +1,380 @@
+/*
+ * Conditional capture: watch a process through /proc without attaching to it
+ * and say when it is worth a stack dump
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "log.h"
+#include "lsstack.h"
+
+/* Per-thread state carried between polls, for the running condition */
+typedef struct _running_thread {
+	int pid;
+	long running_since; /* ms, 0 when not seen running at the last poll */
+	int seen;
+} running_thread;
+
+static running_thread *running_threads = NULL;
+static int number_of_running_threads = 0;
+static int running_threads_size = 0;
+
+/* /proc helper functions */
+
+static long now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Pick the state, utime + stime and thread count out of a stat file. The
+   command name is in parentheses and may itself contain spaces or ')'. */
+int read_stat_file(const char *file_name, char *state, unsigned long *ticks, long *threads)
+{
+	char line[1024];
+	char *fields = NULL;
+	unsigned long utime = 0, stime = 0;
+	FILE *fp = fopen(file_name, "r");
+	if (NULL == fp) {
+		return errno;
+	}
+	if (NULL == fgets(line, sizeof(line), fp)) {
+		fclose(fp);
+		return EIO;
+	}
+	fclose(fp);
+	fields = strrchr(line, ')');
+	if (NULL == fields) {
+		return EIO;
+	}
+	/* Fields 3, 14, 15 and 20 of proc(5) */
+	if (4 != sscanf(fields + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %ld",
+			state, &utime, &stime, threads)) {
+		return EIO;
+	}
+	*ticks = utime + stime;
+	return 0;
+}
+
+static running_thread *find_running_thread(int thepid)
+{
+	int x;
+	for (x = 0; x < number_of_running_threads; x++) {
+		if (running_threads[x].pid == thepid) {
+			return &running_threads[x];
+		}
+	}
+	if (number_of_running_threads == running_threads_size) {
+		int size = running_threads_size ? running_threads_size * 2 : 64;
+		running_thread *temp = (running_thread*) realloc(running_threads, size * sizeof(running_thread));
+		if (NULL == temp) {
+			return NULL;
+		}
+		running_threads = temp;
+		running_threads_size = size;
+	}
+	running_threads[number_of_running_threads].pid = thepid;
+	running_threads[number_of_running_threads].running_since = 0;
+	return &running_threads[number_of_running_threads++];
+}
+
+/* The longest any thread has been seen in R state on consecutive polls. A
+   thread that was running at both polls is assumed to have run in between. */
+static long grok_longest_running(int pid, long now, int *running_pid)
+{
+	char task_dir_name[64];
+	DIR *task_dir = NULL;
+	struct dirent *entry = NULL;
+	long longest = 0;
+	int x;
+
+	sprintf(task_dir_name, "/proc/%d/task", pid);
+	task_dir = opendir(task_dir_name);
+	if (NULL == task_dir) {
+		return 0;
+	}
+	for (x = 0; x < number_of_running_threads; x++) {
+		running_threads[x].seen = 0;
+	}
+	while (NULL != (entry = readdir(task_dir))) {
+		char file_name[96];
+		char state;
+		unsigned long ticks;
+		long threads;
+		running_thread *rt = NULL;
+		int thread_pid = atoi(entry->d_name);
+		if (thread_pid <= 0) {
+			continue;
+		}
+		sprintf(file_name, "%s/%d/stat", task_dir_name, thread_pid);
+		if (read_stat_file(file_name, &state, &ticks, &threads)) {
+			continue;
+		}
+		rt = find_running_thread(thread_pid);
+		if (NULL == rt) {
+			break;
+		}
+		rt->seen = 1;
+		if ('R' != state) {
+			rt->running_since = 0;
+			continue;
+		}
+		if (!rt->running_since) {
+			rt->running_since = now;
+		}
+		if (now - rt->running_since > longest) {
+			longest = now - rt->running_since;
+			*running_pid = thread_pid;
+		}
+	}
+	closedir(task_dir);
+	/* Forget threads that have exited */
+	for (x = 0; x < number_of_running_threads; ) {
+		if (running_threads[x].seen) {
+			x++;
+		} else {
+			running_threads[x] = running_threads[--number_of_running_threads];
+		}
+	}
+	return longest;
+}
+
+/* End of /proc helper functions */
+
+/* Parse "cpu=X,running=N,threads=+N"; any one condition holding fires */
+int parse_trigger(trigger *t, const char *spec)
+{
+	char *copy = strdup(spec);
+	char *condition = NULL;
+	char *saveptr = NULL;
+	int ret = 0;
+
+	if (NULL == copy) {
+		return ENOMEM;
+	}
+	memset(t, 0, sizeof(*t));
+	for (condition = strtok_r(copy, ",", &saveptr); condition; condition = strtok_r(NULL, ",", &saveptr)) {
+		if (0 == strncmp(condition, "cpu=", 4)) {
+			t->cpu_percent = atoi(condition + 4);
+		} else if (0 == strncmp(condition, "running=", 8)) {
+			t->running_ms = atoi(condition + 8);
+		} else if (0 == strncmp(condition, "threads=+", 9)) {
+			t->thread_growth = atoi(condition + 9);
+		} else {
+			log(ERROR, "Unknown trigger condition: %s\n", condition);
+			ret = EINVAL;
+			break;
+		}
+	}
+	free(copy);
+	if (!ret && t->cpu_percent <= 0 && t->running_ms <= 0 && t->thread_growth <= 0) {
+		log(ERROR, "No trigger condition in: %s\n", spec);
+		ret = EINVAL;
+	}
+	return ret;
+}
+
+/* Take a fresh baseline, e.g. at the start or after a capture, whose own
+   cost shouldn't count towards the next trigger */
+int reset_trigger(trigger *t, int pid)
+{
+	char file_name[64];
+	char state;
+	int ret = 0;
+
+	sprintf(file_name, "/proc/%d/stat", pid);
+	ret = read_stat_file(file_name, &state, &t->last_ticks, &t->baseline_threads);
+	t->last_poll = now_ms();
+	number_of_running_threads = 0;
+	return ret;
+}
+
+/* One poll. Returns 0 when a condition holds, EAGAIN when none does, or the
+   error that stopped us reading the process (ENOENT when it has gone) */
+int poll_trigger(trigger *t, int pid)
+{
+	char file_name[64];
+	char state;
+	unsigned long ticks = 0;
+	long threads = 0;
+	long now = now_ms();
+	int ret = 0;
+
+	sprintf(file_name, "/proc/%d/stat", pid);
+	ret = read_stat_file(file_name, &state, &ticks, &threads);
+	if (ret) {
+		return ret;
+	}
+	if (t->cpu_percent > 0 && now > t->last_poll) {
+		long percent = (long)(ticks - t->last_ticks) * 1000 * 100 / sysconf(_SC_CLK_TCK) / (now - t->last_poll);
+		if (percent >= t->cpu_percent) {
+			log(INFO, "Trigger: process %d at %ld%% CPU\n", pid, percent);
+			return 0;
+		}
+	}
+	t->last_ticks = ticks;
+	t->last_poll = now;
+	if (t->thread_growth > 0 && threads - t->baseline_threads >= t->thread_growth) {
+		log(INFO, "Trigger: process %d went from %ld to %ld threads\n", pid, t->baseline_threads, threads);
+		return 0;
+	}
+	if (t->running_ms > 0) {
+		int running_pid = 0;
+		long longest = grok_longest_running(pid, now, &running_pid);
+		if (longest >= t->running_ms) {
+			log(INFO, "Trigger: LWP %d running for %ld ms\n", running_pid, longest);
+			return 0;
+		}
+	}
+	return EAGAIN;
+}
+
+/* CPU time per thread at the previous call of grok_busy_threads, for deltas */
+typedef struct _thread_ticks {
+	int pid;
+	int tgid;
+	unsigned long ticks;
+} thread_ticks;
+
+/* Sorted by pid */
+static thread_ticks *previous_ticks = NULL;
+static int number_of_previous_ticks = 0;
+
+static int compare_thread_pids(const void *a, const void *b)
+{
+	return ((const thread_ticks*)a)->pid - ((const thread_ticks*)b)->pid;
+}
+
+static int compare_thread_ticks(const void *a, const void *b)
+{
+	const thread_ticks *x = (const thread_ticks*)a;
+	const thread_ticks *y = (const thread_ticks*)b;
+	/* Busiest first */
+	return (x->ticks < y->ticks) - (x->ticks > y->ticks);
+}
+
+static unsigned long find_previous_ticks(int thepid)
+{
+	thread_ticks key;
+	thread_ticks *found = NULL;
+	if (0 == number_of_previous_ticks) {
+		return 0;
+	}
+	key.pid = thepid;
+	found = (thread_ticks*) bsearch(&key, previous_ticks, number_of_previous_ticks, sizeof(thread_ticks), compare_thread_pids);
+	return NULL != found ? found->ticks : 0;
+}
+
+/* Find the (at most) 'top' threads of a process that used the most CPU time
+   since the last call, or since they started on the first one. busy must have
+   room for 'top' entries; it is filled with thread ids and tick deltas, busiest
+   first, and threads that used no CPU time are left out. */
+int grok_busy_threads(int pid, int top, int *busy_pids, unsigned long *busy_ticks, int *number_of_busy)
+{
+	char task_dir_name[64];
+	DIR *task_dir = NULL;
+	struct dirent *entry = NULL;
+	thread_ticks *current = NULL;
+	thread_ticks *deltas = NULL;
+	int number_of_current = 0;
+	int current_size = 64;
+	int x;
+
+	*number_of_busy = 0;
+	sprintf(task_dir_name, "/proc/%d/task", pid);
+	task_dir = opendir(task_dir_name);
+	if (NULL == task_dir) {
+		return errno;
+	}
+	current_size += number_of_previous_ticks;
+	current = (thread_ticks*) malloc(current_size * sizeof(thread_ticks));
+	while (NULL != current && NULL != (entry = readdir(task_dir))) {
+		char file_name[96];
+		char state;
+		long threads;
+		int thread_pid = atoi(entry->d_name);
+		if (thread_pid <= 0) {
+			continue;
+		}
+		if (number_of_current == current_size) {
+			thread_ticks *temp = (thread_ticks*) realloc(current, current_size * 2 * sizeof(thread_ticks));
+			if (NULL == temp) {
+				free(current);
+				current = NULL;
+				break;
+			}
+			current = temp;
+			current_size *= 2;
+		}
+		sprintf(file_name, "%s/%d/stat", task_dir_name, thread_pid);
+		if (read_stat_file(file_name, &state, &current[number_of_current].ticks, &threads)) {
+			continue;
+		}
+		current[number_of_current].tgid = pid;
+		current[number_of_current++].pid = thread_pid;
+	}
+	closedir(task_dir);
+	if (NULL == current) {
+		return ENOMEM;
+	}
+
+	deltas = (thread_ticks*) malloc((number_of_current + 1) * sizeof(thread_ticks));
+	if (NULL == deltas) {
+		free(current);
+		return ENOMEM;
+	}
+	for (x = 0; x < number_of_current; x++) {
+		unsigned long before = find_previous_ticks(current[x].pid);
+		deltas[x].pid = current[x].pid;
+		deltas[x].ticks = current[x].ticks >= before ? current[x].ticks - before : 0;
+	}
+	qsort(deltas, number_of_current, sizeof(thread_ticks), compare_thread_ticks);
+	for (x = 0; x < number_of_current && x < top && deltas[x].ticks; x++) {
+		busy_pids[x] = deltas[x].pid;
+		busy_ticks[x] = deltas[x].ticks;
+	}
+	*number_of_busy = x;
+	free(deltas);
+
+	/* Keep what we know about other processes, replace this one's threads */
+	for (x = 0; x < number_of_previous_ticks; x++) {
+		if (previous_ticks[x].tgid == pid) {
+			continue;
+		}
+		if (number_of_current == current_size) {
+			thread_ticks *temp = (thread_ticks*) realloc(current, current_size * 2 * sizeof(thread_ticks));
+			if (NULL == temp) {
+				free(current);
+				return ENOMEM;
+			}
+			current = temp;
+			current_size *= 2;
+		}
+		current[number_of_current++] = previous_ticks[x];
+	}
+	qsort(current, number_of_current, sizeof(thread_ticks), compare_thread_pids);
+	free(previous_ticks);
+	previous_ticks = current;
+	number_of_previous_ticks = number_of_current;
+	return 0;
+}
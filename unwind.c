@@ -1,5 +1,5 @@
 /*
- * Program to unwind the stack frames of a x86_64 process using libunwind
+ * Unwinder backends for lsstack64: frame pointers, libunwind and stack snapshots
  *
  * Author: Arun Prakash Jana <engineerarun@gmail.com>
  * Copyright (C) 2014, 2015 by Arun Prakash Jana <engineerarun@gmail.com>
@@ -8,12 +8,12 @@
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation, either version 3 of the License, or
  * (at your option) any later version.
- * 
+ *
  * This program is distributed in the hope that it will be useful,
  * but WITHOUT ANY WARRANTY; without even the implied warranty of
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU General Public License
  * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
  */
@@ -25,229 +25,485 @@
 #include <libunwind.h>
 #include <libunwind-ptrace.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <sys/ptrace.h>
 
 #include "log.h"
+#include "lsstack.h"
+#include "stats.h"
 
-#define WAIT_TIME 1000
-#define MAX_STACK_DEPTH 32
+/* The snapshot unwinder copies this much of the stack in one read. Anything
+   above it is still read from the target, one word at a time. */
+#define SNAPSHOT_STACK_SIZE (128 * 1024)
 
-int current_log_level = DEBUG;
+static const char *unwinder_names[] = { "fp", "libunwind", "snapshot", "auto", NULL };
 
-int process_stack(pid_t PID)
+int find_unwinder(const char *name)
 {
-	unw_addr_space_t addrspace;
-	struct UPT_info *uptinfo = NULL;
-	unw_proc_info_t procinfo;
-	unw_cursor_t cursor;
-	unw_word_t RIP, RSP, RBP, offset;
-
-	int ret = 0, step = 0;
-	int wait_loops = 20;
-	int waitstatus;
-	int stopped = 0;
-	char procname[512] = {0};
-	size_t len;
-
-	FILE* fp;
-	char psbuf[64];
-	pid_t MID = -1; /* Main thread ID */
-
-	/* Create address space for little endian */
-	addrspace = unw_create_addr_space(&_UPT_accessors, 0);
-	if (!addrspace) {
-		log(ERROR, "unw_create_addr_space failed\n");
-		return -1;
+	int x;
+	for (x = 0; unwinder_names[x]; x++) {
+		if (0 == strcmp(name, unwinder_names[x])) {
+			return x;
+		}
 	}
+	return -1;
+}
 
-	/* Check if this is the main thread or a child thread.
-	   If child thread, we need to stop main thread as well. */
-	sprintf(psbuf, "%s %d %s", "ps -aeLf | grep -w", PID, "| awk '{ print $2, $4 }'");
-
-	fp = popen(psbuf, "r");
-	if (fp) {
-		char pid[16] = {0};
-		char lwp[16] = {0}; /* LWP: Light Weight Process. LWP == PID for main thread. */
-		int i, j;
-		while (fgets(psbuf, sizeof(psbuf) - 1, fp) != NULL) {
-			for (i = 0; psbuf[i] != '\n' && psbuf[i] != '\0'; i++) {
-				if (psbuf[i] == ' ')
-					break;
-				else
-					pid[i] = psbuf[i];
-			}
-
-			pid[++i] = '\0';
-			j = 0;
-
-			for (; psbuf[i] != '\n' && psbuf[i] != '\0'; i++)
-				lwp[j++] = psbuf[i];
+static int add_unwound_frame(thread_stack *ts, unw_cursor_t *cursor)
+{
+	unw_word_t RIP, RSP, RBP;
+	stack_frame *frame = NULL;
 
-			lwp[j] = '\0';
+	if (unw_get_reg(cursor, UNW_X86_64_RIP, &RIP) < 0 || unw_get_reg(cursor, UNW_X86_64_RSP, &RSP) < 0
+			|| unw_get_reg(cursor, UNW_X86_64_RBP, &RBP) < 0) {
+		log(ERROR, "unw_get_reg RIP/RSP/RBP failed\n");
+		return EIO;
+	}
+	frame = thread_stack_add_frame(ts);
+	if (NULL == frame) {
+		return ENOMEM;
+	}
+	frame->pc = RIP;
+	frame->sp = RSP;
+	frame->bp = RBP;
+	frame->number_of_arguments = -1;
+	return 0;
+}
 
-			log(DEBUG, "From ps: pid [%s] lwp [%s]\n", pid, lwp);
+/* Step the cursor up to the outermost frame, recording each one */
+static TARGET_ADDRESS unwind_cursor(thread_stack *ts, unw_cursor_t *cursor)
+{
+	int ret = 0;
 
-			if (pid[0] && lwp[0]) {
-				if (PID == atoi(lwp)) {
-					if (strcmp(lwp, pid) == 0) {
-						log(DEBUG, "This is the main thread.\n\n\n");
-						break;
-					} else {
-						MID = atoi(pid);
-						log(DEBUG, "This is a child thread of main thread %d.\n\n\n", MID);
-						break;
-					}
-				}
-			}
+	do {
+		ret = add_unwound_frame(ts, cursor);
+		if (ret) {
+			return ret;
 		}
+		ret = unw_step(cursor);
+		if (ret == 0) {
+			log(DEBUG, "Last frame reached\n");
+			ts->reached_top = 1;
+			return 0;
+		} else if (ret < 0) {
+			log(DEBUG, "unw_step failed. ret: %d\n", ret);
+			return EIO;
+		}
+	} while (ts->number_of_frames < MAX_STACK_DEPTH);
 
-		pclose(fp);
-	} else {
-		log(ERROR, "popen failed. errno: %d (%s)\n", errno, strerror(errno));
-	}
+	log(ERROR, "Too deeply nested. Breaking out.\n");
+	return 0;
+}
 
-	if (MID != -1) {
-		ret = ptrace(PTRACE_ATTACH, MID, NULL, NULL);
-		if (0 != ret && 0 != errno) {
-			log(ERROR, "ptrace failed. errno: %d (%s)\n", errno, strerror(errno));
-			unw_destroy_addr_space(addrspace);
-			return -1;
-		}
+/* libunwind remote backend. Every memory and register access is a ptrace()
+   on the thread, which is slow but needs nothing from us. Memory reads are
+   passed on to a -R recording like any other. */
 
-		while (wait_loops-- > 0) {
-			ret = waitpid(MID, &waitstatus, WUNTRACED | WNOHANG);
-			if (WIFSTOPPED(waitstatus)) {
-				stopped = 1;
-				break;
-			}
-			usleep(WAIT_TIME);
-		}
+static unw_addr_space_t remote_addrspace = NULL;
+static unw_accessors_t remote_accessors;
+static int remote_pid = 0;
 
-		if (!stopped) {
-			log(ERROR, "Main thread of process %d couldn't be stopped\n", MID);
-			ret = -1;
-			goto bail;
-		}
+static int remote_access_mem(unw_addr_space_t as, unw_word_t addr, unw_word_t *valp, int write, void *arg)
+{
+	int ret = _UPT_access_mem(as, addr, valp, write, arg);
+	if (0 == ret && !write) {
+		record_target_read((char*)valp, sizeof(*valp), addr);
 	}
+	return ret;
+}
 
-        ret = ptrace(PTRACE_ATTACH, PID, NULL, NULL);
-        if (0 != ret && 0 != errno) {
-		log(ERROR, "ptrace failed. errno: %d (%s)\n", errno, strerror(errno));
-		if (MID != -1)
-			ptrace(PTRACE_DETACH, MID, NULL, NULL);
-		unw_destroy_addr_space(addrspace);
-		return -1;
-        }
-
-	while (wait_loops-- > 0) {
-		ret = waitpid(PID, &waitstatus, WUNTRACED | WNOHANG);
-		if (WIFSTOPPED(waitstatus)) {
-			stopped = 1;
-			break;
+static TARGET_ADDRESS unwind_libunwind_stack(thread_stack *ts, process_info *pi, int thepid)
+{
+	unw_cursor_t cursor;
+	void *uptinfo = NULL;
+	TARGET_ADDRESS ret = 0;
+
+	ts->pid = thepid;
+	if (!remote_addrspace) {
+		/* Create address space for little endian */
+		remote_accessors = _UPT_accessors;
+		remote_accessors.access_mem = remote_access_mem;
+		remote_addrspace = unw_create_addr_space(&remote_accessors, 0);
+		if (!remote_addrspace) {
+			log(ERROR, "unw_create_addr_space failed\n");
+			return EIO;
 		}
-		usleep(WAIT_TIME);
+		unw_set_caching_policy(remote_addrspace, UNW_CACHE_GLOBAL);
 	}
-
-	if (!stopped) {
-		log(ERROR, "Process %d couldn't be stopped\n", PID);
-		ret = -1;
-		goto bail;
+	if (remote_pid != pi->pid) {
+		unw_flush_cache(remote_addrspace, 0, 0);
+		remote_pid = pi->pid;
 	}
 
-	uptinfo = (struct UPT_info *)_UPT_create(PID);
+	uptinfo = _UPT_create(thepid);
 	if (!uptinfo) {
 		log(ERROR, "_UPT_create failed\n");
-		ret = -1;
-		goto bail;
+		return EIO;
+	}
+	if (is_recording()) {
+		/* libunwind reads them one at a time; a replay wants the set */
+		struct user_regs_struct regs;
+		read_target_registers(&regs, pi, thepid);
 	}
 
-	ret = unw_init_remote(&cursor, addrspace, (void *)uptinfo);
-	if (ret < 0) {
+	if (unw_init_remote(&cursor, remote_addrspace, uptinfo) < 0) {
 		log(ERROR, "unw_init_remote failed\n");
-		goto bail;
+		_UPT_destroy(uptinfo);
+		return EIO;
 	}
 
-	do {
-		log(INFO, "STACK FRAME %d\n", step);
+	ret = unwind_cursor(ts, &cursor);
+	_UPT_destroy(uptinfo);
+	return ret;
+}
 
-		if (unw_get_reg(&cursor, UNW_X86_64_RIP, &RIP) < 0 || unw_get_reg(&cursor, UNW_X86_64_RSP, &RSP) < 0
-				|| unw_get_reg(&cursor, UNW_X86_64_RBP, &RBP) < 0) {
-			log(ERROR, "unw_get_reg RIP/RSP/RBP failed\n");
-			ret = -1;
-			goto bail;
-		}
+/* Snapshot backend. The registers and the top of the stack are copied once,
+   then libunwind runs against the copy. Only unwind table lookups still go to
+   the target. The registers don't have to be the thread's current ones, so
+   the auto backend can start it from any frame the FP walk found.
+ */
+
+typedef struct _stack_snapshot {
+	process_info *pi;
+	struct user_regs_struct regs;
+	TARGET_ADDRESS stack_start;
+	size_t stack_size;
+} stack_snapshot;
+
+static char snapshot_stack[SNAPSHOT_STACK_SIZE];
+static stack_snapshot *current_snapshot = NULL;
+static unw_addr_space_t snapshot_addrspace = NULL;
+static unw_accessors_t snapshot_accessors;
+static void *snapshot_uptinfo = NULL;
+static int snapshot_pid = 0;
+
+static int snapshot_access_mem(unw_addr_space_t as, unw_word_t addr, unw_word_t *valp, int write, void *arg)
+{
+	stack_snapshot *ss = current_snapshot;
+	TARGET_ADDRESS value = 0;
 
-		procname[0] = '\0';
-		unw_get_proc_name (&cursor, procname, sizeof(procname), &offset);
-		if (offset) {
-			len = strlen(procname);
-			if (len >= sizeof(procname) - 32)
-				len = sizeof(procname) - 32;
-			sprintf((char *)(procname + len), "+0x%016lx", (unsigned long)offset);
+	(void)as;
+	(void)arg;
+	if (write) {
+		return -UNW_EINVAL;
+	}
+	if (addr >= ss->stack_start && addr + sizeof(unw_word_t) <= ss->stack_start + ss->stack_size) {
+		memcpy(valp, snapshot_stack + (addr - ss->stack_start), sizeof(unw_word_t));
+		return 0;
+	}
+	if (read_target_word(&value, ss->pi, addr)) {
+		return -UNW_EINVAL;
+	}
+	*valp = value;
+	return 0;
+}
+
+static int snapshot_access_reg(unw_addr_space_t as, unw_regnum_t reg, unw_word_t *valp, int write, void *arg)
+{
+	struct user_regs_struct *regs = &current_snapshot->regs;
+	unsigned long long *slot = NULL;
+
+	(void)as;
+	(void)arg;
+	switch (reg) {
+		case UNW_X86_64_RAX: slot = &regs->rax; break;
+		case UNW_X86_64_RDX: slot = &regs->rdx; break;
+		case UNW_X86_64_RCX: slot = &regs->rcx; break;
+		case UNW_X86_64_RBX: slot = &regs->rbx; break;
+		case UNW_X86_64_RSI: slot = &regs->rsi; break;
+		case UNW_X86_64_RDI: slot = &regs->rdi; break;
+		case UNW_X86_64_RBP: slot = &regs->rbp; break;
+		case UNW_X86_64_RSP: slot = &regs->rsp; break;
+		case UNW_X86_64_R8: slot = &regs->r8; break;
+		case UNW_X86_64_R9: slot = &regs->r9; break;
+		case UNW_X86_64_R10: slot = &regs->r10; break;
+		case UNW_X86_64_R11: slot = &regs->r11; break;
+		case UNW_X86_64_R12: slot = &regs->r12; break;
+		case UNW_X86_64_R13: slot = &regs->r13; break;
+		case UNW_X86_64_R14: slot = &regs->r14; break;
+		case UNW_X86_64_R15: slot = &regs->r15; break;
+		case UNW_X86_64_RIP: slot = &regs->rip; break;
+		default:
+			return -UNW_EBADREG;
+	}
+	if (write) {
+		*slot = *valp;
+	} else {
+		*valp = *slot;
+	}
+	return 0;
+}
+
+static TARGET_ADDRESS unwind_from_registers(thread_stack *ts, process_info *pi, struct user_regs_struct *regs)
+{
+	stack_snapshot ss;
+	unw_cursor_t cursor;
+	memory_map *map = NULL;
+	TARGET_ADDRESS ret = 0;
+
+	if (!snapshot_addrspace) {
+		/* Unwind tables are found the _UPT way, everything else comes from the snapshot */
+		snapshot_accessors = _UPT_accessors;
+		snapshot_accessors.access_mem = snapshot_access_mem;
+		snapshot_accessors.access_reg = snapshot_access_reg;
+		snapshot_addrspace = unw_create_addr_space(&snapshot_accessors, 0);
+		if (!snapshot_addrspace) {
+			log(ERROR, "unw_create_addr_space failed\n");
+			return EIO;
 		}
-		log(INFO, "RIP = 0x%016lx %-32s\n", RIP, procname);
-		log(INFO, "RSP = 0x%016lx RBP = 0x%016lx\n", RSP, RBP);
+		unw_set_caching_policy(snapshot_addrspace, UNW_CACHE_GLOBAL);
+	}
+	if (snapshot_pid != pi->pid) {
+		if (snapshot_uptinfo) {
+			_UPT_destroy(snapshot_uptinfo);
+		}
+		unw_flush_cache(snapshot_addrspace, 0, 0);
+		snapshot_uptinfo = _UPT_create(pi->pid);
+		if (!snapshot_uptinfo) {
+			log(ERROR, "_UPT_create failed\n");
+			snapshot_pid = 0;
+			return EIO;
+		}
+		snapshot_pid = pi->pid;
+	}
 
-		ret = unw_get_proc_info (&cursor, &procinfo);
-		if (ret < 0) {
-			log(ERROR, "unw_get_proc_info failed. ret: %d\n", ret);
-			goto bail;
+	ss.pi = pi;
+	ss.regs = *regs;
+	ss.stack_start = regs->rsp;
+	ss.stack_size = 0;
+	map = find_memory_map(pi, regs->rsp);
+	if (NULL != map) {
+		ss.stack_size = map->end - regs->rsp;
+		if (ss.stack_size > SNAPSHOT_STACK_SIZE) {
+			ss.stack_size = SNAPSHOT_STACK_SIZE;
 		}
+		if (read_target_block(snapshot_stack, ss.stack_size, pi, ss.stack_start)) {
+			log(DEBUG, "Failed to copy stack at 0x%lx, reading it word by word\n", ss.stack_start);
+			ss.stack_size = 0;
+		}
+	}
 
-		log(INFO, "frame range = (0x%016lx <-> 0x%016lx)\n", procinfo.start_ip, procinfo.end_ip);
-		log(INFO, "handler = %0lx lsda = %0lx\n\n\n", procinfo.handler, procinfo.lsda);
+	current_snapshot = &ss;
+	if (unw_init_remote(&cursor, snapshot_addrspace, snapshot_uptinfo) < 0) {
+		log(DEBUG, "unw_init_remote failed\n");
+		ret = EIO;
+	} else {
+		ret = unwind_cursor(ts, &cursor);
+	}
+	current_snapshot = NULL;
+	return ret;
+}
 
-		ret = unw_step(&cursor);
-		if (ret == 0) {
-			log(DEBUG, "Last frame reached\n");
-			goto bail;
-		} else if (ret < 0) {
-			log(ERROR, "unw_step failed. ret: %d\n", ret);
-			goto bail;
-		} else if (++step > MAX_STACK_DEPTH) {
-			log(ERROR, "Too deeply nested. Breaking out.\n");
-			ret = -1;
-			goto bail;
-		}
-	} while (ret > 0);
+static TARGET_ADDRESS unwind_snapshot_stack(thread_stack *ts, process_info *pi, int thepid)
+{
+	struct user_regs_struct regs;
+	TARGET_ADDRESS ret = 0;
+
+	ts->pid = thepid;
+	/* Without the maps we can't size the copy, but the unwind still works */
+	grok_memory_maps(pi);
+	ret = read_target_registers(&regs, pi, thepid);
+	if (ret) {
+		log(DEBUG, "Failed to read registers from target: %s\n", strerror(ret));
+		return ret;
+	}
+	return unwind_from_registers(ts, pi, &regs);
+}
 
-	ret = 0;
+/* Auto backend. Modules are frame-pointer walked until one of them breaks the
+   chain, after which that module is remembered as needing unwind tables. The
+   memory survives across -p iterations, so the expensive unwind is only paid
+   for from the first frame that needs it.
+ */
 
-bail:
-	if (uptinfo)
-		_UPT_destroy(uptinfo);
-	ptrace(PTRACE_DETACH, PID, NULL, NULL);
-	if (MID != -1)
-		ptrace(PTRACE_DETACH, MID, NULL, NULL);
-	unw_destroy_addr_space(addrspace);
+#define STRATEGY_UNKNOWN 0
+#define STRATEGY_FP 1
+#define STRATEGY_TABLE 2
 
-	return ret;
+typedef struct _module_strategy {
+	char *path;
+	int strategy;
+} module_strategy;
+
+static module_strategy *module_strategies = NULL;
+static int number_of_module_strategies = 0;
+static int module_strategies_size = 0;
+
+static module_strategy *find_module_strategy(const char *path)
+{
+	int x;
+	for (x = 0; x < number_of_module_strategies; x++) {
+		if (0 == strcmp(module_strategies[x].path, path)) {
+			return &module_strategies[x];
+		}
+	}
+	if (number_of_module_strategies == module_strategies_size) {
+		int size = module_strategies_size ? module_strategies_size * 2 : 16;
+		module_strategy *temp = (module_strategy*) realloc(module_strategies, size * sizeof(module_strategy));
+		if (NULL == temp) {
+			return NULL;
+		}
+		module_strategies = temp;
+		module_strategies_size = size;
+	}
+	module_strategies[number_of_module_strategies].path = strdup(path);
+	if (NULL == module_strategies[number_of_module_strategies].path) {
+		return NULL;
+	}
+	module_strategies[number_of_module_strategies].strategy = STRATEGY_UNKNOWN;
+	return &module_strategies[number_of_module_strategies++];
 }
 
-int main(int argc, char **argv)
+/* Returns -1 for addresses outside any executable mapping */
+static int get_strategy(process_info *pi, TARGET_ADDRESS pc)
 {
-	pid_t PID = 1;
+	memory_map *map = find_memory_map(pi, pc);
+	module_strategy *ms = NULL;
 
-	if (argc !=2) {
-		fprintf(stderr, "Usage: unwind PID\n");
+	if (NULL == map || !map->executable) {
 		return -1;
 	}
+	/* Anonymous code (JIT) has no unwind tables to fall back to */
+	if ('\0' == map->path[0]) {
+		return STRATEGY_FP;
+	}
+	ms = find_module_strategy(map->path);
+	return ms ? ms->strategy : STRATEGY_UNKNOWN;
+}
 
-	if ((PID = atoi(argv[1])) <= 0) {
-		fprintf(stderr, "Valid PID please!\n");
-		return -1;
+static void set_strategy(process_info *pi, TARGET_ADDRESS pc, int strategy)
+{
+	memory_map *map = find_memory_map(pi, pc);
+	module_strategy *ms = NULL;
+
+	if (NULL == map || '\0' == map->path[0]) {
+		return;
+	}
+	ms = find_module_strategy(map->path);
+	if (NULL == ms || ms->strategy == strategy || STRATEGY_TABLE == ms->strategy) {
+		return;
 	}
+	log(DEBUG, "Using %s unwinding for %s\n", STRATEGY_TABLE == strategy ? "table-driven" : "frame pointer", map->path);
+	ms->strategy = strategy;
+}
 
-	if (kill(PID, 0) == 0)
-		log(INFO, "Tracing PID: %d\n\n", PID);
-	else {
-		log(ERROR, "kill failed. errno: %d (%s)\n", errno, strerror(errno));
-		return -1;
+static TARGET_ADDRESS unwind_auto_stack(thread_stack *ts, process_info *pi, int thepid)
+{
+	thread_stack fp;
+	thread_stack table;
+	struct user_regs_struct regs;
+	TARGET_ADDRESS walk = 0;
+	TARGET_ADDRESS ret = 0;
+	int split = -1;
+	int walked = 0;
+	int x;
+
+	memset(&fp, 0, sizeof(fp));
+	memset(&table, 0, sizeof(table));
+	fp.pid = thepid;
+	table.pid = thepid;
+
+	if (grok_memory_maps(pi)) {
+		return grok_thread_stack(ts, pi, thepid);
+	}
+	ret = read_target_registers(&regs, pi, thepid);
+	if (ret) {
+		log(DEBUG, "Failed to read registers from target: %s\n", strerror(ret));
+		return ret;
 	}
 
-	if (process_stack(PID) != 0)
-		log(ERROR, "Process stack printing failed\n");
+	if (STRATEGY_TABLE == get_strategy(pi, regs.rip)) {
+		split = 0;
+	} else {
+		walk = grok_thread_stack(&fp, pi, thepid);
+		walked = 1;
+		for (x = 0; x < fp.number_of_frames; x++) {
+			int strategy = get_strategy(pi, fp.frames[x].pc);
+			if (strategy < 0 && x > 0) {
+				/* The function before didn't keep a frame pointer, so this frame is junk */
+				split = x - 1;
+				set_strategy(pi, fp.frames[split].pc, STRATEGY_TABLE);
+				break;
+			}
+			if (STRATEGY_TABLE == strategy) {
+				split = x;
+				break;
+			}
+		}
+		if (split < 0 && !fp.reached_top) {
+			/* The chain ended in the last function we found */
+			split = fp.number_of_frames ? fp.number_of_frames - 1 : 0;
+			set_strategy(pi, split < fp.number_of_frames ? fp.frames[split].pc : regs.rip, STRATEGY_TABLE);
+		}
+		if (split < 0) {
+			for (x = 0; x < fp.number_of_frames; x++) {
+				set_strategy(pi, fp.frames[x].pc, STRATEGY_FP);
+			}
+			*ts = fp;
+			return walk;
+		}
+		if (split < fp.number_of_frames) {
+			regs.rip = fp.frames[split].pc;
+			regs.rsp = fp.frames[split].sp;
+			regs.rbp = fp.frames[split].bp;
+		}
+	}
 
-	return 0;
+	ret = unwind_from_registers(&table, pi, &regs);
+	if (0 == table.number_of_frames || (!table.reached_top && table.number_of_frames <= fp.number_of_frames - split)) {
+		/* Tables did no better, keep what the frame pointers gave us */
+		if (!walked) {
+			walk = grok_thread_stack(&fp, pi, thepid);
+		}
+		*ts = fp;
+		return walk;
+	}
+
+	fp.number_of_frames = split;
+	for (x = 0; x < table.number_of_frames; x++) {
+		stack_frame *frame = thread_stack_add_frame(&fp);
+		if (NULL == frame) {
+			return ENOMEM;
+		}
+		*frame = table.frames[x];
+	}
+	fp.reached_top = table.reached_top;
+	*ts = fp;
+	return ret;
+}
+
+TARGET_ADDRESS unwind_thread_stack(thread_stack *ts, process_info *pi, int thepid, int unwinder)
+{
+	struct timespec start;
+	TARGET_ADDRESS ret = 0;
+
+	start_timer(&start);
+	switch (unwinder) {
+		case UNWINDER_FP:
+			ret = grok_thread_stack(ts, pi, thepid);
+			break;
+		case UNWINDER_LIBUNWIND:
+			ret = unwind_libunwind_stack(ts, pi, thepid);
+			break;
+		case UNWINDER_SNAPSHOT:
+			ret = unwind_snapshot_stack(ts, pi, thepid);
+			break;
+		default:
+			ret = unwind_auto_stack(ts, pi, thepid);
+			break;
+	}
+	stop_timer(&start, STATS_WALK);
+	count_thread_frames(ts->number_of_frames);
+	return ret;
+}
+
+/* A process replaced its image (exec) under the same pid, so nothing cached
+   for that pid describes it any more */
+void unwind_forget_process(int pid)
+{
+	if (remote_pid == pid) {
+		remote_pid = 0;
+	}
+	if (snapshot_pid == pid) {
+		snapshot_pid = 0;
+	}
 }
@@ -0,0 +1,160 @@
+/*
+ * Stack high-water marks: how deep each thread's stack has ever been, from
+ * the pages the kernel has mapped for it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lsstack64.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "lsstack.h"
+#include "stats.h"
+
+/* A stack grows down from the end of its mapping, and a page of it is only
+   backed once something has been written there. The lowest page ever backed
+   is therefore as deep as the stack has been (unless the thread gave pages
+   back with madvise, which glibc only does to stacks of exited threads). The
+   mapping is the one the stack pointer is in; for threads created by glibc
+   its top also holds the thread's TLS and descriptor, which are counted as
+   used.
+
+   /proc/<pid>/pagemap gives one word per page, with bit 63 set when the page
+   is present and bit 62 when it is swapped out, for the whole stack in one
+   read. Where pagemap can't be read, the stack is read from the bottom up,
+   in bulk, to the first word that isn't zero. That misses memory written
+   with zeros, and reading maps the shared zero page into the untouched part,
+   which pagemap counts as present from then on. */
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+
+/* Bytes read at a time by the zero scan */
+#define ZERO_SCAN_CHUNK (64 * 1024)
+
+static const char *usage_method_names[] = { "none", "pagemap", "zero scan" };
+
+/* Stack usage helper functions */
+
+/* The lowest page of [start, end) that has ever been touched, or 0 */
+static int grok_pagemap_low_water(int pid, TARGET_ADDRESS start, TARGET_ADDRESS end, TARGET_ADDRESS *lowest)
+{
+	char file_name[64];
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t number_of_pages = (end - start) / page_size;
+	unsigned long long *entries = NULL;
+	ssize_t count;
+	size_t x;
+	int fd;
+
+	sprintf(file_name, "/proc/%d/pagemap", pid);
+	fd = open(file_name, O_RDONLY);
+	if (fd < 0) {
+		return errno;
+	}
+	entries = (unsigned long long*) malloc(number_of_pages * sizeof(*entries));
+	if (NULL == entries) {
+		close(fd);
+		return ENOMEM;
+	}
+	count = pread(fd, entries, number_of_pages * sizeof(*entries), (start / page_size) * sizeof(*entries));
+	close(fd);
+	if (count != (ssize_t)(number_of_pages * sizeof(*entries))) {
+		free(entries);
+		return count < 0 ? errno : EIO;
+	}
+	count_bytes_read(count);
+	*lowest = 0;
+	for (x = 0; x < number_of_pages; x++) {
+		if (entries[x] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) {
+			*lowest = start + x * page_size;
+			break;
+		}
+	}
+	free(entries);
+	return 0;
+}
+
+static int grok_zero_scan_low_water(int pid, TARGET_ADDRESS start, TARGET_ADDRESS end, TARGET_ADDRESS *lowest)
+{
+	static unsigned long chunk[ZERO_SCAN_CHUNK / sizeof(unsigned long)];
+	long page_size = sysconf(_SC_PAGESIZE);
+	TARGET_ADDRESS address;
+
+	*lowest = 0;
+	for (address = start; address < end; address += ZERO_SCAN_CHUNK) {
+		size_t length = end - address < ZERO_SCAN_CHUNK ? end - address : ZERO_SCAN_CHUNK;
+		struct iovec local = { chunk, length };
+		struct iovec remote = { (void*)address, length };
+		size_t x;
+		if (process_vm_readv(pid, &local, 1, &remote, 1, 0) != (ssize_t)length) {
+			return errno ? errno : EIO;
+		}
+		count_bytes_read(length);
+		for (x = 0; x < length / sizeof(unsigned long); x++) {
+			if (chunk[x]) {
+				*lowest = (address + x * sizeof(unsigned long)) & ~(TARGET_ADDRESS)(page_size - 1);
+				return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/* End of stack usage helper functions */
+
+const char *stack_usage_method_name(int method)
+{
+	return usage_method_names[method];
+}
+
+/* How deep the stack holding sp is now and has ever been. The memory maps
+   must be current enough to hold the stack's mapping. */
+int grok_stack_usage(stack_usage *usage, process_info *pi, TARGET_ADDRESS sp)
+{
+	memory_map *map = find_memory_map(pi, sp);
+	TARGET_ADDRESS lowest = 0;
+
+	memset(usage, 0, sizeof(*usage));
+	if (NULL == map) {
+		return EFAULT;
+	}
+	usage->start = map->start;
+	usage->end = map->end;
+	usage->depth = map->end - sp;
+	if (0 == grok_pagemap_low_water(pi->pid, map->start, map->end, &lowest) && lowest) {
+		usage->method = STACK_USAGE_PAGEMAP;
+	} else if (0 == grok_zero_scan_low_water(pi->pid, map->start, sp, &lowest)) {
+		usage->method = STACK_USAGE_ZERO_SCAN;
+		if (0 == lowest) {
+			/* Nothing below the stack pointer was ever written */
+			lowest = sp;
+		}
+	} else {
+		/* At least as deep as it is now */
+		lowest = sp;
+	}
+	usage->peak_depth = map->end - lowest;
+	if (usage->peak_depth < usage->depth) {
+		usage->peak_depth = usage->depth;
+	}
+	return 0;
+}